@@ -13,8 +13,23 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <dirent.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/time.h>
+#include <linux/gpio.h>
+
+#include "protocol.h"
 
 #define SERVER_IP "192.168.0.14"   // <-- change to your server PC IP if needed
 #define PORT      8080
@@ -23,39 +38,191 @@
 #define ID_TEMP  "TEMP02"
 #define ID_BTN   "BUTTON01"
 #define ID_LED   "LED01"
+#define NUM_CHANNELS 4
 
-// ================= GPIO via pinctrl (Button & LED) =================
+// One logical sensor ID. A server that speaks "HELLO PROTO=" carries all
+// channels on one TCP session; an older server gets one connection per
+// channel as before. With BIN1 the server gives us a numeric handle and
+// we send compact binary frames instead of "ID:STATUS" text (see protocol.h).
+struct channel {
+    const char *id;
+    int         sock;     // -1 until accepted
+    int         binary;
+    uint32_t    handle;
+    unsigned long refused;  // samples dropped because the server denied this ID
+};
 
-// Control LED (1: ON, 0: OFF) on GPIO18
-void set_led(int state) {
-    if (state)
-        system("pinctrl set 18 op dh > /dev/null"); // GPIO18 High
-    else
-        system("pinctrl set 18 op dl > /dev/null"); // GPIO18 Low
+struct channel ch_arm  = {ID_ARM,  -1, 0, 0};
+struct channel ch_temp = {ID_TEMP, -1, 0, 0};
+struct channel ch_btn  = {ID_BTN,  -1, 0, 0};
+struct channel ch_led  = {ID_LED,  -1, 0, 0};
+struct channel *channels[NUM_CHANNELS] = {&ch_arm, &ch_temp, &ch_btn, &ch_led};
+
+// Several threads write to the same session; keep each message whole.
+// send_lock also guards the link state and the offline buffer below.
+pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+int use_binary = 1;   // ask for BIN1 unless started with -t
+const char *server_ip = SERVER_IP;   // -s to override
+
+// ================= GPIO backends (Button & LED) =================
+//
+// The button and LED go through a small backend table so the rest of the
+// client does not care where the pins live:
+//   - cdev: Linux gpiochip character device (GPIO uAPI v2). The button line
+//           is requested with both-edge interrupts, so an emergency press
+//           wakes the button thread immediately; the LED is a direct line
+//           write. No processes are spawned.
+//   - sim : in-process simulation for running the client on any Linux box.
+//           SIGUSR1 presses the button, SIGUSR2 releases it, and the LED
+//           state is just printed.
+
+#define BTN_PIN 17   // GPIO17, pull-down, high when pressed
+#define LED_PIN 18   // GPIO18
+
+struct gpio_backend {
+    const char *name;
+    int  (*init)(void);
+    int  (*read_button)(void);   // 1: pressed, 0: released
+    void (*set_led)(int on);
+    // Wait up to timeout_ms for a button edge. Returns 1 with the new
+    // level and a CLOCK_MONOTONIC timestamp, 0 on timeout, -1 on error.
+    int  (*wait_edge)(int timeout_ms, int *level, long long *ts_ns);
+};
+
+static long long mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-// Read button state (1: pressed, 0: not pressed) on GPIO17
-int read_btn() {
-    FILE *fp;
-    char output[256];
+// ---- cdev backend ----
 
-    fp = popen("pinctrl get 17", "r");
-    if (!fp) return 0;
+static const char *gpio_chip = "/dev/gpiochip0";   // -c to override
+static int cdev_btn_fd = -1, cdev_led_fd = -1;
 
-    if (fgets(output, sizeof(output), fp) != NULL) {
-        if (strstr(output, "hi") != NULL) { // "hi" means high level
-            pclose(fp);
-            return 1;
-        }
+// Request one line with the given flags and return its line fd.
+static int cdev_request(unsigned offset, uint64_t flags) {
+    int chip = open(gpio_chip, O_RDONLY | O_CLOEXEC);
+    if (chip < 0) {
+        perror("[WARN] open gpiochip");
+        return -1;
+    }
+
+    struct gpio_v2_line_request req;
+    memset(&req, 0, sizeof(req));
+    req.offsets[0] = offset;
+    req.num_lines = 1;
+    req.config.flags = flags;
+    strncpy(req.consumer, "factory-client", sizeof(req.consumer) - 1);
+
+    int ret = ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &req);
+    close(chip);
+    if (ret < 0) {
+        perror("[WARN] GPIO_V2_GET_LINE_IOCTL");
+        return -1;
     }
-    pclose(fp);
+    return req.fd;
+}
+
+static int cdev_init(void) {
+    cdev_btn_fd = cdev_request(BTN_PIN, GPIO_V2_LINE_FLAG_INPUT |
+                                        GPIO_V2_LINE_FLAG_EDGE_RISING |
+                                        GPIO_V2_LINE_FLAG_EDGE_FALLING |
+                                        GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN);
+    cdev_led_fd = cdev_request(LED_PIN, GPIO_V2_LINE_FLAG_OUTPUT);
+    return (cdev_btn_fd < 0 || cdev_led_fd < 0) ? -1 : 0;
+}
+
+static int cdev_read_button(void) {
+    struct gpio_v2_line_values v = {0, 1};
+    if (ioctl(cdev_btn_fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &v) < 0) return 0;
+    return v.bits & 1;
+}
+
+static void cdev_set_led(int on) {
+    struct gpio_v2_line_values v = {on ? 1 : 0, 1};
+    ioctl(cdev_led_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &v);
+}
+
+static int cdev_wait_edge(int timeout_ms, int *level, long long *ts_ns) {
+    struct pollfd pfd = {cdev_btn_fd, POLLIN, 0};
+    struct gpio_v2_line_event ev;
+
+    int r = poll(&pfd, 1, timeout_ms);
+    if (r <= 0) return (r < 0 && errno != EINTR) ? -1 : 0;
+    if (read(cdev_btn_fd, &ev, sizeof(ev)) != sizeof(ev)) return -1;
+    *level = (ev.id == GPIO_V2_LINE_EVENT_RISING_EDGE);
+    *ts_ns = ev.timestamp_ns;   // CLOCK_MONOTONIC by default
+    return 1;
+}
+
+// ---- sim backend ----
+
+struct sim_edge {
+    int       level;
+    long long ts_ns;
+};
+
+static int sim_pipe[2] = {-1, -1};
+static volatile sig_atomic_t sim_button = 0;
+
+static void sim_signal(int sig) {
+    struct sim_edge e;
+    e.level = (sig == SIGUSR1);
+    e.ts_ns = mono_ns();   // clock_gettime is async-signal-safe
+    sim_button = e.level;
+    write(sim_pipe[1], &e, sizeof(e));
+}
+
+static int sim_init(void) {
+    if (pipe(sim_pipe) < 0) return -1;
+    signal(SIGUSR1, sim_signal);
+    signal(SIGUSR2, sim_signal);
+    printf("[INFO] Simulated GPIO: kill -USR1 %d to press, -USR2 to release.\n",
+           getpid());
     return 0;
 }
 
-// Initialize GPIO for button/LED using pinctrl
-void init_gpio_shell() {
-    system("pinctrl set 18 op dl"); // LED OFF
-    system("pinctrl set 17 ip pd"); // Button input, pull-down
+static int sim_read_button(void) { return sim_button; }
+
+static void sim_set_led(int on) { printf("[SIM] LED %s\n", on ? "ON" : "OFF"); }
+
+static int sim_wait_edge(int timeout_ms, int *level, long long *ts_ns) {
+    struct pollfd pfd = {sim_pipe[0], POLLIN, 0};
+    struct sim_edge e;
+
+    int r = poll(&pfd, 1, timeout_ms);
+    if (r <= 0) return (r < 0 && errno != EINTR) ? -1 : 0;
+    if (read(sim_pipe[0], &e, sizeof(e)) != sizeof(e)) return -1;
+    *level = e.level;
+    *ts_ns = e.ts_ns;
+    return 1;
+}
+
+static const struct gpio_backend gpio_cdev = {
+    "cdev", cdev_init, cdev_read_button, cdev_set_led, cdev_wait_edge,
+};
+static const struct gpio_backend gpio_sim = {
+    "sim", sim_init, sim_read_button, sim_set_led, sim_wait_edge,
+};
+static const struct gpio_backend *gpio = &gpio_cdev;
+
+// Control LED (1: ON, 0: OFF)
+void set_led(int state) { gpio->set_led(state); }
+
+// Read button state (1: pressed, 0: not pressed)
+int read_btn() { return gpio->read_button(); }
+
+// Pick the backend; fall back to simulation when there is no gpiochip.
+void init_gpio(void) {
+    if (gpio->init() == 0) return;
+    if (gpio == &gpio_cdev) {
+        printf("[WARN] %s unavailable, using simulated GPIO.\n", gpio_chip);
+        gpio = &gpio_sim;
+        if (gpio->init() == 0) return;
+    }
+    printf("[FATAL] GPIO backend '%s' failed.\n", gpio->name);
+    exit(1);
 }
 
 // ================= DHT11 via kernel IIO driver =================
@@ -122,41 +289,69 @@ int find_dht11_device() {
 // or keeps last valid temperature, or -1000.0 if none yet.
 float read_temperature() {
     static float last_temp = -1000.0f;
+    static int temp_fd = -1;
+    static time_t next_probe = 0;
 
-    if (!dht11_found) {
-        if (find_dht11_device() != 0) {
+    if (temp_fd < 0) {
+        // Probe at most every 10 s so a missing sensor does not spam the log
+        if (time(NULL) < next_probe) return last_temp;
+        next_probe = time(NULL) + 10;
+
+        if (!dht11_found && find_dht11_device() != 0) {
             // DHT11 device not found; keep last temp
             return last_temp;
         }
-    }
 
-    char temp_path[256];
-    snprintf(temp_path, sizeof(temp_path),
-             "%s/in_temp_input", dht11_base_path);
-
-    FILE *fp = fopen(temp_path, "r");
-    if (!fp) {
-        printf("[WARN] Cannot open %s\n", temp_path);
-        return last_temp;
+        // Keep the attribute open; pread at offset 0 triggers a new reading
+        char temp_path[256];
+        snprintf(temp_path, sizeof(temp_path),
+                 "%s/in_temp_input", dht11_base_path);
+        temp_fd = open(temp_path, O_RDONLY | O_CLOEXEC);
+        if (temp_fd < 0) {
+            printf("[WARN] Cannot open %s\n", temp_path);
+            return last_temp;
+        }
     }
 
-    long milli = 0;
-    if (fscanf(fp, "%ld", &milli) != 1) {
-        fclose(fp);
-        printf("[WARN] Failed to read temperature from %s\n", temp_path);
+    char buf[32];
+    ssize_t n = pread(temp_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) {
+        // The DHT11 driver returns EIO on a bad checksum; just retry later
+        printf("[WARN] Failed to read temperature\n");
         return last_temp;
     }
-    fclose(fp);
+    buf[n] = 0;
 
-    float temp_c = milli / 1000.0f;
+    float temp_c = strtol(buf, NULL, 10) / 1000.0f;
     last_temp = temp_c;
     return temp_c;
 }
 
 // ================= Networking Utilities =================
 
-// Connect to server and send "ID:Just Connected"
-int connect_to_server(const char *id) {
+// Read one '\n'-terminated line during the handshake (byte by byte, so
+// nothing after the reply is consumed before the receive thread starts).
+// Older servers send a bare "ACCEPTED"/"DENIED" without the newline, so
+// a verdict followed by a short silence also ends the reply.
+static int read_reply(int sock, char *buf, int size) {
+    int n = 0;
+    char ch;
+
+    while (n < size - 1 && read(sock, &ch, 1) == 1) {
+        if (ch == '\n') break;
+        buf[n++] = ch;
+        buf[n] = 0;
+        if (strcmp(buf, "ACCEPTED") == 0 || strcmp(buf, "DENIED") == 0) {
+            struct pollfd pfd = {sock, POLLIN, 0};
+            if (poll(&pfd, 1, 50) == 0) break;
+        }
+    }
+    buf[n] = 0;
+    return n;
+}
+
+// Open a TCP connection to the server.
+static int connect_socket(void) {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
         perror("[ERROR] socket");
@@ -168,7 +363,7 @@ int connect_to_server(const char *id) {
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_port   = htons(PORT);
 
-    if (inet_pton(AF_INET, SERVER_IP, &serv_addr.sin_addr) <= 0) {
+    if (inet_pton(AF_INET, server_ip, &serv_addr.sin_addr) <= 0) {
         printf("[ERROR] Invalid SERVER_IP\n");
         close(sock);
         return -1;
@@ -179,182 +374,871 @@ int connect_to_server(const char *id) {
         close(sock);
         return -1;
     }
+    return sock;
+}
+
+// Write all of buf. MSG_NOSIGNAL: a dead server must not kill us with
+// SIGPIPE; the failure is handled as a link drop instead.
+static int send_all(int sock, const void *buf, int len) {
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void send_raw(int sock, const void *buf, int len) {
+    pthread_mutex_lock(&send_lock);
+    send_all(sock, buf, len);
+    pthread_mutex_unlock(&send_lock);
+}
 
+// Introduce one channel on sock and wait for the verdict.
+// We offer BIN1 (or TEXT with -t) with "ID:HELLO PROTO=..."; on a session
+// that already switched to BIN1 the hello is a BIN_HELLO frame instead.
+// Returns 1 if the server answered "ACCEPTED PROTO=... HANDLE=<n>" (it
+// multiplexes), 0 for a plain "ACCEPTED" (older server), -1 if denied.
+static int say_hello(struct channel *ch, int sock, int session_binary) {
     char msg[256];
-    snprintf(msg, sizeof(msg), "%s:Just Connected", id);
-    write(sock, msg, strlen(msg));
-    printf("[INFO] Connected as %s\n", id);
+    int n;
 
-    return sock;
+    if (session_binary) {
+        n = bin_hello((uint8_t *)msg, sizeof(msg), ch->id);
+    } else {
+        n = snprintf(msg, sizeof(msg), "%s:%s%s\n", ch->id, PROTO_HELLO,
+                     use_binary ? PROTO_NAME : PROTO_TEXT);
+    }
+    if (n < 0) return -1;
+    send_raw(sock, msg, n);
+
+    // Wait briefly for the verdict so we know which format to send.
+    struct timeval tv = {2, 0}, no_tv = {0, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    read_reply(sock, msg, sizeof(msg));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &no_tv, sizeof(no_tv));
+
+    if (strncmp(msg, "DENIED", 6) == 0) {
+        printf("[ERROR] Server denied %s\n", ch->id);
+        return -1;
+    }
+    ch->binary = 0;
+    if (strncmp(msg, PROTO_ACCEPTED, strlen(PROTO_ACCEPTED)) != 0)
+        return 0;
+
+    const char *proto = msg + strlen(PROTO_ACCEPTED);
+    const char *handle = strstr(proto, "HANDLE=");
+    ch->binary = strncmp(proto, PROTO_NAME, strlen(PROTO_NAME)) == 0;
+    ch->handle = handle ? strtoul(handle + 7, NULL, 10) : 0;
+    return 1;
+}
+
+// Close the sockets of a half-connected round (no receive threads yet).
+static void close_channels(void) {
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        int sock = channels[i]->sock, seen = 0;
+        for (int j = 0; j < i; j++)
+            if (channels[j]->sock == sock) seen = 1;
+        if (sock >= 0 && !seen) close(sock);
+    }
+    for (int i = 0; i < NUM_CHANNELS; i++)
+        channels[i]->sock = -1;
+}
+
+// Connect every channel. The first accepted hello tells us whether the
+// server multiplexes; if so the remaining channels join the same session,
+// otherwise each one opens its own connection like before.
+// Returns how many channels were accepted; 0 if the server could not be
+// reached for all of them. A denied channel stays at sock -1.
+int connect_channels(void) {
+    int session = -1, session_binary = 0, connected = 0;
+
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        struct channel *ch = channels[i];
+        int sock = session;
+
+        // Unreachable: give up on the whole round so the link stays DOWN
+        // and samples keep buffering, rather than going UP with only some
+        // of the channels connected.
+        if (sock < 0 && (sock = connect_socket()) < 0) {
+            close_channels();
+            return 0;
+        }
+
+        int r = say_hello(ch, sock, sock == session && session_binary);
+        if (r < 0) {
+            // the server drops a connection whose first ID is denied
+            if (sock != session) close(sock);
+            continue;
+        }
+        ch->sock = sock;
+        connected++;
+        if (r == 1 && session < 0) {
+            session = sock;
+            session_binary = ch->binary;
+        }
+        printf("[INFO] Connected as %s (%s%s)\n", ch->id,
+               ch->binary ? PROTO_NAME : "text",
+               sock == session ? ", shared session" : "");
+    }
+    return connected;
 }
 
-// Send status in "ID:STATUS" format and log locally
-void send_status(int sock, const char *id, const char *status) {
-    if (sock < 0) return;
+// ================= Offline buffer & reconnect =================
+//
+// Samples are never written while the link is down. They go into a
+// bounded ring (the outbox) instead, and the link thread reconnects with
+// jittered exponential backoff and replays the ring in order, packing many
+// samples into each write. Only when the ring is empty does the link go
+// back to UP and samples are sent directly again, so nothing overtakes the
+// backlog. When the ring is full the oldest sample is dropped and counted.
+//
+// The ring normally lives in memory. With -o <file> it is an mmap'd file
+// instead, so samples taken while the server was away also survive a
+// client restart (they are replayed on the next connection).
+// Records hold the sample itself, not the encoded bytes: BIN1 handles are
+// handed out per session and can change on every reconnect.
+
+#define OUTBOX_MAGIC     0x4f424f58u   // "OBOX"
+#define OUTBOX_DEFAULT   4096          // records, -O to change
+#define OUTBOX_TEXT      64
+#define OUTBOX_NOTE      16
+#define REPLAY_BATCH     16384         // bytes per replay write
+#define BACKOFF_MIN_MS   500
+#define BACKOFF_MAX_MS   30000
+
+struct outbox_rec {
+    uint8_t  chan;                     // index into channels[]
+    uint8_t  mode, button, led;
+    uint16_t fields;
+    uint8_t  text_len, note_len;
+    float    temp;
+    char     text[OUTBOX_TEXT];
+    char     note[OUTBOX_NOTE];
+};
+
+// Header at the start of the ring (and of the -o file). head and tail are
+// running counts; the record for count n sits in slot n % cap.
+struct outbox_hdr {
+    uint32_t magic, rec_size, cap, pad;
+    uint64_t head, tail, dropped;
+};
+
+enum { LINK_DOWN, LINK_REPLAYING, LINK_UP };
+
+static struct outbox_hdr *outbox;
+static struct outbox_rec *outbox_recs;
+static const char *outbox_file = NULL;       // -o
+static unsigned outbox_cap = OUTBOX_DEFAULT; // -O
+static int link_state = LINK_DOWN;
+static pthread_cond_t link_cond = PTHREAD_COND_INITIALIZER;
+
+// Set up the ring. A file left by an earlier run with the same layout is
+// kept as it is; anything else is started over.
+int init_outbox(void) {
+    size_t size = sizeof(struct outbox_hdr) +
+                  (size_t)outbox_cap * sizeof(struct outbox_rec);
+    void *mem;
+
+    if (outbox_file) {
+        int fd = open(outbox_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror("[ERROR] outbox file");
+            return -1;
+        }
+        int fresh = (size_t)st.st_size != size;
+        if (fresh && ftruncate(fd, size) < 0) {
+            perror("[ERROR] outbox ftruncate");
+            close(fd);
+            return -1;
+        }
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            perror("[ERROR] outbox mmap");
+            return -1;
+        }
+        outbox = mem;
+        if (fresh || outbox->magic != OUTBOX_MAGIC || outbox->cap != outbox_cap ||
+            outbox->rec_size != sizeof(struct outbox_rec) ||
+            outbox->head - outbox->tail > outbox_cap)
+            memset(outbox, 0, sizeof(*outbox));
+    } else {
+        if ((mem = calloc(1, size)) == NULL) {
+            perror("[ERROR] outbox");
+            return -1;
+        }
+        outbox = mem;
+    }
+    outbox->magic    = OUTBOX_MAGIC;
+    outbox->rec_size = sizeof(struct outbox_rec);
+    outbox->cap      = outbox_cap;
+    outbox_recs      = (struct outbox_rec *)(outbox + 1);
+
+    printf("[INFO] Offline buffer: %u samples%s%s", outbox_cap,
+           outbox_file ? " in " : " in memory", outbox_file ? outbox_file : "");
+    if (outbox->head != outbox->tail)
+        printf(", %llu kept from last run",
+               (unsigned long long)(outbox->head - outbox->tail));
+    printf("\n");
+    return 0;
+}
+
+// Caller holds send_lock.
+static void outbox_push(struct channel *ch, const struct sample *s) {
+    struct outbox_rec *r;
+
+    if (outbox->head - outbox->tail == outbox->cap) {
+        outbox->tail++;   // full: the oldest sample makes room
+        outbox->dropped++;
+    }
+    r = &outbox_recs[outbox->head % outbox->cap];
+    memset(r, 0, sizeof(*r));
+    for (int i = 0; i < NUM_CHANNELS; i++)
+        if (channels[i] == ch) r->chan = i;
+    r->fields   = s->fields;
+    r->mode     = s->mode;
+    r->button   = s->button;
+    r->led      = s->led;
+    r->temp     = s->temp;
+    r->text_len = s->text_len < OUTBOX_TEXT ? s->text_len : OUTBOX_TEXT;
+    r->note_len = s->note_len < OUTBOX_NOTE ? s->note_len : OUTBOX_NOTE;
+    if (s->fields & SF_TEXT) memcpy(r->text, s->text, r->text_len);
+    if (s->fields & SF_NOTE) memcpy(r->note, s->note, r->note_len);
+    outbox->head++;
+}
+
+static void outbox_sample(const struct outbox_rec *r, struct sample *s) {
+    memset(s, 0, sizeof(*s));
+    s->fields   = r->fields;
+    s->mode     = r->mode;
+    s->button   = r->button;
+    s->led      = r->led;
+    s->temp     = r->temp;
+    s->text     = r->text;
+    s->text_len = r->text_len;
+    s->note     = r->note;
+    s->note_len = r->note_len;
+}
+
+// Caller holds send_lock. Ends every socket of the session; each receive
+// thread then sees EOF, closes its own fd and exits, and the link thread
+// starts reconnecting. Only acts if sock still belongs to a channel, so a
+// late EOF from an older session cannot take down a new one.
+static void link_down_locked(int sock) {
+    int current = 0;
+
+    for (int i = 0; i < NUM_CHANNELS; i++)
+        if (channels[i]->sock == sock) current = 1;
+    if (!current) return;
+
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        if (channels[i]->sock >= 0) shutdown(channels[i]->sock, SHUT_RDWR);
+        channels[i]->sock = -1;
+    }
+    if (link_state != LINK_DOWN)
+        printf("\n[LINK] Server connection lost, buffering samples.\n");
+    link_state = LINK_DOWN;
+    pthread_cond_broadcast(&link_cond);
+}
+
+// "ID:STATUS\n" for text channels, one BIN1 frame for binary ones.
+// Returns -1 if the whole message does not fit, never a cut-off one.
+static int encode_sample(const struct channel *ch, const struct sample *s,
+                         char *buf, int size) {
+    if (ch->binary)
+        return sample_to_bin((uint8_t *)buf, size, ch->handle, s);
+
+    int n = snprintf(buf, size, "%s:", ch->id);
+    if (n >= size - 1) return -1;
+
+    // sample_to_text clips at room - 1 characters, so a result that
+    // reaches it may have been cut short
+    int room = size - n - 1;   // keep one byte for the '\n'
+    int len = sample_to_text(buf + n, room, s);
+    if (len >= room - 1) return -1;
+    n += len;
+    buf[n++] = '\n';
+    return n;
+}
+
+// Send status in "ID:STATUS\n" format and log locally.
+// The server frames messages on '\n', so back-to-back sends that TCP
+// coalesces into one segment are still read as separate readings.
+// On a BIN1 channel the same sample goes out as one binary frame instead.
+// While the link is down or the backlog is still being replayed the
+// sample is queued in the outbox instead (see above). A sample for a
+// channel the server denied is dropped, counted and printed as such.
+void send_sample(struct channel *ch, const struct sample *s) {
+    char text[256], msg[512];
+    int queued = 0, refused = 0;
+
+    pthread_mutex_lock(&send_lock);
+    if (link_state == LINK_UP && outbox->head == outbox->tail) {
+        int n = encode_sample(ch, s, msg, sizeof(msg));
+        // a channel the server denied has nowhere to go
+        if (ch->sock < 0) {
+            ch->refused++;
+            refused = 1;
+        } else if (n > 0 && send_all(ch->sock, msg, n) < 0) {
+            link_down_locked(ch->sock);
+        }
+        if (link_state != LINK_UP) {
+            outbox_push(ch, s);
+            queued = 1;
+        }
+    } else {
+        outbox_push(ch, s);
+        queued = 1;
+    }
+    pthread_mutex_unlock(&send_lock);
+
+    sample_to_text(text, sizeof(text), s);
+    if (refused)
+        printf("[DROPPED][%s] %s (ID denied by the server)\n", ch->id, text);
+    else if (queued)
+        printf("[BUFFERED][%s] %s\n", ch->id, text);
+    else
+        printf("[SEND][%s] %s\n", ch->id, text);
+}
 
-    char msg[512];
-    snprintf(msg, sizeof(msg), "%s:%s", id, status);
-    write(sock, msg, strlen(msg));
+// Free-form status text ("System Started").
+void send_status(struct channel *ch, const char *status) {
+    struct sample s = {0};
 
-    printf("[SEND][%s] %s\n", id, status);
+    s.fields   = SF_TEXT;
+    s.text     = status;
+    s.text_len = strlen(status) < 200 ? strlen(status) : 200;
+    send_sample(ch, &s);
+}
+
+// "BUTTON:PRESSED (EMERGENCY)" / "LED:ON" style samples.
+void send_switch(struct channel *ch, int field, int on, const char *note) {
+    struct sample s = {0};
+
+    s.fields = field;
+    s.button = s.led = on;
+    if (note) {
+        s.fields  |= SF_NOTE;
+        s.note     = note;
+        s.note_len = strlen(note);
+    }
+    send_sample(ch, &s);
+}
+
+// Handle one line from the server.
+// Commands arrive as "ID:CMD:<corr>:<command>"; the ID says which channel
+// of a shared session they are for. We acknowledge right away on that
+// channel with "ID:ACK:<corr>" so the server can measure delivery latency,
+// then act on the command. Anything else (old-style bare commands) is
+// just printed and checked for RESET as before.
+void handle_server_line(int sock, const char *line) {
+    char id[32], ack[64];
+    unsigned corr;
+    int off = 0;
+    const char *command = line;
+
+    printf("\n[COMMAND RECEIVED] Server says: %s\n", line);
+
+    if (sscanf(line, "%31[^:]:CMD:%u:%n", id, &corr, &off) == 2 && off > 0) {
+        struct channel *ch = NULL;
+        for (int i = 0; i < NUM_CHANNELS; i++)
+            if (channels[i]->sock == sock && strcmp(channels[i]->id, id) == 0)
+                ch = channels[i];
+
+        if (ch && ch->binary) {
+            int n = bin_ack((uint8_t *)ack, ch->handle, corr);
+            send_raw(sock, ack, n);
+        } else {
+            snprintf(ack, sizeof(ack), "%s:ACK:%u\n", id, corr);
+            send_raw(sock, ack, strlen(ack));
+        }
+        command = line + off;
+    }
+
+    if (strstr(command, "RESET") != NULL) {
+        printf(">> RESET command detected! Rebooting system state...\n");
+        set_led(0); 
+        usleep(500000);
+        set_led(1);
+    }
 }
 
 void *recv_thread(void *arg) {
-    int sock = *(int *)arg;
-    char buffer[256];
+    int sock = (int)(intptr_t)arg;
+    char buffer[512];
+    int used = 0;
 
     while (1) {
-        int len = read(sock, buffer, sizeof(buffer) - 1);
+        int len = read(sock, buffer + used, sizeof(buffer) - 1 - used);
 
         if (len <= 0) {
-            printf("\n[FATAL] Server disconnected.\n");
-            kill(getpid(), SIGINT); 
-            break; 
+            pthread_mutex_lock(&send_lock);
+            link_down_locked(sock);
+            pthread_mutex_unlock(&send_lock);
+            close(sock);
+            break;
         }
 
-        buffer[len] = 0;
-        printf("\n[COMMAND RECEIVED] Server says: %s\n", buffer);
-
-        if (strstr(buffer, "RESET") != NULL) {
-            printf(">> RESET command detected! Rebooting system state...\n");
-            set_led(0); 
-            usleep(500000);
-            set_led(1);
+        // Split into '\n'-terminated lines; keep a partial line for later.
+        used += len;
+        buffer[used] = 0;
+        char *line = buffer, *nl;
+        while ((nl = strchr(line, '\n')) != NULL) {
+            *nl = 0;
+            if (nl > line && nl[-1] == '\r') nl[-1] = 0;
+            if (*line) handle_server_line(sock, line);
+            line = nl + 1;
+        }
+        used = strlen(line);
+        memmove(buffer, line, used + 1);
+        if (used == (int)sizeof(buffer) - 1) {  // overlong line
+            handle_server_line(sock, buffer);
+            used = 0;
         }
     }
     return NULL;
 }
 
-void cleanup_handler(int sig) {
-    printf("\n[SYSTEM] Cleaning up resources...\n");
-    set_led(0); // LED 끄기
-    printf("[SYSTEM] LED turned OFF.\n");
-    printf("[SYSTEM] Client terminated safely.\n");
-    exit(0);
+// One receive thread per distinct socket, so commands for every
+// channel are read, not just ARM01's.
+static void start_recv_threads(void) {
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        int sock = channels[i]->sock, seen = 0;
+        for (int j = 0; j < i; j++)
+            if (channels[j]->sock == sock) seen = 1;
+        if (sock < 0 || seen) continue;
+
+        pthread_t r_tid;
+        int ret = pthread_create(&r_tid, NULL, recv_thread, (void *)(intptr_t)sock);
+
+        if (ret != 0) {
+            perror("[ERROR] Failed to create receive thread");
+            continue;
+        }
+
+        pthread_detach(r_tid);
+    }
 }
 
-int main(void) {
-    signal(SIGINT, cleanup_handler);
+// Send the outbox in order, REPLAY_BATCH bytes per write. Samples taken
+// meanwhile keep queueing behind the backlog; the link only goes UP once
+// the ring is empty, under the same lock, so order is kept throughout.
+// A batch is removed from the ring only after its write went through.
+static void replay_outbox(void) {
+    static char batch[REPLAY_BATCH];
+    unsigned long long sent = 0, refused = 0;
 
-    printf("[INFO] Initializing GPIO (button & LED) via pinctrl...\n");
-    init_gpio_shell();
+    pthread_mutex_lock(&send_lock);
+    link_state = LINK_REPLAYING;
+    while (link_state == LINK_REPLAYING) {
+        uint64_t pos = outbox->tail;
+        int used = 0, sock = -1;
 
-    // Connect to the server with four logical IDs
-    int sock_arm  = connect_to_server(ID_ARM);
-    int sock_temp = connect_to_server(ID_TEMP);
-    int sock_btn  = connect_to_server(ID_BTN);
-    int sock_led  = connect_to_server(ID_LED);
+        if (pos == outbox->head) {
+            link_state = LINK_UP;
+            break;
+        }
+        // One socket per write: with an older server each channel has its own.
+        while (pos != outbox->head) {
+            const struct outbox_rec *r = &outbox_recs[pos % outbox->cap];
+            struct channel *ch = channels[r->chan < NUM_CHANNELS ? r->chan : 0];
+            struct sample smp;
+            int n;
 
-    if (sock_arm < 0 && sock_temp < 0 && sock_btn < 0 && sock_led < 0) {
-        printf("[FATAL] Failed to establish any connection.\n");
-        return 1;
+            if (ch->sock < 0) {   // denied this time: nowhere to send it
+                ch->refused++;
+                refused++;
+                pos++;
+                continue;
+            }
+            if (sock >= 0 && ch->sock != sock) break;
+            outbox_sample(r, &smp);
+            n = encode_sample(ch, &smp, batch + used, sizeof(batch) - used);
+            if (n < 0 && used > 0) break;   // batch full
+            sock = ch->sock;
+            if (n > 0) used += n;
+            pos++;
+        }
+        if (used > 0 && send_all(sock, batch, used) < 0) {
+            link_down_locked(sock);
+            break;
+        }
+        sent += pos - outbox->tail;
+        outbox->tail = pos;
+
+        // let live samples queue up between batches
+        pthread_mutex_unlock(&send_lock);
+        pthread_mutex_lock(&send_lock);
+    }
+    if (link_state == LINK_UP && sent > 0) {
+        printf("[LINK] Replayed %llu buffered samples", sent - refused);
+        if (refused) printf(", dropped %llu for denied IDs", refused);
+        printf(".\n");
     }
+    pthread_mutex_unlock(&send_lock);
+}
+
+// Keeps the server link up: waits while it is, otherwise reconnects with
+// exponential backoff (BACKOFF_MIN_MS doubling up to BACKOFF_MAX_MS) and
+// a random spread of half the delay, so a plant full of clients does not
+// reconnect in lockstep after a server restart.
+void *link_thread(void *arg) {
+    long delay_ms = BACKOFF_MIN_MS;
+    (void)arg;
+
+    srand(time(NULL) ^ getpid());
+    while (1) {
+        pthread_mutex_lock(&send_lock);
+        while (link_state != LINK_DOWN)
+            pthread_cond_wait(&link_cond, &send_lock);
+        pthread_mutex_unlock(&send_lock);
 
-    pthread_t r_tid;
-    int ret = pthread_create(&r_tid, NULL, recv_thread, (void *)&sock_arm);
-    
-    if (ret != 0) {
-        perror("[ERROR] Failed to create receive thread");
+        if (connect_channels() == 0) {
+            long wait_ms = delay_ms / 2 + rand() % (delay_ms / 2 + 1);
+
+            pthread_mutex_lock(&send_lock);
+            printf("[LINK] Server unreachable, retrying in %ld ms (%llu samples buffered)\n",
+                   wait_ms, (unsigned long long)(outbox->head - outbox->tail));
+            pthread_mutex_unlock(&send_lock);
+            usleep(wait_ms * 1000);
+            delay_ms = delay_ms * 2 < BACKOFF_MAX_MS ? delay_ms * 2 : BACKOFF_MAX_MS;
+            continue;
+        }
+        delay_ms = BACKOFF_MIN_MS;
+        start_recv_threads();
+        replay_outbox();
     }
-    
-    pthread_detach(r_tid);
+    return NULL;
+}
 
-    int is_emergency = 0;
-    int led_state    = 1;
-    set_led(led_state);
+// ================= Button / emergency thread =================
 
-    // Initial status messages
-    send_status(sock_arm,  ID_ARM,  "System Started");
-    send_status(sock_led,  ID_LED,  "LED:ON");
-    send_status(sock_btn,  ID_BTN,  "BUTTON:RELEASED");
-    send_status(sock_temp, ID_TEMP, "TEMP:INIT");
+#define DEBOUNCE_NS 20000000LL   // ignore contact bounce for 20 ms
 
-    unsigned long loop_count = 0;
+pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+int is_emergency = 0;
+int led_state    = 1;
 
-    printf(">> System running... (LED ON)\n");
-    printf(">> Press the button (GPIO17) to trigger EMERGENCY STOP.\n");
+// Apply a debounced button level. On a press the LED goes off and the
+// emergency messages go out before anything is printed, so the time from
+// the edge to the first sent byte is just an ioctl and a few writes.
+static void button_changed(int btn, long long edge_ns) {
+    pthread_mutex_lock(&state_lock);
+
+    // --- Button pressed -> EMERGENCY mode ---
+    if (btn == 1 && is_emergency == 0) {
+        is_emergency = 1;
+        led_state = 0;
+        set_led(led_state);
+
+        send_switch(&ch_btn, SF_BUTTON, 1, "EMERGENCY");
+        send_switch(&ch_led, SF_LED, 0, "EMERGENCY");
+        send_status(&ch_arm, "WARNING - INTERRUPT DETECTED!");
+        long long sent_ns = mono_ns();
+
+        printf("\n=======================================\n");
+        printf("   [ WARNING ] INTERRUPT DETECTED !!   \n");
+        printf("=======================================\n");
+        printf("   !!! EMERGENCY STOP ACTIVATED !!!    \n");
+        printf("=======================================\n");
+        printf("   (edge -> sent in %.1f us)\n\n", (sent_ns - edge_ns) / 1000.0);
+    }
+
+    // --- Button released -> back to normal ---
+    if (btn == 0 && is_emergency == 1) {
+        is_emergency = 0;
+        led_state = 1;
+        set_led(led_state);
+
+        printf(">> System restarting...\n");
+        send_status(&ch_arm, "System Resumed");
+        send_switch(&ch_btn, SF_BUTTON, 0, "RUNNING");
+        send_switch(&ch_led, SF_LED, 1, "RUNNING");
+    }
+
+    pthread_mutex_unlock(&state_lock);
+}
+
+// Sleeps until the GPIO backend reports a button edge. The first edge acts
+// at once; bounces right after it are ignored, and the level is re-read
+// every 100 ms so a release lost inside the bounce window is still seen.
+void *button_thread(void *arg) {
+    long long last_edge = 0;
+    (void)arg;
+
+    // Real-time priority keeps the wake-up short while the main loop or
+    // other processes are busy (needs root or CAP_SYS_NICE).
+    struct sched_param sp = {50};
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) != 0)
+        printf("[INFO] Button thread runs without real-time priority.\n");
 
     while (1) {
-        loop_count++;
+        int level;
+        long long ts;
+        int r = gpio->wait_edge(100, &level, &ts);
+
+        if (r < 0) {
+            perror("[ERROR] GPIO edge wait");
+            break;
+        }
+        if (r == 0) {
+            level = read_btn();
+            ts = mono_ns();
+        } else if (ts - last_edge < DEBOUNCE_NS) {
+            continue;
+        } else {
+            last_edge = ts;
+        }
+        button_changed(level, ts);
+    }
+    return NULL;
+}
+
+// ================= Sampling scheduler =================
+//
+// Every periodic report is a task with its own period. Each task owns a
+// timerfd armed with an absolute CLOCK_MONOTONIC start and a fixed
+// interval, so the kernel keeps the deadlines: nothing drifts however long
+// a read takes, and the main thread just sleeps in epoll_wait. If a task
+// falls behind, the timerfd says how many periods went by; those are
+// counted as missed instead of being run in a burst.
+// Tasks run without state_lock; a periodic report that races a button
+// edge may carry the old state once and is corrected on the next period.
+// Periods can be changed with -p name=ms (e.g. -p temp=10000 -p button=10).
+
+float last_temperature = NAN;   // latest reading, shared by temp and arm
+
+static void task_temp(void) {
+    float temp = read_temperature();
+    int temp_valid = (temp > -200.0f);  // crude check: below -200 => invalid
+    struct sample smp = {0};
+
+    // TEMP02: temperature only (NaN => "N/A")
+    last_temperature = temp_valid ? temp : NAN;
+    smp.fields = SF_TEMP;
+    smp.temp   = last_temperature;
+    send_sample(&ch_temp, &smp);
+}
+
+static void task_arm(void) {
+    struct sample smp = {0};
+    int emergency;
+
+    pthread_mutex_lock(&state_lock);
+    emergency = is_emergency;
+    pthread_mutex_unlock(&state_lock);
+
+    // ARM01: overall summary (mode + temperature)
+    smp.fields = SF_MODE | SF_TEMP;
+    smp.mode   = emergency ? MODE_EMERGENCY : MODE_RUNNING;
+    smp.temp   = last_temperature;
+    send_sample(&ch_arm, &smp);
+}
+
+static void task_button(void) {
+    // BUTTON01: current button state
+    send_switch(&ch_btn, SF_BUTTON, read_btn(), NULL);
+}
 
-        int btn = read_btn();
+static void task_led(void) {
+    int on;
 
-        // --- Button pressed -> EMERGENCY mode ---
-        if (btn == 1 && is_emergency == 0) {
-            is_emergency = 1;
-            led_state = 0;
-            set_led(led_state);
+    pthread_mutex_lock(&state_lock);
+    on = led_state;
+    pthread_mutex_unlock(&state_lock);
 
-            printf("\n=======================================\n");
-            printf("   [ WARNING ] INTERRUPT DETECTED !!   \n");
-            printf("=======================================\n");
-            printf("   !!! EMERGENCY STOP ACTIVATED !!!    \n");
-            printf("=======================================\n\n");
+    // LED01: current LED state
+    send_switch(&ch_led, SF_LED, on, NULL);
+}
+
+struct task {
+    const char   *name;
+    long          period_ms;
+    void        (*run)(void);
+    int           tfd;
+    unsigned long runs, missed;
+};
+
+struct task tasks[] = {
+    {"temp",   1000, task_temp,   -1, 0, 0},
+    {"arm",    1000, task_arm,    -1, 0, 0},
+    {"button", 1000, task_button, -1, 0, 0},
+    {"led",    1000, task_led,    -1, 0, 0},
+};
+#define NUM_TASKS ((int)(sizeof(tasks) / sizeof(tasks[0])))
+
+// "-p name=ms"
+int set_task_period(const char *spec) {
+    const char *eq = strchr(spec, '=');
 
-            send_status(sock_arm, ID_ARM, "WARNING - INTERRUPT DETECTED!");
-            send_status(sock_btn, ID_BTN, "BUTTON:PRESSED (EMERGENCY)");
-            send_status(sock_led, ID_LED, "LED:OFF (EMERGENCY)");
+    for (int i = 0; eq && i < NUM_TASKS; i++) {
+        if (strlen(tasks[i].name) == (size_t)(eq - spec) &&
+            strncmp(tasks[i].name, spec, eq - spec) == 0 && atol(eq + 1) > 0) {
+            tasks[i].period_ms = atol(eq + 1);
+            return 0;
         }
+    }
+    printf("[ERROR] Bad period '%s' (tasks: temp, arm, button, led)\n", spec);
+    return -1;
+}
+
+// Runs forever on the calling thread.
+void run_scheduler(void) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct timespec now;
 
-        // --- Button released -> back to normal ---
-        if (btn == 0 && is_emergency == 1) {
-            is_emergency = 0;
-            led_state = 1;
-            set_led(led_state);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < NUM_TASKS; i++) {
+        struct task *t = &tasks[i];
+        struct itimerspec its;
+        struct epoll_event ev;
 
-            printf(">> System restarting...\n");
-            send_status(sock_arm, ID_ARM, "System Resumed");
-            send_status(sock_btn, ID_BTN, "BUTTON:RELEASED (RUNNING)");
-            send_status(sock_led, ID_LED, "LED:ON (RUNNING)");
+        // First deadline one period from now, then every period after it
+        its.it_interval.tv_sec  = t->period_ms / 1000;
+        its.it_interval.tv_nsec = (t->period_ms % 1000) * 1000000L;
+        its.it_value.tv_sec  = now.tv_sec + its.it_interval.tv_sec;
+        its.it_value.tv_nsec = now.tv_nsec + its.it_interval.tv_nsec;
+        if (its.it_value.tv_nsec >= 1000000000L) {
+            its.it_value.tv_sec++;
+            its.it_value.tv_nsec -= 1000000000L;
         }
 
-        // --- Periodic status update (~every 1 second) ---
-        if (loop_count % 20 == 0) {  // 0.05s * 20 = 1s
-            float temp = read_temperature();
-            char buf[256];
-            int temp_valid = (temp > -200.0f);  // crude check: below -200 => invalid
-
-            // ARM01: overall summary (mode + temperature)
-            if (temp_valid) {
-                snprintf(buf, sizeof(buf),
-                         "MODE:%s TEMP:%.1fC",
-                         is_emergency ? "EMERGENCY" : "RUNNING",
-                         temp);
-            } else {
-                snprintf(buf, sizeof(buf),
-                         "MODE:%s TEMP:N/A",
-                         is_emergency ? "EMERGENCY" : "RUNNING");
-            }
-            send_status(sock_arm, ID_ARM, buf);
+        t->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (t->tfd < 0 || timerfd_settime(t->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+            perror("[ERROR] timerfd");
+            exit(1);
+        }
+        ev.events   = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, t->tfd, &ev);
+        printf("[INFO] Task %-6s every %ld ms\n", t->name, t->period_ms);
+    }
 
-            // TEMP02: temperature only
-            if (temp_valid) {
-                snprintf(buf, sizeof(buf), "TEMP:%.1fC", temp);
-            } else {
-                snprintf(buf, sizeof(buf), "TEMP:N/A");
+    while (1) {
+        struct epoll_event events[NUM_TASKS];
+        int n = epoll_wait(epfd, events, NUM_TASKS, -1);
+
+        for (int k = 0; k < n; k++) {
+            struct task *t = &tasks[events[k].data.u32];
+            uint64_t expirations;
+
+            if (read(t->tfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                continue;
+            t->runs++;
+            t->missed += expirations - 1;
+            // No lock here: the DHT11 read can take a while and must not
+            // hold up the button thread. Tasks that look at the emergency
+            // state copy it under state_lock themselves.
+            t->run();
+        }
+    }
+}
+
+void cleanup_handler(int sig) {
+    printf("\n[SYSTEM] Cleaning up resources...\n");
+    set_led(0); // LED 끄기
+    printf("[SYSTEM] LED turned OFF.\n");
+    if (outbox)
+        printf("[SYSTEM] Offline buffer: %llu samples unsent, %llu dropped.\n",
+               (unsigned long long)(outbox->head - outbox->tail),
+               (unsigned long long)outbox->dropped);
+    for (int i = 0; i < NUM_TASKS; i++)
+        printf("[SYSTEM] Task %-6s ran %lu times, missed %lu periods.\n",
+               tasks[i].name, tasks[i].runs, tasks[i].missed);
+    for (int i = 0; i < NUM_CHANNELS; i++)
+        if (channels[i]->refused)
+            printf("[SYSTEM] %s: %lu samples dropped, ID denied by the server.\n",
+                   channels[i]->id, channels[i]->refused);
+    printf("[SYSTEM] Client terminated safely.\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    signal(SIGINT, cleanup_handler);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "tg:c:s:p:o:O:")) != -1) {
+        switch (opt) {
+        case 't':   // legacy text protocol only
+            use_binary = 0;
+            printf("[INFO] Using the text protocol.\n");
+            break;
+        case 'g':   // GPIO backend: cdev (default) or sim
+            gpio = strcmp(optarg, "sim") == 0 ? &gpio_sim : &gpio_cdev;
+            break;
+        case 'c':   // gpiochip device for the cdev backend
+            gpio_chip = optarg;
+            break;
+        case 's':   // server address
+            server_ip = optarg;
+            break;
+        case 'p':   // sampling period of one task, e.g. temp=10000
+            if (set_task_period(optarg) < 0) return 1;
+            break;
+        case 'o':   // keep the offline buffer in this file (survives restarts)
+            outbox_file = optarg;
+            break;
+        case 'O':   // offline buffer size in samples
+            if (atol(optarg) <= 0) {
+                printf("[ERROR] Bad buffer size '%s'\n", optarg);
+                return 1;
             }
-            send_status(sock_temp, ID_TEMP, buf);
-
-            // BUTTON01: current button state
-            snprintf(buf, sizeof(buf),
-                     "BUTTON:%s",
-                     btn ? "PRESSED" : "RELEASED");
-            send_status(sock_btn, ID_BTN, buf);
-
-            // LED01: current LED state
-            snprintf(buf, sizeof(buf),
-                     "LED:%s",
-                     led_state ? "ON" : "OFF");
-            send_status(sock_led, ID_LED, buf);
+            outbox_cap = atol(optarg);
+            break;
+        default:
+            printf("Usage: %s [-t] [-g cdev|sim] [-c /dev/gpiochipN] [-s server_ip] [-p task=ms]\n"
+                   "       [-o buffer_file] [-O buffer_samples]\n",
+                   argv[0]);
+            return 1;
         }
+    }
 
-        usleep(50000);  // 0.05 seconds
+    printf("[INFO] Initializing GPIO (button & LED)...\n");
+    init_gpio();
+    printf("[INFO] GPIO backend: %s\n", gpio->name);
+
+    if (init_outbox() < 0) return 1;
+
+    // Connect the four logical IDs (one shared session if the server can)
+    // on the link thread, which also reconnects whenever the server goes
+    // away. Until then everything below is buffered.
+    pthread_t l_tid;
+    if (pthread_create(&l_tid, NULL, link_thread, NULL) != 0) {
+        perror("[ERROR] Failed to create link thread");
+        return 1;
+    }
+    pthread_detach(l_tid);
+
+    set_led(led_state);
+
+    // Initial status messages
+    send_status(&ch_arm,  "System Started");
+    send_switch(&ch_led,  SF_LED, 1, NULL);
+    send_switch(&ch_btn,  SF_BUTTON, 0, NULL);
+    send_status(&ch_temp, "TEMP:INIT");
+
+    // Button edges are handled on their own thread (see button_thread)
+    pthread_t b_tid;
+    if (pthread_create(&b_tid, NULL, button_thread, NULL) != 0) {
+        perror("[ERROR] Failed to create button thread");
+        return 1;
     }
+    pthread_detach(b_tid);
+
+    printf(">> System running... (LED ON)\n");
+    printf(">> Press the button (GPIO%d) to trigger EMERGENCY STOP.\n", BTN_PIN);
+
+    // Periodic reports, each on its own timer (see run_scheduler)
+    run_scheduler();
 
     // (Normally never reached)
-    close(sock_arm);
-    close(sock_temp);
-    close(sock_btn);
-    close(sock_led);
+    for (int i = 0; i < NUM_CHANNELS; i++)
+        if (channels[i]->sock >= 0) close(channels[i]->sock);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,960 @@
+// loadgen.c
+// Virtual sensor fleet for sizing server.c on one machine.
+// Opens many sessions to the server on localhost, each carrying up to
+// MAX_CHANNELS sensor IDs (VS00000, VS00001, ...), and sends status
+// samples built with the same protocol code as client.c (protocol.h):
+//   - rate      : total samples per second across the fleet (-r)
+//   - mix       : weights of ARM-style MODE+TEMP, TEMP, BUTTON and LED
+//                 samples (-m mode=1,temp=3,button=1,led=1)
+//   - bursts    : samples leave in back-to-back bursts of N at the same
+//                 average rate (-B)
+//   - churn     : every session drops and reconnects on average every
+//                 N seconds (-C)
+//   - commands  : "ID:CMD:..." from the server dashboard are acked like
+//                 client.c does, for a given share and after a delay (-A, -D)
+// Every Nth sample (-P) is followed by a PING; the server answers with
+// PONG once it has handled everything before it on that session, so the
+// PING -> PONG time is the end-to-end latency of a sample.
+// Prints the achieved rate and latency percentiles every second and a
+// summary at the end; -j also writes the summary as one JSON object so
+// runs can be kept and compared for regressions.
+//
+// The server has to accept the made-up IDs: run it as "./server -a", or
+// let loadgen start one itself with -X ./server (headless, on a private
+// log directory, control socket and checkpoint that are removed afterwards).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <math.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <dirent.h>
+
+#include "protocol.h"
+
+#define SERVER_IP    "127.0.0.1"   // localhost only
+#define PORT         8080
+#define MAX_CHANNELS 32            // per session, same limit as the server
+#define MAX_WORKERS  64
+#define OUT_SIZE     65536
+#define IN_SIZE      4096
+#define PING_SLOTS   65536
+#define MAX_ACKS     64            // delayed acks waiting per session
+#define TICK_NS      1000000L      // 1 ms
+
+enum { MIX_MODE, MIX_TEMP, MIX_BUTTON, MIX_LED, NUM_MIX };
+static const char *const mix_names[NUM_MIX] = {"mode", "temp", "button", "led"};
+
+// ===== Settings (command line) =====
+
+int   num_sensors   = 1000;   // -n
+int   per_session   = 16;     // -k
+int   num_workers   = 2;      // -w
+double total_rate   = 10000;  // -r samples/s
+int   mix[NUM_MIX]  = {1, 3, 1, 1};   // -m
+int   burst         = 1;      // -B
+double churn_s      = 0;      // -C, 0: never
+int   ping_every    = 100;    // -P
+int   ack_percent   = 100;    // -A
+int   ack_delay_ms  = 0;      // -D
+int   duration_s    = 10;     // -d
+int   use_binary    = 1;      // -t for text
+const char *server_path = NULL;   // -X: start this server binary
+const char *json_path   = NULL;   // -j: summary as JSON ("-" for stdout)
+
+// ===== Sessions and workers =====
+
+struct pending_ack {
+    long long due_ns;
+    int       chan;
+    uint32_t  corr;
+};
+
+// A session reconnecting during the run goes through these states on the
+// worker's epoll instead of blocking the loop.
+enum { SS_READY, SS_CONNECTING, SS_HELLO };
+
+struct session {
+    int      fd;
+    int      state;                   // SS_*, while fd >= 0
+    int      replies;                 // hello replies so far
+    int      binary;
+    int      first, nchan;            // sensors first .. first+nchan-1
+    uint32_t handle[MAX_CHANNELS];
+    char     in[IN_SIZE];
+    int      in_used;
+    char     out[OUT_SIZE];
+    int      out_used;
+    int      want_out;
+    long long churn_ns;               // next forced reconnect or retry,
+                                      // handshake deadline while connecting
+    struct pending_ack acks[MAX_ACKS];
+    int      nacks;
+};
+
+// Counters are written by one worker and read by the reporter.
+struct worker {
+    int             no;
+    pthread_t       tid;
+    struct session *sess;
+    int             nsess;
+    int             epfd;
+    double          rate;             // samples/s for this worker
+    uint64_t        rng;
+    long long       ping_ns[PING_SLOTS];
+    uint32_t        ping_seq;
+    unsigned long   cursor;           // round-robin over its sensors
+    int             nsensors;
+
+    unsigned long   sent, bytes, stalled, reconnects, denied;
+    unsigned long   cmds, acks, pongs;
+
+    pthread_mutex_t lat_lock;         // latency samples since last report
+    unsigned       *lat_us;
+    int             lat_len, lat_cap;
+};
+
+static struct worker workers[MAX_WORKERS];
+static volatile int running = 1;
+
+static long long mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// xorshift64*, one per worker
+static uint32_t rnd(struct worker *w) {
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return (w->rng * 2685821657736338717ULL) >> 32;
+}
+
+static void sensor_id(char *buf, int size, int n) {
+    snprintf(buf, size, "VS%05d", n);
+}
+
+// ===== Connecting =====
+
+// Read one '\n'-terminated reply, waiting up to 2 s.
+static int read_line(struct session *s, char *line, int size) {
+    while (1) {
+        char *nl = memchr(s->in, '\n', s->in_used);
+        if (nl) {
+            int n = nl - s->in;
+            int len = n < size - 1 ? n : size - 1;
+            memcpy(line, s->in, len);
+            line[len] = 0;
+            s->in_used -= n + 1;
+            memmove(s->in, nl + 1, s->in_used);
+            return len;
+        }
+
+        struct pollfd pfd = {s->fd, POLLIN, 0};
+        if (s->in_used == IN_SIZE || poll(&pfd, 1, 2000) <= 0) return -1;
+        int n = read(s->fd, s->in + s->in_used, IN_SIZE - s->in_used);
+        if (n <= 0) return -1;
+        s->in_used += n;
+    }
+}
+
+// Parse "ACCEPTED PROTO=<name> HANDLE=<n>". Returns 0, or -1 if denied.
+static int parse_accept(struct session *s, int chan, const char *line) {
+    const char *handle = strstr(line, "HANDLE=");
+
+    if (strncmp(line, PROTO_ACCEPTED, strlen(PROTO_ACCEPTED)) != 0 || !handle)
+        return -1;
+    s->handle[chan] = strtoul(handle + 7, NULL, 10);
+    return 0;
+}
+
+static int session_fail(struct session *s) {
+    close(s->fd);
+    s->fd = -1;
+    s->state = SS_READY;
+    s->churn_ns = mono_ns() + 1000000000LL;   // retry in a second
+    return -1;
+}
+
+// The handshake: the first hello goes out as text, and once the server
+// answers (and, for BIN1, switched to frames) the rest follow pipelined in
+// one write. Denied sensors stay silent. These steps are shared by the
+// blocking open at startup and the epoll-driven reopen used for churn.
+static int send_first_hello(struct session *s) {
+    char id[16], buf[64];
+    int n;
+
+    for (int k = 0; k < s->nchan; k++) s->handle[k] = UINT32_MAX;
+    s->in_used = s->out_used = s->nacks = s->want_out = 0;
+    s->replies = 0;
+    sensor_id(id, sizeof(id), s->first);
+    n = snprintf(buf, sizeof(buf), "%s:%s%s\n", id, PROTO_HELLO,
+                 use_binary ? PROTO_NAME : PROTO_TEXT);
+    return write(s->fd, buf, n) == n ? 0 : -1;
+}
+
+// One reply to our hellos. Returns 1 once every channel has its answer,
+// 0 if more are due, -1 if the session has to be dropped.
+static int hello_reply(struct worker *w, struct session *s, const char *line) {
+    char id[16], buf[MAX_CHANNELS * 32];
+    int n = 0;
+
+    if (s->replies++ > 0) {
+        if (parse_accept(s, s->replies - 1, line) < 0) w->denied++;
+        return s->replies == s->nchan;
+    }
+    if (strncmp(line, PROTO_ACCEPTED, strlen(PROTO_ACCEPTED)) != 0 &&
+        strncmp(line, "DENIED", 6) != 0) {
+        fprintf(stderr, "[ERROR] Server does not speak %s (got \"%s\")\n",
+                PROTO_HELLO, line);
+        return -1;
+    }
+    if (parse_accept(s, 0, line) < 0) {   // the server drops us now
+        w->denied++;
+        return -1;
+    }
+    s->binary = use_binary && strstr(line, PROTO_NAME) != NULL;
+
+    for (int k = 1; k < s->nchan; k++) {
+        sensor_id(id, sizeof(id), s->first + k);
+        if (s->binary)
+            n += bin_hello((uint8_t *)buf + n, sizeof(buf) - n, id);
+        else
+            n += snprintf(buf + n, sizeof(buf) - n, "%s:%s%s\n", id,
+                          PROTO_HELLO, PROTO_TEXT);
+    }
+    if (n && write(s->fd, buf, n) != n) return -1;
+    return s->nchan == 1;
+}
+
+// Handshake done: take the session into the worker's epoll set.
+static void session_ready(struct worker *w, struct session *s, int op) {
+    struct epoll_event ev = {EPOLLIN, {.ptr = s}};
+
+    s->state = SS_READY;
+    epoll_ctl(w->epfd, op, s->fd, &ev);
+    if (churn_s > 0)
+        s->churn_ns = mono_ns() +
+                      (long long)(-log((rnd(w) + 1.0) / 4294967297.0) * churn_s * 1e9);
+}
+
+static int session_socket(struct session *s, int flags) {
+    struct sockaddr_in addr;
+    int one = 1;
+
+    s->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | flags, 0);
+    if (s->fd < 0) return -1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(PORT);
+    inet_pton(AF_INET, SERVER_IP, &addr.sin_addr);
+    if (connect(s->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+        errno != EINPROGRESS)
+        return -1;
+    return 0;
+}
+
+// Open the session and wait for the whole handshake. Only used before the
+// workers start; reconnects while running go through session_reopen.
+static int session_open(struct worker *w, struct session *s) {
+    char line[128];
+    int r = 0;
+
+    if (session_socket(s, 0) < 0 || send_first_hello(s) < 0)
+        return s->fd < 0 ? -1 : session_fail(s);
+    while (r == 0) {
+        if (read_line(s, line, sizeof(line)) < 0 ||
+            (r = hello_reply(w, s, line)) < 0)
+            return session_fail(s);
+    }
+    fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+    session_ready(w, s, EPOLL_CTL_ADD);
+    return 0;
+}
+
+// Start a non-blocking reconnect; session_handshake carries it on from
+// the worker loop as the socket becomes writable and replies come in.
+// churn_ns is the deadline for the whole handshake meanwhile.
+static void session_reopen(struct worker *w, struct session *s) {
+    struct epoll_event ev = {EPOLLOUT, {.ptr = s}};
+
+    if (session_socket(s, SOCK_NONBLOCK) < 0) {
+        if (s->fd >= 0) session_fail(s);
+        else s->churn_ns = mono_ns() + 1000000000LL;
+        return;
+    }
+    s->state = SS_CONNECTING;
+    s->churn_ns = mono_ns() + 2000000000LL;
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, s->fd, &ev);
+}
+
+// One epoll event for a session that is still shaking hands.
+static void session_handshake(struct worker *w, struct session *s,
+                              unsigned events) {
+    char line[128];
+    int err = 0, r = 0;
+    socklen_t len = sizeof(err);
+
+    if (s->state == SS_CONNECTING) {
+        struct epoll_event ev = {EPOLLIN, {.ptr = s}};
+
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+        if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err ||
+            send_first_hello(s) < 0) {
+            session_fail(s);
+            return;
+        }
+        s->state = SS_HELLO;
+        epoll_ctl(w->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+        return;
+    }
+
+    int n = read(s->fd, s->in + s->in_used, IN_SIZE - s->in_used);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n <= 0) {
+        session_fail(s);
+        return;
+    }
+    s->in_used += n;
+    while (r == 0) {
+        char *nl = memchr(s->in, '\n', s->in_used);
+        if (!nl) {
+            if (s->in_used == IN_SIZE) session_fail(s);
+            return;
+        }
+        int used = nl - s->in;
+        int cut = used < (int)sizeof(line) - 1 ? used : (int)sizeof(line) - 1;
+        memcpy(line, s->in, cut);
+        line[cut] = 0;
+        s->in_used -= used + 1;
+        memmove(s->in, nl + 1, s->in_used);
+        if ((r = hello_reply(w, s, line)) < 0) {
+            session_fail(s);
+            return;
+        }
+    }
+    session_ready(w, s, EPOLL_CTL_MOD);
+    w->reconnects++;
+}
+
+static void session_close(struct session *s) {
+    if (s->fd >= 0) close(s->fd);   // also leaves the epoll set
+    s->fd = -1;
+}
+
+// ===== Sending =====
+
+static void session_flush(struct worker *w, struct session *s) {
+    while (s->out_used > 0) {
+        ssize_t n = send(s->fd, s->out, s->out_used, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        s->out_used -= n;
+        memmove(s->out, s->out + n, s->out_used);
+    }
+    int want = s->out_used > 0;
+    if (want != s->want_out) {
+        struct epoll_event ev = {EPOLLIN | (want ? EPOLLOUT : 0), {.ptr = s}};
+        epoll_ctl(w->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+        s->want_out = want;
+    }
+}
+
+// One sample from the payload mix.
+static void make_sample(struct worker *w, struct sample *smp) {
+    int total = 0, pick;
+
+    for (int i = 0; i < NUM_MIX; i++) total += mix[i];
+    pick = rnd(w) % total;
+    for (int i = 0; i < NUM_MIX; i++) {
+        if (pick < mix[i]) { pick = i; break; }
+        pick -= mix[i];
+    }
+
+    memset(smp, 0, sizeof(*smp));
+    switch (pick) {
+    case MIX_MODE:
+        smp->fields = SF_MODE | SF_TEMP;
+        smp->mode   = rnd(w) % 100 ? MODE_RUNNING : MODE_EMERGENCY;
+        smp->temp   = 20.0f + (rnd(w) % 100) / 10.0f;
+        break;
+    case MIX_TEMP:
+        smp->fields = SF_TEMP;
+        smp->temp   = 20.0f + (rnd(w) % 100) / 10.0f;
+        break;
+    case MIX_BUTTON:
+        smp->fields = SF_BUTTON;
+        smp->button = rnd(w) % 2;
+        break;
+    default:
+        smp->fields = SF_LED;
+        smp->led    = rnd(w) % 2;
+        break;
+    }
+}
+
+// Append one sample for channel k (and maybe a PING) to the session's
+// output. If the server is not keeping up and the buffer is full the
+// sample is counted as stalled instead.
+static void queue_sample(struct worker *w, struct session *s, int k) {
+    char id[16];
+    struct sample smp;
+    int room = OUT_SIZE - s->out_used, n;
+    char *p = s->out + s->out_used;
+
+    if (s->handle[k] == UINT32_MAX || room < 512) {
+        w->stalled++;
+        return;
+    }
+    make_sample(w, &smp);
+    sensor_id(id, sizeof(id), s->first + k);
+    if (s->binary) {
+        n = sample_to_bin((uint8_t *)p, room, s->handle[k], &smp);
+    } else {
+        n = snprintf(p, room, "%s:", id);
+        n += sample_to_text(p + n, room - n - 1, &smp);
+        p[n++] = '\n';
+    }
+    if (n <= 0) return;
+    s->out_used += n;
+    w->sent++;
+    w->bytes += n;
+
+    if (ping_every > 0 && w->sent % ping_every == 0) {
+        uint32_t seq = w->ping_seq++;
+        p = s->out + s->out_used;
+        if (s->binary)
+            n = bin_ping((uint8_t *)p, s->handle[k], seq);
+        else
+            n = snprintf(p, 64, "%s:PING:%u\n", id, seq);
+        s->out_used += n;
+        w->ping_ns[seq % PING_SLOTS] = mono_ns();
+    }
+}
+
+static void send_ack(struct worker *w, struct session *s, int k, uint32_t corr) {
+    char *p = s->out + s->out_used;
+    char id[16];
+
+    if (OUT_SIZE - s->out_used < 64) return;
+    if (s->binary) {
+        s->out_used += bin_ack((uint8_t *)p, s->handle[k], corr);
+    } else {
+        sensor_id(id, sizeof(id), s->first + k);
+        s->out_used += snprintf(p, 64, "%s:ACK:%u\n", id, corr);
+    }
+    w->acks++;
+}
+
+// ===== Receiving =====
+
+static void record_latency(struct worker *w, unsigned us) {
+    pthread_mutex_lock(&w->lat_lock);
+    if (w->lat_len == w->lat_cap) {
+        int cap = w->lat_cap ? w->lat_cap * 2 : 1024;
+        unsigned *lat = realloc(w->lat_us, cap * sizeof(*lat));
+        if (!lat) {
+            pthread_mutex_unlock(&w->lat_lock);
+            return;
+        }
+        w->lat_us = lat;
+        w->lat_cap = cap;
+    }
+    w->lat_us[w->lat_len++] = us;
+    pthread_mutex_unlock(&w->lat_lock);
+}
+
+// "ID:PONG:<seq>" or "ID:CMD:<corr>:<command>"
+static void handle_line(struct worker *w, struct session *s, const char *line,
+                        long long now) {
+    const char *colon = strchr(line, ':');
+    unsigned num;
+    int k;
+
+    if (!colon) return;
+    if (sscanf(colon + 1, "PONG:%u", &num) == 1) {
+        long long sent = w->ping_ns[num % PING_SLOTS];
+        w->pongs++;
+        if (sent && now >= sent) record_latency(w, (now - sent) / 1000);
+        return;
+    }
+    if (sscanf(colon + 1, "CMD:%u:", &num) != 1) return;
+    w->cmds++;
+    k = atoi(line + 2) - s->first;   // "VS<n>"
+    if (k < 0 || k >= s->nchan || (int)(rnd(w) % 100) >= ack_percent) return;
+    if (ack_delay_ms == 0) {
+        send_ack(w, s, k, num);
+    } else if (s->nacks < MAX_ACKS) {
+        struct pending_ack *a = &s->acks[s->nacks++];
+        a->due_ns = now + ack_delay_ms * 1000000LL;
+        a->chan   = k;
+        a->corr   = num;
+    }
+}
+
+// Returns -1 if the server closed the session.
+static int session_read(struct worker *w, struct session *s) {
+    long long now = mono_ns();
+
+    while (1) {
+        int n = read(s->fd, s->in + s->in_used, IN_SIZE - 1 - s->in_used);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return 0;
+        if (n <= 0) return -1;
+
+        s->in_used += n;
+        s->in[s->in_used] = 0;
+        char *line = s->in, *nl;
+        while ((nl = strchr(line, '\n')) != NULL) {
+            *nl = 0;
+            handle_line(w, s, line, now);
+            line = nl + 1;
+        }
+        s->in_used = strlen(line);
+        memmove(s->in, line, s->in_used + 1);
+        if (s->in_used == IN_SIZE - 1) s->in_used = 0;   // overlong line
+    }
+}
+
+// ===== Worker loop =====
+
+// Each millisecond tick works out how many samples the worker owes to
+// stay on its rate and sends them round-robin over its sensors; with -B
+// they wait until a whole burst is owed. Due acks and churn happen on the
+// same tick.
+static void on_tick(struct worker *w, long long start, long long now,
+                    unsigned long *owed_base) {
+    unsigned long target = (unsigned long)((now - start) / 1e9 * w->rate);
+    unsigned long owed = target - *owed_base;
+
+    if (owed >= (unsigned long)burst) {
+        *owed_base = target;
+        for (unsigned long i = 0; i < owed; i++) {
+            unsigned long n = w->cursor++ % w->nsensors;
+            // sessions of a worker hold per_session sensors each
+            struct session *s = &w->sess[n / per_session];
+            if (s->fd >= 0 && s->state == SS_READY) queue_sample(w, s, n % per_session);
+            else w->stalled++;
+        }
+    }
+
+    for (int i = 0; i < w->nsess; i++) {
+        struct session *s = &w->sess[i];
+
+        if (s->fd >= 0 && s->state != SS_READY) {
+            if (now >= s->churn_ns) session_fail(s);   // handshake timed out
+            continue;
+        }
+        if ((s->fd < 0 || churn_s > 0) && now >= s->churn_ns) {
+            session_close(s);
+            session_reopen(w, s);
+            continue;
+        }
+        for (int a = 0; a < s->nacks;) {
+            if (s->acks[a].due_ns <= now) {
+                send_ack(w, s, s->acks[a].chan, s->acks[a].corr);
+                s->acks[a] = s->acks[--s->nacks];
+            } else {
+                a++;
+            }
+        }
+        if (s->out_used > 0) session_flush(w, s);
+    }
+}
+
+void *worker_thread(void *arg) {
+    struct worker *w = arg;
+    struct itimerspec its = {{0, TICK_NS}, {0, TICK_NS}};
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    struct epoll_event ev = {EPOLLIN, {.ptr = NULL}};
+    unsigned long owed_base = 0;
+    long long start = mono_ns();
+
+    timerfd_settime(tfd, 0, &its, NULL);
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, tfd, &ev);
+
+    while (running) {
+        struct epoll_event events[64];
+        int n = epoll_wait(w->epfd, events, 64, 100);
+
+        for (int i = 0; i < n; i++) {
+            struct session *s = events[i].data.ptr;
+
+            if (s == NULL) {
+                uint64_t exp;
+                if (read(tfd, &exp, sizeof(exp)) == sizeof(exp))
+                    on_tick(w, start, mono_ns(), &owed_base);
+                continue;
+            }
+            if (s->fd < 0) continue;
+            if (s->state != SS_READY) {
+                session_handshake(w, s, events[i].events);
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+                session_read(w, s) < 0) {
+                session_close(s);
+                s->churn_ns = mono_ns() + 100000000LL;   // reconnect soon
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) session_flush(w, s);
+        }
+    }
+    for (int i = 0; i < w->nsess; i++) session_close(&w->sess[i]);
+    close(tfd);
+    return NULL;
+}
+
+// ===== Reporting =====
+
+static int cmp_uint(const void *a, const void *b) {
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+    return x < y ? -1 : x > y;
+}
+
+static unsigned pct(const unsigned *v, int n, double p) {
+    if (n == 0) return 0;
+    int i = (int)(p / 100.0 * n);
+    return v[i < n ? i : n - 1];
+}
+
+struct totals {
+    unsigned long sent, bytes, stalled, reconnects, denied, cmds, acks, pongs;
+};
+
+static void sum_workers(struct totals *t) {
+    memset(t, 0, sizeof(*t));
+    for (int i = 0; i < num_workers; i++) {
+        struct worker *w = &workers[i];
+        t->sent       += __atomic_load_n(&w->sent, __ATOMIC_RELAXED);
+        t->bytes      += __atomic_load_n(&w->bytes, __ATOMIC_RELAXED);
+        t->stalled    += __atomic_load_n(&w->stalled, __ATOMIC_RELAXED);
+        t->reconnects += __atomic_load_n(&w->reconnects, __ATOMIC_RELAXED);
+        t->denied     += __atomic_load_n(&w->denied, __ATOMIC_RELAXED);
+        t->cmds       += __atomic_load_n(&w->cmds, __ATOMIC_RELAXED);
+        t->acks       += __atomic_load_n(&w->acks, __ATOMIC_RELAXED);
+        t->pongs      += __atomic_load_n(&w->pongs, __ATOMIC_RELAXED);
+    }
+}
+
+// Move every worker's latency samples into *all (which grows) and return
+// how many were added; those are the last interval's.
+static int collect_latency(unsigned **all, int *len, int *cap) {
+    int added = 0;
+
+    for (int i = 0; i < num_workers; i++) {
+        struct worker *w = &workers[i];
+        pthread_mutex_lock(&w->lat_lock);
+        if (*len + w->lat_len > *cap) {
+            int c = *cap ? *cap : 4096;
+            while (c < *len + w->lat_len) c *= 2;
+            unsigned *p = realloc(*all, c * sizeof(*p));
+            if (p) {
+                *all = p;
+                *cap = c;
+            }
+        }
+        if (*len + w->lat_len <= *cap) {
+            memcpy(*all + *len, w->lat_us, w->lat_len * sizeof(unsigned));
+            *len += w->lat_len;
+            added += w->lat_len;
+        }
+        w->lat_len = 0;
+        pthread_mutex_unlock(&w->lat_lock);
+    }
+    return added;
+}
+
+static void print_latency(unsigned *v, int n) {
+    qsort(v, n, sizeof(*v), cmp_uint);
+    printf("p50 %u  p90 %u  p99 %u  p99.9 %u  max %u us",
+           pct(v, n, 50), pct(v, n, 90), pct(v, n, 99), pct(v, n, 99.9),
+           n ? v[n - 1] : 0);
+}
+
+// ===== Server under test (-X) =====
+
+static pid_t server_pid = 0;
+static char server_dir[] = "/tmp/loadgen-XXXXXX";
+
+// Remove a directory and the files in it (one level, which is all the
+// server writes there besides its log directory).
+static void remove_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    char path[512];
+
+    while (d && (e = readdir(d))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (e->d_type == DT_DIR) remove_dir(path);
+        else unlink(path);
+    }
+    if (d) closedir(d);
+    rmdir(dir);
+}
+
+static void stop_server(void) {
+    if (server_pid <= 0) return;
+    kill(server_pid, SIGINT);
+    waitpid(server_pid, NULL, 0);
+    server_pid = 0;
+    remove_dir(server_dir);
+}
+
+// Start "server -H -a" with room for the whole fleet and wait until it
+// accepts connections. Its own output goes to server.out in the temp dir.
+static int start_server(void) {
+    char cap[16], logs[64], sock[64], out[64], ckpt[64];
+
+    if (!mkdtemp(server_dir)) {
+        perror("[ERROR] mkdtemp");
+        return -1;
+    }
+    snprintf(cap, sizeof(cap), "%d", num_sensors + 64);
+    snprintf(logs, sizeof(logs), "%s/log", server_dir);
+    snprintf(sock, sizeof(sock), "%s/ctl.sock", server_dir);
+    snprintf(out, sizeof(out), "%s/server.out", server_dir);
+    snprintf(ckpt, sizeof(ckpt), "%s/factory.ckpt", server_dir);
+    server_pid = fork();
+    if (server_pid < 0) {
+        perror("[ERROR] fork");
+        return -1;
+    }
+    if (server_pid == 0) {
+        int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        execl(server_path, server_path, "-H", "-a", "-n", cap, "-L", logs,
+              "-U", sock, "-C", ckpt, "-i", "3600", (char *)NULL);
+        _exit(127);
+    }
+    atexit(stop_server);
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(PORT)};
+    inet_pton(AF_INET, SERVER_IP, &addr.sin_addr);
+    for (int tries = 0; tries < 100; tries++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0), ok;
+        ok = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if (waitpid(server_pid, NULL, WNOHANG) == server_pid) {
+            server_pid = 0;  // it died (port taken, bad path, ...)
+            printf("[FATAL] %s exited during startup, see %s\n", server_path, out);
+            return -1;
+        }
+        if (ok) return 0;
+        usleep(50000);
+    }
+    printf("[FATAL] %s did not start listening on port %d\n", server_path, PORT);
+    return -1;
+}
+
+static void write_json(const struct totals *t, double total_s, unsigned *lat,
+                       int n, int nsess) {
+    FILE *f = strcmp(json_path, "-") ? fopen(json_path, "w") : stdout;
+
+    if (!f) {
+        perror("[ERROR] -j");
+        return;
+    }
+    fprintf(f, "{\"time\":%ld,\"sensors\":%d,\"sessions\":%d,\"workers\":%d,"
+               "\"protocol\":\"%s\",\"burst\":%d,\"target_rate\":%.0f,"
+               "\"duration_s\":%.3f,\"samples\":%lu,\"rate\":%.1f,"
+               "\"mb_per_s\":%.3f,",
+            (long)time(NULL), num_sensors, nsess, num_workers,
+            use_binary ? PROTO_NAME : "text", burst, total_rate, total_s,
+            t->sent, t->sent / total_s, t->bytes / total_s / 1e6);
+    fprintf(f, "\"latency_us\":{\"count\":%d,\"p50\":%u,\"p90\":%u,"
+               "\"p99\":%u,\"p999\":%u,\"max\":%u},",
+            n, pct(lat, n, 50), pct(lat, n, 90), pct(lat, n, 99),
+            pct(lat, n, 99.9), n ? lat[n - 1] : 0);
+    fprintf(f, "\"stalled\":%lu,\"reconnects\":%lu,\"denied\":%lu,"
+               "\"commands\":%lu,\"acked\":%lu}\n",
+            t->stalled, t->reconnects, t->denied, t->cmds, t->acks);
+    if (f != stdout) fclose(f);
+}
+
+static void stop_handler(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+// ===== Main =====
+
+// "-m mode=1,temp=3,button=1,led=1"
+static int set_mix(char *spec) {
+    int total = 0;
+
+    memset(mix, 0, sizeof(mix));
+    for (char *tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '=');
+        int i;
+        for (i = 0; eq && i < NUM_MIX; i++)
+            if (strncmp(tok, mix_names[i], eq - tok) == 0 &&
+                strlen(mix_names[i]) == (size_t)(eq - tok))
+                break;
+        if (!eq || i == NUM_MIX || atoi(eq + 1) < 0) {
+            printf("[ERROR] Bad mix '%s' (mode, temp, button, led)\n", tok);
+            return -1;
+        }
+        mix[i] = atoi(eq + 1);
+        total += mix[i];
+    }
+    return total > 0 ? 0 : -1;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-n sensors] [-k per_session] [-w workers] [-r samples/s]\n"
+           "       [-m mode=1,temp=3,button=1,led=1] [-B burst] [-C churn_s]\n"
+           "       [-P ping_every] [-A ack_percent] [-D ack_delay_ms] [-d seconds] [-t]\n"
+           "       [-X ./server] [-j summary.json|-]\n",
+           prog);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:k:w:r:m:B:C:P:A:D:d:tX:j:h")) != -1) {
+        switch (opt) {
+        case 'n': num_sensors  = atoi(optarg); break;
+        case 'k': per_session  = atoi(optarg); break;
+        case 'w': num_workers  = atoi(optarg); break;
+        case 'r': total_rate   = atof(optarg); break;
+        case 'm': if (set_mix(optarg) < 0) return 1; break;
+        case 'B': burst        = atoi(optarg); break;
+        case 'C': churn_s      = atof(optarg); break;
+        case 'P': ping_every   = atoi(optarg); break;
+        case 'A': ack_percent  = atoi(optarg); break;
+        case 'D': ack_delay_ms = atoi(optarg); break;
+        case 'd': duration_s   = atoi(optarg); break;
+        case 't': use_binary   = 0; break;
+        case 'X': server_path  = optarg; break;
+        case 'j': json_path    = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (num_sensors < 1 || per_session < 1 || per_session > MAX_CHANNELS ||
+        num_workers < 1 || num_workers > MAX_WORKERS || total_rate <= 0 ||
+        burst < 1 || duration_s < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (num_workers > num_sensors) num_workers = num_sensors;
+
+    signal(SIGINT, stop_handler);
+    signal(SIGPIPE, SIG_IGN);
+    if (server_path && start_server() < 0) return 1;
+
+    // Sensors are dealt to workers in contiguous blocks, and each worker
+    // cuts its block into sessions of per_session sensors.
+    int nsess_total = 0;
+    for (int i = 0; i < num_workers; i++) {
+        struct worker *w = &workers[i];
+        int first = (long)num_sensors * i / num_workers;
+        int last  = (long)num_sensors * (i + 1) / num_workers;
+
+        w->no       = i;
+        w->nsensors = last - first;
+        w->nsess    = (w->nsensors + per_session - 1) / per_session;
+        w->sess     = calloc(w->nsess, sizeof(struct session));
+        w->rate     = total_rate * w->nsensors / num_sensors;
+        w->rng      = 0x9E3779B97F4A7C15ULL * (i + 1) ^ (uint64_t)mono_ns();
+        w->epfd     = epoll_create1(EPOLL_CLOEXEC);
+        pthread_mutex_init(&w->lat_lock, NULL);
+        if (!w->sess) {
+            perror("[ERROR] calloc");
+            return 1;
+        }
+        for (int k = 0; k < w->nsess; k++) {
+            struct session *s = &w->sess[k];
+            s->first = first + k * per_session;
+            s->nchan = last - s->first < per_session ? last - s->first : per_session;
+            if (session_open(w, s) < 0 && s->fd < 0 && k == 0 && i == 0) {
+                printf("[FATAL] Cannot reach the server on %s:%d "
+                       "(run it with -a so it accepts VSxxxxx IDs).\n",
+                       SERVER_IP, PORT);
+                return 1;
+            }
+        }
+        nsess_total += w->nsess;
+    }
+
+    struct totals t0, t1;
+    sum_workers(&t0);
+    printf("[INFO] %d sensors on %d sessions (%s), %d workers, target %.0f samples/s\n",
+           num_sensors, nsess_total, use_binary ? PROTO_NAME : "text",
+           num_workers, total_rate);
+    if (t0.denied)
+        printf("[WARN] Server denied %lu sensors (is it running with -a and -n big enough?)\n",
+               t0.denied);
+
+    for (int i = 0; i < num_workers; i++)
+        pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]);
+
+    unsigned *lat = NULL;
+    int lat_len = 0, lat_cap = 0;
+    long long start = mono_ns(), last = start;
+
+    for (int sec = 1; running && sec <= duration_s; sec++) {
+        struct timespec until = {0, 0};
+        long long wake = start + sec * 1000000000LL;
+        until.tv_sec  = wake / 1000000000LL;
+        until.tv_nsec = wake % 1000000000LL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR && running)
+            ;
+
+        long long now = mono_ns();
+        double dt = (now - last) / 1e9;
+        sum_workers(&t1);
+        int added = collect_latency(&lat, &lat_len, &lat_cap);
+
+        // sort a copy of the interval so the run total stays intact
+        unsigned *recent = malloc((added ? added : 1) * sizeof(unsigned));
+        memcpy(recent, lat + lat_len - added, added * sizeof(unsigned));
+        printf("[%3ds] sent %7.0f/s %6.1f MB/s  pongs %5lu  ", sec,
+               (t1.sent - t0.sent) / dt, (t1.bytes - t0.bytes) / dt / 1e6,
+               t1.pongs - t0.pongs);
+        print_latency(recent, added);
+        printf("  stalled %lu  reconn %lu  cmds %lu/%lu acked\n",
+               t1.stalled - t0.stalled, t1.reconnects - t0.reconnects,
+               t1.acks - t0.acks, t1.cmds - t0.cmds);
+        fflush(stdout);
+        free(recent);
+        t0 = t1;
+        last = now;
+    }
+
+    running = 0;
+    for (int i = 0; i < num_workers; i++) pthread_join(workers[i].tid, NULL);
+
+    double total_s = (mono_ns() - start) / 1e9;
+    sum_workers(&t1);
+    collect_latency(&lat, &lat_len, &lat_cap);
+    printf("\n[SUMMARY] %.1f s: %lu samples (%.0f/s of %.0f target), %.1f MB\n",
+           total_s, t1.sent, t1.sent / total_s, total_rate, t1.bytes / 1e6);
+    printf("[SUMMARY] end-to-end latency over %d pings: ", lat_len);
+    print_latency(lat, lat_len);
+    printf("\n[SUMMARY] stalled %lu, reconnects %lu, denied %lu, commands %lu (acked %lu)\n",
+           t1.stalled, t1.reconnects, t1.denied, t1.cmds, t1.acks);
+    if (json_path) write_json(&t1, total_s, lat, lat_len, nsess_total);
+    free(lat);
+    return 0;
+}
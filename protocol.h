@@ -0,0 +1,296 @@
+// protocol.h
+// client.c와 server.c가 함께 쓰는 바이너리 전송 형식 (BIN1).
+//
+// 접속하면 글자로 "ID:HELLO PROTO=BIN1\n"을 보내고, 서버가 이 형식을 알면
+// "ACCEPTED PROTO=BIN1 HANDLE=<번호>\n"으로 답한다. 그 뒤로 클라이언트가
+// 보내는 것은 모두 아래 프레임이다. 예전 서버는 그냥 "ACCEPTED\n"으로
+// 답하므로 그때는 지금까지처럼 "ID:STATUS\n" 글자로 보낸다. 서버도
+// HELLO 없이 글자로 오는 예전 장비를 그대로 받는다.
+//
+// 접속 하나에 센서 ID(채널)를 여러 개 실을 수 있다. 두 번째 ID부터는
+// 글자 접속이면 "ID2:HELLO PROTO=TEXT\n", BIN1 접속이면 BIN_HELLO 프레임을
+// 보내고 같은 형식의 답("ACCEPTED PROTO=... HANDLE=n" 또는 "DENIED")을
+// 받는다. 글자 줄은 앞의 ID로, 프레임은 handle로 채널이 정해지고, 서버가
+// 보내는 명령 줄도 "ID:CMD:..."라서 ID로 나누면 된다. HELLO에 PROTO=가
+// 붙은 답이 오지 않으면(예전 서버) ID마다 접속을 따로 연다.
+//
+// 프레임 = 8바이트 고정 헤더 + TLV 필드들. 모든 수는 little-endian.
+//   [magic 0xB1][type][len: u16][handle: u32]  [tag][len][value]...
+// handle은 서버가 준 센서 번호라서 매번 ID 문자열을 보낼 필요가 없다.
+// 서버가 클라이언트로 보내는 명령("ID:CMD:...")은 계속 글자다.
+//
+// 지연 측정: "ID:PING:<번호>" 줄이나 BIN_PING 프레임을 보내면 서버는 그
+// 앞의 보고를 모두 처리한 뒤 "ID:PONG:<번호>\n"으로 답한다 (loadgen.c).
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PROTO_NAME "BIN1"
+#define PROTO_TEXT "TEXT"
+#define PROTO_HELLO "HELLO PROTO="      // + PROTO_NAME 또는 PROTO_TEXT
+#define PROTO_ACCEPTED "ACCEPTED PROTO=" // + 이름 + " HANDLE=<번호>"
+#define BIN_MAGIC 0xB1
+#define BIN_HDR_SIZE 8
+#define BIN_MAX_PAYLOAD 255 // 프레임 하나의 TLV 전체 최대 길이
+
+// 기계 동작 모드
+enum { MODE_UNKNOWN, MODE_RUNNING, MODE_EMERGENCY };
+
+// 프레임 종류
+enum {
+  BIN_SAMPLE = 1, // 상태 보고 (TLV 필드들)
+  BIN_ACK = 2,    // 명령 응답 (TLV_CORR)
+  BIN_HELLO = 3,  // 채널 추가 (TLV_TEXT: 센서 ID, 헤더의 handle은 0)
+  BIN_PING = 4,   // 지연 측정 (TLV_CORR), 답은 글자 "ID:PONG:<번호>"
+};
+
+// TLV 태그
+enum {
+  TLV_MODE = 1,   // u8, MODE_*
+  TLV_TEMP = 2,   // f32 (NaN: 읽기 실패, 글자로는 N/A)
+  TLV_BUTTON = 3, // u8, 1: PRESSED
+  TLV_LED = 4,    // u8, 1: ON
+  TLV_ERROR = 5,  // 값 없음
+  TLV_TEXT = 6,   // 자유 문구 ("System Started" 등)
+  TLV_NOTE = 7,   // 괄호 안 설명 ("EMERGENCY")
+  TLV_CORR = 8,   // u32, 명령 상관 번호 (PING이면 PING 번호)
+};
+
+// 상태 보고 하나. fields에 있는 값만 유효하다.
+enum {
+  SF_MODE = 1,
+  SF_TEMP = 2,
+  SF_BUTTON = 4,
+  SF_LED = 8,
+  SF_ERROR = 16,
+  SF_TEXT = 32,
+  SF_NOTE = 64,
+};
+
+struct sample {
+  unsigned fields;
+  uint8_t mode, button, led;
+  float temp;
+  const char *text, *note; // NUL로 끝나지 않을 수 있음 (길이는 아래)
+  uint8_t text_len, note_len;
+};
+
+static const char *const MODE_NAMES[] = {"UNKNOWN", "RUNNING", "EMERGENCY"};
+
+static inline void put_u16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static inline void put_u32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static inline uint16_t get_u16(const uint8_t *p) { return p[0] | p[1] << 8; }
+
+static inline uint32_t get_u32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// 예전 글자 형식("MODE:RUNNING TEMP:23.5C", "BUTTON:PRESSED (EMERGENCY)")
+// 으로 바꾼다. ID와 줄바꿈은 붙이지 않는다. 쓴 길이를 돌려준다.
+static inline int sample_to_text(char *buf, int size, const struct sample *s) {
+  int n = 0;
+
+#define TEXT_PUT(...)                                                          \
+  do {                                                                         \
+    if (n < size)                                                              \
+      n += snprintf(buf + n, size - n, __VA_ARGS__);                           \
+  } while (0)
+  if (s->fields & SF_ERROR)
+    TEXT_PUT("ERROR");
+  if (s->fields & SF_TEXT)
+    TEXT_PUT("%s%.*s", n ? " " : "", s->text_len, s->text);
+  if (s->fields & SF_MODE)
+    TEXT_PUT("%sMODE:%s", n ? " " : "",
+             MODE_NAMES[s->mode <= MODE_EMERGENCY ? s->mode : 0]);
+  if ((s->fields & SF_TEMP) && s->temp == s->temp)
+    TEXT_PUT("%sTEMP:%.1fC", n ? " " : "", s->temp);
+  else if (s->fields & SF_TEMP)
+    TEXT_PUT("%sTEMP:N/A", n ? " " : "");
+  if (s->fields & SF_BUTTON)
+    TEXT_PUT("%sBUTTON:%s", n ? " " : "", s->button ? "PRESSED" : "RELEASED");
+  if (s->fields & SF_LED)
+    TEXT_PUT("%sLED:%s", n ? " " : "", s->led ? "ON" : "OFF");
+  if (s->fields & SF_NOTE)
+    TEXT_PUT("%s(%.*s)", n ? " " : "", s->note_len, s->note);
+#undef TEXT_PUT
+  return n < size ? n : size - 1;
+}
+
+static inline void bin_header(uint8_t *buf, int type, int len,
+                              uint32_t handle) {
+  buf[0] = BIN_MAGIC;
+  buf[1] = type;
+  put_u16(buf + 2, len);
+  put_u32(buf + 4, handle);
+}
+
+// 상태 보고를 프레임으로 만든다. 프레임 길이를, 넘치면 -1을 돌려준다.
+static inline int sample_to_bin(uint8_t *buf, int size, uint32_t handle,
+                                const struct sample *s) {
+  uint8_t *p = buf + BIN_HDR_SIZE;
+  int need = BIN_HDR_SIZE + 3 + 6 + 3 + 3 + 2 + (2 + s->text_len) +
+             (2 + s->note_len); // 모든 필드가 있을 때
+
+  if (need > size || need - BIN_HDR_SIZE > BIN_MAX_PAYLOAD)
+    return -1;
+  if (s->fields & SF_MODE) {
+    *p++ = TLV_MODE;
+    *p++ = 1;
+    *p++ = s->mode;
+  }
+  if (s->fields & SF_TEMP) {
+    uint32_t bits;
+    memcpy(&bits, &s->temp, 4);
+    *p++ = TLV_TEMP;
+    *p++ = 4;
+    put_u32(p, bits);
+    p += 4;
+  }
+  if (s->fields & SF_BUTTON) {
+    *p++ = TLV_BUTTON;
+    *p++ = 1;
+    *p++ = s->button;
+  }
+  if (s->fields & SF_LED) {
+    *p++ = TLV_LED;
+    *p++ = 1;
+    *p++ = s->led;
+  }
+  if (s->fields & SF_ERROR) {
+    *p++ = TLV_ERROR;
+    *p++ = 0;
+  }
+  if (s->fields & SF_TEXT) {
+    *p++ = TLV_TEXT;
+    *p++ = s->text_len;
+    memcpy(p, s->text, s->text_len);
+    p += s->text_len;
+  }
+  if (s->fields & SF_NOTE) {
+    *p++ = TLV_NOTE;
+    *p++ = s->note_len;
+    memcpy(p, s->note, s->note_len);
+    p += s->note_len;
+  }
+  bin_header(buf, BIN_SAMPLE, p - buf - BIN_HDR_SIZE, handle);
+  return p - buf;
+}
+
+// 명령 응답 프레임. 길이는 항상 BIN_HDR_SIZE + 6.
+static inline int bin_ack(uint8_t *buf, uint32_t handle, uint32_t corr) {
+  bin_header(buf, BIN_ACK, 6, handle);
+  buf[8] = TLV_CORR;
+  buf[9] = 4;
+  put_u32(buf + 10, corr);
+  return BIN_HDR_SIZE + 6;
+}
+
+// PING 프레임. 모양은 명령 응답과 같고 종류만 다르다.
+static inline int bin_ping(uint8_t *buf, uint32_t handle, uint32_t seq) {
+  bin_ack(buf, handle, seq);
+  buf[1] = BIN_PING;
+  return BIN_HDR_SIZE + 6;
+}
+
+// 채널 추가 프레임. 프레임 길이를, ID가 너무 길면 -1을 돌려준다.
+static inline int bin_hello(uint8_t *buf, int size, const char *id) {
+  int len = strlen(id);
+
+  if (len > BIN_MAX_PAYLOAD - 2 || BIN_HDR_SIZE + 2 + len > size)
+    return -1;
+  bin_header(buf, BIN_HELLO, 2 + len, 0);
+  buf[8] = TLV_TEXT;
+  buf[9] = len;
+  memcpy(buf + 10, id, len);
+  return BIN_HDR_SIZE + 2 + len;
+}
+
+// 버퍼 앞의 프레임 길이. 헤더가 덜 왔으면 0, 형식이 틀리면 -1.
+static inline int bin_frame_len(const uint8_t *buf, int avail) {
+  if (avail < 1)
+    return 0;
+  if (buf[0] != BIN_MAGIC)
+    return -1;
+  if (avail < BIN_HDR_SIZE)
+    return 0;
+  if (get_u16(buf + 2) > BIN_MAX_PAYLOAD)
+    return -1;
+  return BIN_HDR_SIZE + get_u16(buf + 2);
+}
+
+// 프레임의 TLV들을 s로 푼다. text/note는 프레임 안을 가리킨다.
+// 명령 응답이면 *corr도 채운다. 모르는 태그는 건너뛴다. 틀리면 -1.
+static inline int bin_decode(const uint8_t *frame, struct sample *s,
+                             uint32_t *corr) {
+  const uint8_t *p = frame + BIN_HDR_SIZE, *end = p + get_u16(frame + 2);
+
+  s->fields = 0;
+  while (p < end) {
+    int tag, len;
+    if (end - p < 2 || end - p - 2 < p[1])
+      return -1;
+    tag = p[0];
+    len = p[1];
+    p += 2;
+    switch (tag) {
+    case TLV_MODE:
+    case TLV_BUTTON:
+    case TLV_LED:
+      if (len != 1)
+        return -1;
+      if (tag == TLV_MODE) {
+        s->fields |= SF_MODE;
+        s->mode = *p;
+      } else if (tag == TLV_BUTTON) {
+        s->fields |= SF_BUTTON;
+        s->button = *p;
+      } else {
+        s->fields |= SF_LED;
+        s->led = *p;
+      }
+      break;
+    case TLV_TEMP:
+    case TLV_CORR:
+      if (len != 4)
+        return -1;
+      if (tag == TLV_TEMP) {
+        uint32_t bits = get_u32(p);
+        memcpy(&s->temp, &bits, 4);
+        s->fields |= SF_TEMP;
+      } else if (corr)
+        *corr = get_u32(p);
+      break;
+    case TLV_ERROR:
+      s->fields |= SF_ERROR;
+      break;
+    case TLV_TEXT:
+      s->fields |= SF_TEXT;
+      s->text = (const char *)p;
+      s->text_len = len;
+      break;
+    case TLV_NOTE:
+      s->fields |= SF_NOTE;
+      s->note = (const char *)p;
+      s->note_len = len;
+      break;
+    }
+    p += len;
+  }
+  return 0;
+}
+
+#endif
@@ -1,15 +1,34 @@
+#define _GNU_SOURCE // accept4
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <ncurses.h> // TUI 라이브러리
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
+
+#include "protocol.h"
+
 #ifdef USE_AUDIO
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_mixer.h>
@@ -20,565 +39,5063 @@ Mix_Chunk *alert = NULL, *sent = NULL;
 
 #define PORT 8080
 #define BUF_SIZE 1024
-#define LOG_SIZE 4096
-#define MAX_CLIENTS 10 // 최대 접속 가능한 기계 수
+#define LOG_QUEUE_SIZE 8192 // 기본 로그 큐 칸 수 (-Q, 2의 거듭제곱으로 올림)
+#define LOG_TEXT_LEN 480    // 로그 레코드 payload 최대 길이
+#define LOG_BATCH 256       // writev 한 번에 모아 쓰는 최대 줄 수
+#define LOG_LATE_MS 500     // 큐에서 이만큼 넘게 기다린 줄은 late로 센다
+#define MAX_SENSORS 16384 // 기본 최대 등록 가능한 기계 수 (-n 으로 변경)
+#define SENSOR_ID_LEN 24
+#define STATUS_LEN 128 // 화면에 보일 상태 메시지 길이
+// 추세 한 줄: ID + 값 이름(7) + " 1m min .. (개수)" 글자와 네 값 (보통 10자 안쪽)
+#define TREND_TEXT_LEN (SENSOR_ID_LEN + 104)
+#define UI_ROWS 10     // 한 화면에 보여줄 기계 수
+#define TS_RAW_SIZE 256 // 센서별 원본 값 보관 개수
+#define TS_SEC_SIZE 300 // 1초 묶음 보관 개수 (5분)
+#define TS_MIN_SIZE 240 // 1분 묶음 보관 개수 (4시간)
+#define MAX_EVENTS 256 // epoll_wait 한 번에 처리할 이벤트 수
+#define MAX_WORKERS 16 // ingest 이벤트 루프 최대 개수
+#define RBUF_SIZE 4096 // 접속별 수신 링 버퍼 크기 (2의 거듭제곱)
+#define OUT_MAX 65536  // 접속별 송신 큐 최대 크기 (넘으면 명령 거절)
+#define MAX_CHANNELS 32 // 접속 하나에 실을 수 있는 센서 ID 수
+#define RULE_NAME_LEN 24 // 경보 규칙 이름 길이 (예: "TEMP>80")
 
 // [공유 데이터] 모든 스레드가 이 변수를 함께 씁니다.
-char machine_status[MAX_CLIENTS][BUF_SIZE], time_buffer[BUF_SIZE],
-    log_buffer[LOG_SIZE]; // 각 기계의 상태 메시지 저장
-int active_clients[MAX_CLIENTS] = {0}, client_sockss[MAX_CLIENTS],
-    client_error[MAX_CLIENTS] = {0}, log_fd = 0,
-    keep_running = 1; // 접속 여부 (0: 끊김, 1: 연결됨)
-
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-
-struct tm time_struct;
-time_t t;
-
-const char *SENSOR_IDS[MAX_CLIENTS] = {
-    // ui에서 각 클라이언트가 특정 센서이므로 맞춤 프로토콜 필요 -> 센서마다
-    // 인덱스 고정 필요
-    "ARM01",    // index 0
-    "TEMP02",   // index 1
-    "BUTTON01", // index 2
-    "LED01",    // index 3
-    "sensor01", // index 4
-    "sensor02", // index 5
-    "sensor03", // index 6
-    "sensor04", // index 7
-    "sensor05", // index 8
-    "sensor06", // index 9
+int log_fd = 0, keep_running = 1;
+
+enum { CMD_NONE, CMD_PENDING, CMD_ACKED };
+// 상태 메시지에서 읽어낸 필드 표시
+enum {
+  PF_MODE = 1,
+  PF_TEMP = 2,
+  PF_BUTTON = 4,
+  PF_LED = 8,
+  PF_ERROR = 16,
+  PF_VALUE = 32, // 숫자 값 (TEMP 말고도 KEY:숫자 꼴이면)
+  PF_NOTE = 64,
 };
 
-#ifdef USE_AUDIO
-void init_audio() {
+static long long now_ns(clockid_t clk) {
+  struct timespec ts;
+  clock_gettime(clk, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-  if (SDL_Init(SDL_INIT_AUDIO) < 0)
-    return;
-  if (Mix_OpenAudio(48000, MIX_DEFAULT_FORMAT, 2, 4096) < 0)
-    return;
+// [계측] 스레드마다 자기 칸(struct metrics)에만 더하므로 락도 atomic도
+// 필요 없다. 읽는 쪽(통계 스레드, 제어 소켓, 통계 패널)이 모든 칸을 더해
+// 본다. 지연 시간은 HDR 방식 히스토그램에 넣는다: 2의 거듭제곱 구간마다
+// 16칸이라 어느 값이든 6% 안쪽 오차로 1024칸에 다 들어간다.
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+#define MAX_METRIC_THREADS 32
 
-  Ambience = Mix_LoadMUS("Ambience.mp3");
-  Intro = Mix_LoadMUS("Intro.mp3");
-  alert = Mix_LoadWAV("Alert.wav");
-  sent = Mix_LoadWAV("Sent.wav");
+enum { LK_CMD, LK_REGISTRY, LK_SERIES, LK_OUT, NUM_LOCKS };
+const char *const LOCK_NAMES[NUM_LOCKS] = {"cmd", "registry", "series", "out"};
 
-  Mix_VolumeMusic(64);
-  if (alert)
-    Mix_VolumeChunk(alert, 128);
-  if (sent)
-    Mix_VolumeChunk(sent, 32);
+struct metrics {
+  char name[16]; // "ingest-0", "ui" 등 (비어 있으면 안 쓰는 칸)
+  // 여기부터 끝까지 모두 unsigned long (합치고 빼기를 한 번에 한다)
+  unsigned long msgs, bytes, reads, errors, accepts, closes, handoffs;
+  unsigned long lock_acq[NUM_LOCKS], lock_contended[NUM_LOCKS];
+  unsigned long lock_wait_ns[NUM_LOCKS];
+  unsigned long log_depth_max; // 로그 큐 최대 깊이 (합칠 때는 최댓값)
+  unsigned long publish_sum_ns, cmd_sum_ns;
+  unsigned long hist_publish[HIST_BUCKETS]; // 읽은 뒤 상태 반영까지 (ns)
+  unsigned long hist_cmd[HIST_BUCKETS];     // 명령을 큐에 넣은 뒤 ACK까지
+} __attribute__((aligned(64)));
+#define METRIC_WORDS                                                           \
+  ((sizeof(struct metrics) - offsetof(struct metrics, msgs)) /                 \
+   sizeof(unsigned long))
+
+// 0번 칸은 이름을 받지 않은 스레드들(제어 소켓 등, 드물다)이 같이 쓴다.
+struct metrics all_metrics[MAX_METRIC_THREADS] = {{.name = "other"}};
+unsigned metric_threads = 1;
+static __thread struct metrics *my_metrics = &all_metrics[0];
+
+// 이 스레드에 칸을 하나 준다. 스레드가 시작할 때 한 번 부른다.
+void metrics_thread(const char *fmt, int n) {
+  unsigned i = __atomic_fetch_add(&metric_threads, 1, __ATOMIC_RELAXED);
+
+  if (i >= MAX_METRIC_THREADS)
+    return; // 넘치면 0번 칸을 같이 쓴다
+  snprintf(all_metrics[i].name, sizeof(all_metrics[i].name), fmt, n);
+  my_metrics = &all_metrics[i];
 }
-#endif
 
-void play_intro() {
-  // 글자 읽기
-  char line1[12][165], line2[13][165], line3[12][165];
-  FILE *f;
-  if (!(f = fopen("intro.txt", "r"))) {
+static inline unsigned hist_bucket(unsigned long v) {
+  int msb;
+
+  if (v < (1 << HIST_SUB_BITS))
+    return v;
+  msb = 63 - __builtin_clzl(v);
+  return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+         ((v >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+// 칸 b에 들어가는 가장 큰 값
+static unsigned long hist_upper(unsigned b) {
+  unsigned long mant = (1 << HIST_SUB_BITS) | (b & ((1 << HIST_SUB_BITS) - 1));
+
+  if (b < (1 << HIST_SUB_BITS))
+    return b;
+  return ((mant + 1) << ((b >> HIST_SUB_BITS) - 1)) - 1;
+}
+
+static inline void hist_record(unsigned long *h, unsigned long *sum,
+                               long long ns) {
+  if (ns < 0)
+    ns = 0;
+  h[hist_bucket(ns)]++;
+  *sum += ns;
+}
+
+static unsigned long hist_count(const unsigned long *h) {
+  unsigned long n = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++)
+    n += h[b];
+  return n;
+}
+
+// pct 백분위(0~100) 값. 그 값이 든 칸의 상한을 돌려준다. 비었으면 0.
+static unsigned long hist_pct(const unsigned long *h, double pct) {
+  unsigned long n = hist_count(h), want, seen = 0;
+
+  if (!n)
+    return 0;
+  want = (unsigned long)(n * pct / 100.0);
+  if (want < 1)
+    want = 1;
+  for (int b = 0; b < HIST_BUCKETS; b++)
+    if ((seen += h[b]) >= want)
+      return hist_upper(b);
+  return hist_upper(HIST_BUCKETS - 1);
+}
+
+// 락을 잡으면서 기다린 시간을 센다. 바로 잡히면 시계도 읽지 않는다.
+static void metered_lock(pthread_mutex_t *m, int which) {
+  struct metrics *mt = my_metrics;
+  long long t0;
+
+  mt->lock_acq[which]++;
+  if (pthread_mutex_trylock(m) == 0)
     return;
+  t0 = now_ns(CLOCK_MONOTONIC);
+  pthread_mutex_lock(m);
+  mt->lock_contended[which]++;
+  mt->lock_wait_ns[which] += now_ns(CLOCK_MONOTONIC) - t0;
+}
+
+// 모든 스레드의 칸을 더한다.
+void metrics_sum(struct metrics *t) {
+  unsigned n = __atomic_load_n(&metric_threads, __ATOMIC_RELAXED);
+  unsigned long *dst = &t->msgs;
+
+  memset(t, 0, sizeof(*t));
+  for (unsigned i = 0; i < n && i < MAX_METRIC_THREADS; i++) {
+    const unsigned long *src = &all_metrics[i].msgs;
+    for (size_t w = 0; w < METRIC_WORDS; w++)
+      dst[w] += __atomic_load_n(&src[w], __ATOMIC_RELAXED);
   }
-  for (int j = 0; j < 12; j++) {
-    fread(line1[j], sizeof(char), 164, f);
-    line1[j][164] = '\0';
-  }
-  fseek(f, 328, SEEK_CUR);
-  for (int j = 0; j < 13; j++) {
-    fread(line2[j], sizeof(char), 164, f);
-    line2[j][164] = '\0';
-  }
-  fseek(f, 164, SEEK_CUR);
-  for (int j = 0; j < 12; j++) {
-    fread(line3[j], sizeof(char), 164, f);
-    line3[j][164] = '\0';
-  }
-  fclose(f);
+  t->log_depth_max = 0; // 위에서 더해진 것 대신 최댓값
+  for (unsigned i = 0; i < n && i < MAX_METRIC_THREADS; i++)
+    if (all_metrics[i].log_depth_max > t->log_depth_max)
+      t->log_depth_max = all_metrics[i].log_depth_max;
+}
 
-  int float_cycle[8] = {0, 1, 1, 1, 0, -1, -1, -1}, add_pulse[11] = {0};
-  int inner_timer1, inner_timer2, color;
-  int base_color = 0;
-#ifdef USE_AUDIO
-  if (Intro)
-    Mix_PlayMusic(Intro, 1);
-#endif
-  // 인트로는 10초 동안 지속
-  for (int frame = 0; frame < 100; frame++) {
-    erase();
+// d = a - b (최근 구간의 값). 최대 깊이는 a의 것을 그대로 쓴다.
+static void metrics_diff(const struct metrics *a, const struct metrics *b,
+                         struct metrics *d) {
+  const unsigned long *pa = &a->msgs, *pb = &b->msgs;
+  unsigned long *pd = &d->msgs;
 
-    for (int k = 10; k >= 0; k--) {
-      if (k)
-        add_pulse[k] = add_pulse[k - 1];
-      else {
-        if (frame % 32 == 0)
-          add_pulse[k] = 8;
-        else
-          add_pulse[k] /= 2;
-      }
-    }
-    // 글자 애니매이션 타이머 지정
-    inner_timer1 = (frame > 20) ? frame - 20 : 0;
-    inner_timer2 = frame / 4 + 2;
+  for (size_t w = 0; w < METRIC_WORDS; w++)
+    pd[w] = pa[w] - pb[w];
+  d->log_depth_max = a->log_depth_max;
+}
 
-    base_color =
-        (240 >= 232 + (inner_timer1 / 4)) ? 232 + (inner_timer1 / 4) : 240;
+struct conn;
+struct series;
+struct rule;
+struct ruleset;
+struct rule_state;
 
-    // 글자 그리기
-    for (int i = 0; i < 12; i++) {
-      for (int j = 0; j < 163; j++) {
-        init_pair(10 + j / 16, base_color + add_pulse[j / 16], COLOR_BLACK);
-        attron(COLOR_PAIR(10 + j / 16));
+// 기계 하나의 상태를 한 곳에 모은 레코드. 예전에는 machine_status,
+// active_clients, client_sockss, client_error 네 배열에 흩어져 있었다.
+// 자주 바뀌는 필드를 앞에 두어 한 캐시 라인 안에서 끝나게 한다.
+// 상태는 seqlock으로 보호한다. 쓰는 쪽(ingest)은 seq를 홀수로 만들고 고친
+// 뒤 짝수로 돌려놓기만 하고, 읽는 쪽(UI)은 읽는 동안 seq가 바뀌었으면
+// 다시 읽는다. 그래서 UI가 아무리 오래 그려도 ingest는 기다리지 않는다.
+struct sensor {
+  unsigned seq; // seqlock 순번 (홀수: 쓰는 중)
+  int dirty;    // 1이면 UI가 이 줄을 다시 그려야 함
+  int active;   // 접속 여부 (0: 끊김, 1: 연결됨)
+  int error;  // 경보 중이면 1 (켜진 경보 규칙이 하나라도 있음)
+  struct conn *conn; // 명령을 보낼 접속 (cmd_lock을 잡고 써야 함)
+  struct series *ts;  // 숫자 값 시계열 (숫자를 보낸 적 없으면 NULL)
+  // 상태 메시지에서 읽어낸 마지막 값들 (fields에 있는 것만 유효)
+  unsigned fields;
+  unsigned char mode, button, led;
+  float temp;
+  unsigned long msgs, errors; // 받은 상태 보고 수, 그중 ERROR 수
+  // 마지막 명령과 응답(ACK) 상태
+  unsigned cmd_corr;   // 마지막 명령의 상관 번호
+  int cmd_state;       // CMD_NONE, CMD_PENDING, CMD_ACKED
+  long long cmd_sent;  // 큐에 넣은 시각 (ns)
+  long cmd_rtt_us;     // 큐에 넣은 뒤 ACK까지 걸린 시간
+  unsigned hash;
+  char id[SENSOR_ID_LEN];
+  char status[STATUS_LEN]; // 기계의 상태 메시지
+  // 경보 규칙. 쓰기 구간(sensor_write_begin/end) 안에서만 고친다.
+  const struct ruleset *rules;     // rule_state를 고를 때 쓴 규칙 묶음
+  struct rule_state *rule_state;   // 이 센서에 걸린 규칙과 그 상태
+  unsigned nrules, alerts;         // 걸린 규칙 수, 지금 켜진 경보 수
+  const struct rule *stale_rule;   // 가장 짧은 무응답 규칙 (없으면 NULL)
+  int stale_ms, stale;             // 그 한도, 무응답 경보 중이면 1
+  long long last_ms;               // 마지막 상태 보고 시각 (단조 시계 ms)
+  char alert_name[RULE_NAME_LEN];  // 마지막으로 켜진 규칙 이름
+  // 체크포인트에서 되살린 값이면 1 (다시 켠 뒤 아직 보고가 없음)과 그
+  // 값을 받았던 시각 (벽시계 ms)
+  int restored;
+  long long restored_ms;
+};
 
-        mvaddch(i + 4 + float_cycle[inner_timer2 % 8], j + 8, line1[i][j]);
-        mvaddch(i + 18 + float_cycle[(inner_timer2 - 1) % 8], j + 8,
-                line2[i][j]);
-        mvaddch(i + 32 + float_cycle[(inner_timer2 - 2) % 8], j + 8,
-                line3[i][j]);
+// [센서 명단] 시작할 때 파일에서 읽고, 실행 중에도 추가할 수 있다.
+// sensors[]는 등록 순서(= 화면 순서)대로 쌓이고, sensor_table은 ID 해시로
+// 인덱스를 찾는 open addressing 테이블이다. 삭제가 없으므로 조회는 락
+// 없이 하고, 추가만 registry_lock으로 직렬화한다.
+struct sensor *sensors;
+unsigned *sensor_table; // 0: 빈 칸, 그 외: 인덱스 + 1
+unsigned table_mask, sensor_count = 0, sensor_cap = MAX_SENSORS;
+int auto_register = 0; // 1이면 모르는 ID도 자동으로 등록
+const char *sensor_file = "sensors.conf";
+pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
 
-        attroff(COLOR_PAIR(10 + j / 16));
-      }
-    }
+// 명령 전송과 연결 종료만 서로 막는다. 닫힌 소켓 번호가 다른 접속에
+// 재사용된 뒤에 명령이 엉뚱한 곳으로 가지 않게 하기 위함. 센서의 cmd_*
+// 도 이 락 안에서만 고치고 본다. 상태 보고 경로는 이 락을 잡지 않고,
+// ACK를 받았을 때만 잠깐 잡는다.
+pthread_mutex_t cmd_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    refresh();
-    napms(100);
-  }
-#ifdef USE_AUDIO
-  Mix_HaltMusic();
-#endif
-  endwin();
-  printf("\e[8;23;60t");
-  fflush(stdout);
-  usleep(100000);
-  initscr();
+// 접속 하나당 상태. 스레드 대신 epoll 루프가 이 구조체를 들고 다닌다.
+struct conn {
+  int fd;
+  int epfd;         // 이 접속을 돌보는 epoll 루프
+  int binary;       // HELLO로 BIN1을 고른 뒤로는 프레임으로 받는다
+  int replay;       // 로그 재생이 만든 가짜 접속 (기록된 ID는 명단 밖이라도 받음)
+  // 이 접속에 실린 센서들 (sensors 인덱스). 장비 하나가 ARM01, TEMP02 등
+  // 여러 ID를 한 접속으로 보낼 수 있다. 예전 장비는 하나뿐이다.
+  int nchan;
+  int ids[MAX_CHANNELS];
+  // 수신 링 버퍼. head/tail/scan은 계속 증가하는 값이고 인덱스는 & 로 구함
+  unsigned head, tail, scan; // 쓴 위치 / 처리 안 된 줄 시작 / '\n' 탐색 위치
+  char rbuf[RBUF_SIZE];
+  // 송신 큐. UI가 넣고 epoll 루프가 EPOLLOUT 때 비운다.
+  pthread_mutex_t out_lock;
+  char *out;
+  unsigned out_len, out_cap;
+  int want_out; // EPOLLOUT을 켜 두었는지
+  int shard;    // 이 접속을 돌보는 ingest 루프 번호
+  int resume;   // 넘겨받은 뒤 링에 남은 줄을 아직 처리하지 않았으면 1
+};
+
+int server_sock = -1, num_workers = 1;
+
+// [샤딩] -P면 ingest 루프마다 SO_REUSEPORT 리스닝 소켓을 따로 열어서
+// 커널이 새 접속을 루프들에 나눠 준다 (접속 폭주 때 accept 하나가 밀리지
+// 않음). 또 기계 명단을 MAX_CHANNELS개씩 묶어 루프마다 번갈아 맡기고,
+// 접속의 첫 ID가 다른 루프 몫이면 그 줄을 처리하기 전에 그 루프로 접속을
+// 넘긴다. 그래서 한 기계의 레코드, 시계열, 송신 큐는 다시 접속해도 늘 같은
+// 루프(-c면 같은 코어)만 만진다. 한 접속에 실어 보내는 ID는 모두 첫 ID와
+// 같은 묶음이어야 하고, 다른 묶음의 ID는 DENIED로 거절한다.
+int sharded = 0;                    // -P
+int listen_fds[MAX_WORKERS];        // 루프별 리스닝 소켓 (-P가 아니면 모두 같음)
+int ingest_epfd[MAX_WORKERS];       // 루프별 epoll (다른 루프가 접속을 넘길 때 씀)
+int pin_cores[MAX_WORKERS], num_pin_cores = 0; // -c 0,2,4,6
+static __thread int my_shard = 0;
+
+static int sensor_shard(unsigned idx) {
+  return (idx / MAX_CHANNELS) % num_workers;
 }
 
-void send_command(char command[]) {
-  int ch, select = 0;
-  clear();
+// [이벤트 로그] factory.log에 글자로 쓰던 로그를 고정 헤더 + payload의
+// 바이너리 레코드로 log/ 디렉터리에 이어 쓴다. 파일은 크기나 시간이
+// 차면 다음 번호의 세그먼트로 넘어가고, 서버를 다시 켜도 예전 세그먼트는
+// 건드리지 않고 새 세그먼트부터 시작한다. 사람이 읽을 때는 ./server -d 로
+// 예전과 같은 "[시간] [MSG] From X: ..." 형식으로 풀어 본다.
+#define LOG_MAGIC 0x474f4c46u // "FLOG"
+#define LOG_VERSION 1
+#define NO_SENSOR 0xffffffffu
 
-  attron(COLOR_PAIR(1));
-  mvprintw(1, 10, "========================================");
-  mvprintw(2, 10, "           SELECT THE CLIENT            ");
-  mvprintw(3, 10, "========================================");
-  attroff(COLOR_PAIR(1));
+enum {
+  EV_START = 1,  // 서버 시작
+  EV_STOP,       // Ctrl+C로 종료
+  EV_CONNECT,    // 새 접속 시도
+  EV_MSG,        // From 센서: payload
+  EV_CMD,        // To 센서: payload
+  EV_CMD_FAIL,   // 명령 전송 실패
+  EV_DISCONNECT, // 센서 연결 끊김
+  EV_REGISTER,   // 센서 인덱스 <-> ID (payload = ID)
+  EV_INFO,       // 그 밖의 안내 문구 (payload = 글자)
+  EV_ACK,        // 센서가 명령을 받았다고 응답 (payload = "#번호 (x ms)")
+  EV_ALERT,      // 경보가 켜지거나 꺼짐 (payload = "RAISE TEMP>80 (81.5)")
+};
+#define EVF_DICT 1 // 세그먼트 앞에 다시 적는 명단. 풀어 볼 때는 숨긴다.
 
-  pthread_mutex_lock(&lock);
-  // 2. 기계 상태 목록 그리기
-  for (int i = 0; i < MAX_CLIENTS; i++) {
-    int row = 6 + i; // 6번째 줄부터 한 줄씩 출력
+// 세그먼트 맨 앞에 한 번 쓰는 헤더. 시작 시각의 벽시계/단조 시계 쌍으로
+// 레코드의 단조 시각을 실제 시각으로 바꾼다.
+struct seg_hdr {
+  uint32_t magic;
+  uint16_t version, hdr_size;
+  uint32_t seq;
+  int64_t wall_ns, mono_ns;
+} __attribute__((packed));
 
-    if (active_clients[i]) {
-      // 접속된 경우
-      attron(COLOR_PAIR(4));
-      mvprintw(row, 2, "[Machine %s]", SENSOR_IDS[i]);
-      attroff(COLOR_PAIR(4));
-    } else {
-      // 접속 안 된 경우
-      attron(COLOR_PAIR(5)); // 회색
-      mvprintw(row, 2, "Not available");
-      attroff(COLOR_PAIR(5));
-    }
+struct ev_hdr {
+  uint16_t len; // payload 길이
+  uint8_t type;
+  uint8_t flags;
+  uint32_t sensor; // 센서 인덱스 (없으면 NO_SENSOR)
+  int64_t mono_ns; // CLOCK_MONOTONIC
+  uint32_t check;  // check를 0으로 둔 헤더 + payload의 해시 (찢긴 꼬리 검출)
+} __attribute__((packed));
+
+void log_event(int type, int sensor, const char *payload, int len);
+
+// sensors.conf가 없을 때 쓰는 기본 명단
+const char *DEFAULT_SENSOR_IDS[] = {
+    "ARM01",    "TEMP02",   "BUTTON01", "LED01",    "sensor01",
+    "sensor02", "sensor03", "sensor04", "sensor05", "sensor06",
+};
+
+// FNV-1a
+static unsigned hash_id(const char *id, size_t len) {
+  unsigned h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)id[i]) * 16777619u;
+  return h;
+}
+
+// ID로 센서 인덱스를 찾는다. 못 찾으면 -1. 락 없이 불러도 된다.
+int sensor_lookup(const char *id, size_t len) {
+  unsigned h = hash_id(id, len);
+
+  if (len >= SENSOR_ID_LEN)
+    return -1;
+  for (unsigned i = h & table_mask;; i = (i + 1) & table_mask) {
+    unsigned slot = __atomic_load_n(&sensor_table[i], __ATOMIC_ACQUIRE);
+    if (!slot)
+      return -1;
+    struct sensor *sn = &sensors[slot - 1];
+    if (sn->hash == h && !strncmp(sn->id, id, len) && sn->id[len] == '\0')
+      return slot - 1;
   }
-  pthread_mutex_unlock(&lock);
-  mvaddch(6, 59, '<');
-  refresh();
+}
 
-  while (1) {
-    while ((ch = getch()) != -1) {
-      mvaddch(6 + select, 59, ' ');
+// 센서를 명단에 추가하고 인덱스를 돌려준다. 이미 있으면 그 인덱스를,
+// 명단이 가득 찼거나 ID가 너무 길면 -1을 돌려준다.
+int sensor_register(const char *id, size_t len) {
+  int idx, added = 0;
 
-      switch (ch) {
-      case KEY_UP:
-        if (!select)
-          select = MAX_CLIENTS - 1;
-        else
-          select -= 1;
-        break;
-      case KEY_DOWN:
-        select = (select + 1) % MAX_CLIENTS;
-        break;
-      case '\n':
-      case '\r':
-        move(6 + select, 0);
-        clrtoeol();
-        pthread_mutex_lock(&lock);
-
-        gettime_log();
-        if (!active_clients[select] ||
-            (write(client_sockss[select], command, strlen(command)) == -1)) {
-          attron(COLOR_PAIR(3));
-          mvprintw(6 + select, 2, "Failed!");
-          attroff(COLOR_PAIR(3));
-
-          snprintf(log_buffer, LOG_SIZE,
-                   "[%s] [INFO] Server has failed to send a command!\n",
-                   time_buffer);
-          write(log_fd, log_buffer, strlen(log_buffer));
-        } else {
-          attron(COLOR_PAIR(2));
-#ifdef USE_AUDIO
-          if (sent) {
-            Mix_PlayChannel(-1, sent, 0);
-          }
-#endif
-          mvprintw(6 + select, 2, "Successfully sent!");
-          attroff(COLOR_PAIR(2));
+  if (!len || len >= SENSOR_ID_LEN)
+    return -1;
+  metered_lock(&registry_lock, LK_REGISTRY);
+  if ((idx = sensor_lookup(id, len)) == -1 && sensor_count < sensor_cap) {
+    unsigned h = hash_id(id, len), i = h & table_mask;
+    struct sensor *sn = &sensors[sensor_count];
 
-          snprintf(log_buffer, LOG_SIZE, "[%s] [MSG] To %s: %s\n", time_buffer,
-                   SENSOR_IDS[select], command);
-          write(log_fd, log_buffer, strlen(log_buffer));
-        }
+    memcpy(sn->id, id, len);
+    sn->id[len] = '\0';
+    sn->hash = h;
+    while (sensor_table[i])
+      i = (i + 1) & table_mask;
+    idx = sensor_count;
+    // 레코드를 다 채운 뒤에 공개해야 락 없는 조회가 반쯤 쓴 값을 안 본다.
+    __atomic_store_n(&sensor_count, sensor_count + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&sensor_table[i], idx + 1, __ATOMIC_RELEASE);
+    added = 1;
+  }
+  pthread_mutex_unlock(&registry_lock);
+  if (added) // 실행 중에 추가된 센서는 로그에도 인덱스를 남긴다
+    log_event(EV_REGISTER, idx, id, len);
+  return idx;
+}
 
-        pthread_mutex_unlock(&lock);
-        refresh();
-        napms(1000);
-        return;
-      }
-    }
+// 명단 파일을 읽어 등록한다. 한 줄에 ID 하나, '#'부터는 주석.
+// 이미 등록된 ID는 건너뛰므로 실행 중에 다시 불러도 된다.
+int sensor_load(const char *path) {
+  char line[BUF_SIZE];
+  FILE *f;
+  int n = 0;
 
-    mvaddch(6 + select, 59, '<');
+  if (!(f = fopen(path, "r")))
+    return -1;
+  while (fgets(line, sizeof(line), f)) {
+    char *p = line, *end;
+    line[strcspn(line, "#\r\n")] = '\0';
+    while (isspace((unsigned char)*p))
+      p++;
+    for (end = p; *end && !isspace((unsigned char)*end); end++)
+      ;
+    if (end > p && sensor_register(p, end - p) != -1)
+      n++;
   }
-  refresh();
+  fclose(f);
+  return n;
 }
 
-// [UI 스레드] 0.1초마다 공유 데이터를 읽어서 화면을 새로 그립니다.
-void *draw_ui_thread(void *arg) {
-  const char loading[4] = {'|', '/', '-', '\\'},
-             *logo = "FACTORY MONITORING SYSTEM";
-  const int red_fade[] = {160, 124, 88, 52, 0, 0, 0, 0};
-  int move_bar[7] = {0};
-  char command[32];
-  int index = -1;
-  int global_timer = 0, mes_color = 2, logo_starts = 0, logo_pos = 0;
-  memset(command, 0, sizeof(command));
-  int ch;
-  initscr();     // ncurses 시작
-  curs_set(0);   // 커서 숨김
-  noecho();      // 키 입력 화면 노출 방지
-  start_color(); // 색상 모드 시작
-  keypad(stdscr, TRUE);
-  timeout(10);
+// 명단 배열과 해시 테이블만 만든다.
+void sensor_alloc() {
+  unsigned size = 1;
 
-  // 색상 정의 (번호, 글자색, 배경색)
-  init_pair(1, COLOR_CYAN, COLOR_BLACK); // 제목 (하늘색)
-  init_pair(2, COLOR_GREEN, COLOR_BLACK); // 클라이언트 연결됨 (초록색)
-  init_pair(3, COLOR_RED, COLOR_BLACK);   // 클라이언트 끊김 (빨간색)
-  init_pair(4, COLOR_YELLOW, COLOR_BLACK);
-  init_pair(5, 240, COLOR_BLACK);
-  for (int i = 0; i < 5; i++) {
-    init_pair(90 + i, 243 - 2 * i, COLOR_BLACK);
+  while (size < sensor_cap * 2) // 적재율 50% 이하로 유지
+    size <<= 1;
+  table_mask = size - 1;
+  sensors = calloc(sensor_cap, sizeof(struct sensor));
+  sensor_table = calloc(size, sizeof(unsigned));
+  if (!sensors || !sensor_table) {
+    printf("Not enough memory for %u sensors.\n", sensor_cap);
+    exit(1);
   }
-  play_intro();
+}
 
-#ifdef USE_AUDIO
-  if (Ambience && !Mix_PlayingMusic())
-    Mix_PlayMusic(Ambience, -1);
-#endif
-  while (keep_running) {
+void sensor_init() {
+  sensor_alloc();
+  if (sensor_load(sensor_file) == -1) {
+    for (size_t i = 0;
+         i < sizeof(DEFAULT_SENSOR_IDS) / sizeof(DEFAULT_SENSOR_IDS[0]); i++)
+      sensor_register(DEFAULT_SENSOR_IDS[i], strlen(DEFAULT_SENSOR_IDS[i]));
+  }
+}
 
-    // 커맨드 입력 처리
-    while ((ch = getch()) != -1) {
-      switch (ch) {
-      case '\n':
-      case '\r':
-        send_command(command);
-        memset(command, 0, sizeof(command));
-        index = -1;
-        break;
-      case KEY_BACKSPACE:
-        if (index > -1)
-          command[index--] = '\0';
-        break;
-      default:
-        if ((index < 31) && (ch >= 32 && ch <= 126)) {
-          command[++index] = (char)ch;
-          command[index + 1] = '\0';
-        }
-      }
-    }
+// UI 등 읽는 쪽이 보는 센서 상태 사본
+struct sensor_view {
+  int active, error;
+  unsigned cmd_corr;
+  int cmd_state;
+  long cmd_rtt_us;
+  unsigned fields;
+  unsigned char mode, button, led;
+  float temp;
+  char status[STATUS_LEN];
+  char alert[RULE_NAME_LEN]; // 경보 중일 때 마지막으로 켜진 규칙
+  int restored;              // 지난 실행의 마지막 값 (체크포인트)
+  long long seen_ms;         // restored일 때 그 값을 받은 시각 (벽시계 ms)
+};
 
-    if (global_timer % 2 == 0) {
-      for (int i = 0; i < 7; i++) {
-        if (move_bar[i] <= 1)
-          move_bar[i] = rand() % 4 + 2;
-        else
-          --move_bar[i];
-      }
-    }
+// 쓰기 시작. 같은 센서에 쓰는 쪽이 둘일 때(같은 ID로 두 번 접속)만 돈다.
+static void sensor_write_begin(struct sensor *sn) {
+  unsigned seq = __atomic_load_n(&sn->seq, __ATOMIC_RELAXED);
 
-    clear(); // 화면 지우기
-    init_pair(9, COLOR_WHITE, red_fade[global_timer % 8]);
-
-    // 1. 제목 그리기
-    attron(COLOR_PAIR(1));
-    logo_starts = 49 - (global_timer % 64);
-    mvprintw(1, 10, "========================================");
-    for (int k = 0; k < 25; k++) {
-      logo_pos = logo_starts + k;
-      if ((logo_pos >= 10) && (logo_pos < 50))
-        mvaddch(2, logo_pos, logo[k]);
-    }
-    mvprintw(3, 10, "========================================");
-    attroff(COLOR_PAIR(1));
-
-    pthread_mutex_lock(&lock);
-    // 2. 기계 상태 목록 그리기
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-      int row = 6 + i; // 6번째 줄부터 한 줄씩 출력
-
-      if (active_clients[i]) { // 접속된 경우
-        if (client_error[i]) {
-          mes_color = 9;
-        } else
-          mes_color = 2;
-        attron(COLOR_PAIR(mes_color)); // 초록색
-        mvprintw(row, 2, "[Machine %s] Status: %s", SENSOR_IDS[i],
-                 machine_status[i]); // 프로토콜 구체화 필요
-        attroff(COLOR_PAIR(mes_color));
-      } else {
-        // 접속 안 된 경우
-        attron(COLOR_PAIR(3)); // 빨간색
-        mvprintw(row, 2, "[Machine %s] Waiting for connection.\t\t  %c",
-                 SENSOR_IDS[i],
-                 loading[(global_timer % 4)]); // 프로토콜 구체화 필요
-        attroff(COLOR_PAIR(3));
-      }
-    }
-    pthread_mutex_unlock(&lock);
+  while ((seq & 1) ||
+         !__atomic_compare_exchange_n(&sn->seq, &seq, seq + 1, 1,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    seq = __atomic_load_n(&sn->seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-    // 3. 안내 문구
-    mvprintw(18, 2, "Command: ");
-    mvprintw(18, 11, "%s", command);
-    mvprintw(20, 2, "Listening on Port %d", PORT);
-    for (int i = 0; i < (global_timer % 8) / 2; i++) {
-      mvprintw(20, 24 + i, ".");
-    }
-    attron(COLOR_PAIR(5));
-    mvprintw(21, 2, "Press Ctrl+C to exit server.");
-    attroff(COLOR_PAIR(5));
+static void sensor_write_end(struct sensor *sn) {
+  __atomic_store_n(&sn->seq, sn->seq + 1, __ATOMIC_RELEASE);
+}
 
-    for (int i = 0; i < 7; i++) {
-      for (int j = 0; j < move_bar[i]; j++) {
-        attron(COLOR_PAIR(90 + j));
-        mvaddch(21 - j, 44 + 2 * i, '#');
-        attroff(COLOR_PAIR(90 + j));
-      }
-    }
+// 센서 상태를 락 없이 일관되게 복사한다. 쓰는 중이면 다시 읽는다.
+void sensor_snapshot(unsigned idx, struct sensor_view *v) {
+  struct sensor *sn = &sensors[idx];
+  unsigned s1, s2;
 
-    refresh(); // 실제 화면 업데이트
-    global_timer = (global_timer + 1) % 128;
-    napms(100); // 0.1초 휴식 (CPU 과부하 방지)
-  }
+  do {
+    while ((s1 = __atomic_load_n(&sn->seq, __ATOMIC_ACQUIRE)) & 1)
+      ;
+    v->active = sn->active;
+    v->error = sn->error;
+    v->cmd_corr = sn->cmd_corr;
+    v->cmd_state = sn->cmd_state;
+    v->cmd_rtt_us = sn->cmd_rtt_us;
+    v->fields = sn->fields;
+    v->mode = sn->mode;
+    v->button = sn->button;
+    v->led = sn->led;
+    v->temp = sn->temp;
+    memcpy(v->status, sn->status, STATUS_LEN);
+    memcpy(v->alert, sn->alert_name, RULE_NAME_LEN);
+    v->restored = sn->restored;
+    v->seen_ms = sn->restored_ms;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    s2 = __atomic_load_n(&sn->seq, __ATOMIC_RELAXED);
+  } while (s1 != s2);
+  v->status[STATUS_LEN - 1] = '\0';
+  v->alert[RULE_NAME_LEN - 1] = '\0';
+  if (!v->error)
+    v->alert[0] = '\0';
+}
 
-  pthread_mutex_lock(&lock);
+// [화면 갱신 알림] ingest가 상태를 바꾸면 그 센서를 dirty로 표시하고,
+// 그 센서가 지금 화면에 보이는 줄이면 UI를 깨운다. 이미 깨워 둔 상태면
+// 다시 write하지 않으므로 메시지가 아무리 많아도 프레임당 한 번만 깨운다.
+int ui_event_fd = -1, ui_wake_pending = 0;
+unsigned ui_top = 0;   // UI가 지금 보여주는 첫 번째 기계 인덱스
+int ui_fps = 10;       // 초당 최대 화면 갱신 횟수 (-r)
+int ui_animations = 1; // 0이면 흐르는 제목, 막대 등 장식을 끈다 (-q)
 
-  gettime_log();
-  snprintf(log_buffer, LOG_SIZE,
-           "[%s] [INFO] Server has been Ctrl^C'd. All the contents in the log "
-           "will be deleted "
-           "when the server is restarted.\n",
-           time_buffer);
-  write(log_fd, log_buffer, strlen(log_buffer));
+// [헤드리스 / 붙는 UI] -H면 ncurses, 인트로, 소리 없이 ingest와 로그,
+// 명령 처리만 돌리고 주기적으로 통계를 표준 출력에 찍는다. 제어 소켓(-U)
+// 으로 다른 프로세스가 상태를 읽고 명령을 보낼 수 있고, ./server -A 소켓
+// 은 그 소켓에 붙어서 같은 대시보드만 그린다 (ingest는 하지 않는다).
+int headless = 0;                      // -H
+const char *replay_path = NULL;        // 재생할 로그 (-p, [로그 재생] 참고)
+int stats_interval = 5;                // 헤드리스 통계 주기, 초 (-i)
+const char *ctl_path = "factory.sock"; // 제어 소켓 경로 (-U)
+const char *attach_path = NULL;        // 붙을 서버의 제어 소켓 (-A)
+int ctl_fd = -1;
+long long start_ns; // 서버 시작 시각 (CLOCK_MONOTONIC)
 
-#ifdef USE_AUDIO
-  if (Ambience)
-    Mix_FreeMusic(Ambience);
-  if (Intro)
-    Mix_FreeMusic(Intro);
-  if (alert)
-    Mix_FreeChunk(alert);
-  if (sent)
-    Mix_FreeChunk(sent);
+int attach_request(const char *req, void (*on_line)(char *line, void *arg),
+                   void *arg);
 
-  Mix_CloseAudio();
-  SDL_Quit();
-#endif
+// 통계 패널의 최근 구간 기준 (지난번에 본 합계)
+struct metrics_window {
+  struct metrics prev;
+  long long prev_ns;
+  unsigned long thread_msgs[MAX_METRIC_THREADS]; // 스레드별 지난번 msgs
+};
+int metrics_panel(struct metrics_window *w, char lines[][64], int max);
 
-  pthread_mutex_unlock(&lock);
+// 보이는 줄과 상관없이 UI를 깨운다 (명령 ACK 등).
+static void ui_wake() {
+  uint64_t one = 1;
 
-  endwin();
-  close(log_fd);
-  signal(SIGINT, SIG_DFL);
-  kill(getpid(), SIGINT);
-  return NULL;
+  if (ui_event_fd != -1 &&
+      !__atomic_exchange_n(&ui_wake_pending, 1, __ATOMIC_ACQ_REL))
+    write(ui_event_fd, &one, sizeof(one));
 }
 
-void gettime_log() {
-  t = time(NULL);
-  localtime_r(&t,
-              &time_struct); // 결과값을 내가 만든 변수 t에 담아줌 (안전)
-  strftime(time_buffer, BUF_SIZE, "%Y-%m-%d %H:%M:%S", &time_struct);
+static void ui_notify(unsigned idx) {
+  unsigned top = __atomic_load_n(&ui_top, __ATOMIC_RELAXED);
+  uint64_t one = 1;
+
+  __atomic_store_n(&sensors[idx].dirty, 1, __ATOMIC_RELEASE);
+  if (idx < top || idx >= top + UI_ROWS || ui_event_fd == -1)
+    return;
+  if (!__atomic_exchange_n(&ui_wake_pending, 1, __ATOMIC_ACQ_REL))
+    write(ui_event_fd, &one, sizeof(one));
 }
 
-// [작업 스레드] 클라이언트와 1:1로 대화하며 데이터를 공유 메모리에 적습니다.
-void *handle_client(void *arg) {
-  int client_sock = *((int *)arg);
-  free(arg);
+// SIGHUP을 받으면 명단 파일을 다시 읽어 새 ID만 추가하고, 경보 규칙
+// 파일도 다시 읽는다.
+volatile sig_atomic_t reload_sensors = 0, reload_rules = 0;
+void sensor_reload_requested() { reload_sensors = reload_rules = 1; }
+
+// [비동기 로거] 로그를 남기는 스레드는 큐에 레코드를 넣기만 하고, 실제
+// 디스크 쓰기는 로거 스레드가 모아서 writev 한 번으로 처리한다.
+// 큐는 칸마다 순번(seq)을 두는 고정 크기 링이라 생산자끼리 락 없이 CAS로
+// 자리를 잡는다. 큐가 가득 차면 기다리지 않고 버리고 dropped를 센다.
+// 칸 안에서 헤더와 payload가 붙어 있어서 그대로 파일에 쓴다.
+struct log_rec {
+  unsigned long seq;
+  struct ev_hdr hdr;
+  char payload[LOG_TEXT_LEN];
+};
 
-  char buffer[BUF_SIZE], temp_id[20], message[BUF_SIZE];
-  int str_len;
-  int id = -1;          // 초기화 (못 찾음 : -1)
-  int has_sent_msg = 0; // 센서 ID 확인용 플래그
+struct log_rec *log_queue;
+unsigned long log_queue_size = LOG_QUEUE_SIZE;
+unsigned long log_enq_pos = 0, log_deq_pos = 0;
+unsigned long log_dropped = 0, log_late = 0, log_written = 0;
+int log_flush_ms = 50;   // 로거 스레드가 큐를 비우는 주기 (-F)
+int log_fsync = 0;       // 0: 안 함, 1: 1초마다, 2: 매 writev마다 (-S)
+long log_rotate_mb = 64; // 세그먼트 최대 크기 (-R)
+long log_rotate_sec = 3600; // 세그먼트 최대 유지 시간 (-T)
+const char *log_dir = "log";
+int log_stop = 0;
+pthread_t log_tid;
+sem_t log_wake;
 
-  while (1) {
-    memset(buffer, 0, BUF_SIZE);
-    str_len = read(client_sock, buffer, BUF_SIZE);
-
-    if (str_len <= 0)
-      break; // 연결 종료
-
-    sscanf(buffer, "%[^:]:%[^\n]", temp_id, message);
-    buffer[strcspn(buffer, "\n")] = 0;
-    message[strcspn(buffer, "\n")] = 0;
-
-    if (id == -1) { // ui 상에서 아직 자리가 배정 안 됐다면
-      for (int i = 0; i < MAX_CLIENTS;
-           i++) { // 명단(SENSOR_IDS)을 탐색해 자리를 찾는다
-        if (SENSOR_IDS[i] != NULL && strcmp(temp_id, SENSOR_IDS[i]) == 0) {
-          id = i; // 자리를 찾음
-
-          pthread_mutex_lock(&lock);
-          active_clients[id] = 1;
-          client_sockss[id] = client_sock;
-          pthread_mutex_unlock(&lock);
-          break;
-        }
-      }
+// 지금 쓰고 있는 세그먼트
+unsigned log_seq = 0;
+long long log_seg_bytes = 0, log_seg_opened = 0;
 
-      // ID 확인 결과에 따라 답장 보내기
-      if (id == -1) {
-        printf("Unknown Sensor Rejected: %s\n", buffer); // 존재하지 않는 센서
-                                                         // ID
-        char *msg = "DENIED";
-        write(client_sock, msg, strlen(msg));
-        break; // 루프 탈출 -> 연결 종료
-      } else {
-        if (!has_sent_msg) { // 센서 ID 존재함 -> 승인 메시지 전송 (최초 1회만)
-          pthread_mutex_lock(&lock);
-          active_clients[id] = 1;
-          pthread_mutex_unlock(&lock);
-
-          char *msg = "ACCEPTED";
-          write(client_sock, msg, strlen(msg));
-          has_sent_msg = 1;
-        }
-      }
-    }
+static unsigned ev_check(const struct ev_hdr *h, const char *payload) {
+  struct ev_hdr tmp = *h;
+  unsigned c;
 
-    // 멀티쓰레드 서버용 안전한 버전
-    pthread_mutex_lock(&lock);
+  tmp.check = 0;
+  c = hash_id((const char *)&tmp, sizeof(tmp));
+  for (unsigned i = 0; i < h->len; i++)
+    c = (c ^ (unsigned char)payload[i]) * 16777619u;
+  return c;
+}
 
-    if (!strcmp("ERROR", message)) {
-      client_error[id] = 1;
-#ifdef USE_AUDIO
-      if (alert) {
-        Mix_PlayChannel(-1, alert, 0);
+// 레코드 하나를 큐에 넣는다. sensor가 -1이면 센서와 상관없는 이벤트.
+void log_event(int type, int sensor, const char *payload, int len) {
+  unsigned long pos = __atomic_load_n(&log_enq_pos, __ATOMIC_RELAXED);
+  struct log_rec *r;
+
+  if (!log_queue) // 로거를 켜기 전 (시작할 때 명단을 읽는 중)
+    return;
+  while (1) {
+    r = &log_queue[pos & (log_queue_size - 1)];
+    long diff = (long)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&log_enq_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        unsigned long depth =
+            pos + 1 - __atomic_load_n(&log_deq_pos, __ATOMIC_RELAXED);
+        if (depth > my_metrics->log_depth_max)
+          my_metrics->log_depth_max = depth;
+        break;
       }
-#endif
+    } else if (diff < 0) { // 가득 참
+      __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+      return;
     } else
-      client_error[id] = 0;
+      pos = __atomic_load_n(&log_enq_pos, __ATOMIC_RELAXED);
+  }
 
-    gettime_log();
-    snprintf(log_buffer, LOG_SIZE, "[%s] [MSG] From %s: %s\n", time_buffer,
-             temp_id, message);
-    write(log_fd, log_buffer, strlen(log_buffer));
+  if (len > LOG_TEXT_LEN)
+    len = LOG_TEXT_LEN;
+  r->hdr.len = len;
+  r->hdr.type = type;
+  r->hdr.flags = 0;
+  r->hdr.sensor = (sensor < 0) ? NO_SENSOR : (uint32_t)sensor;
+  r->hdr.mono_ns = now_ns(CLOCK_MONOTONIC);
+  if (len)
+    memcpy(r->payload, payload, len);
+  __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+  // 큐가 1/4씩 찰 때마다 주기를 기다리지 말고 바로 비우라고 깨운다.
+  if ((pos & (log_queue_size / 4 - 1)) == log_queue_size / 4 - 1)
+    sem_post(&log_wake);
+}
+
+// 안내 문구를 EV_INFO 레코드로 남긴다.
+void log_info(const char *fmt, ...) {
+  char text[LOG_TEXT_LEN];
+  va_list ap;
+  int len;
 
-    snprintf(machine_status[id], BUF_SIZE, "%s", buffer);
+  va_start(ap, fmt);
+  len = vsnprintf(text, sizeof(text), fmt, ap);
+  va_end(ap);
+  log_event(EV_INFO, -1, text, len < (int)sizeof(text) ? len : LOG_TEXT_LEN - 1);
+}
 
-    pthread_mutex_unlock(&lock);
+// 다 쓸 때까지 writev를 반복한다. 디스크 오류면 -1.
+static int writev_all(int fd, struct iovec *iov, int cnt) {
+  for (int done = 0; done < cnt;) {
+    ssize_t w = writev(fd, iov + done, cnt - done);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (done < cnt && (size_t)w >= iov[done].iov_len)
+      w -= iov[done++].iov_len;
+    if (done < cnt) {
+      iov[done].iov_base = (char *)iov[done].iov_base + w;
+      iov[done].iov_len -= w;
+    }
   }
+  return 0;
+}
 
-  if (id != -1) { // 연결 종료 처리
-    pthread_mutex_lock(&lock);
+static void segment_path(char *path, size_t size, const char *dir,
+                         unsigned seq) {
+  snprintf(path, size, "%s/factory-%06u.seg", dir, seq);
+}
 
-    active_clients[id] = 0;
-    gettime_log();
-    snprintf(log_buffer, LOG_SIZE,
-             "[%s] [INFO] Client [%s] has been disconnected.\n", time_buffer,
-             temp_id);
-    write(log_fd, log_buffer, strlen(log_buffer));
-    pthread_mutex_unlock(&lock);
-  }
-  close(client_sock);
-  return NULL;
+static int is_segment(const struct dirent *d) {
+  size_t n = strlen(d->d_name);
+  return !strncmp(d->d_name, "factory-", 8) && n > 4 &&
+         !strcmp(d->d_name + n - 4, ".seg");
 }
 
-void server_crashed() { keep_running = 0; }
+// 새 세그먼트를 열고 헤더와 센서 명단을 적는다. 예전 파일은 절대 다시
+// 열지 않으므로, 지난 실행이 레코드 중간에 죽었어도 그 꼬리만 버려진다.
+static void segment_open() {
+  struct seg_hdr sh;
+  char path[512];
+  unsigned count;
 
-int main() {
-  signal(SIGINT, server_crashed);
-  int server_sock, client_sock;
-  struct sockaddr_in server_addr, client_addr;
-  socklen_t client_addr_size;
-  pthread_t t_id, ui_tid;
-  if ((log_fd = open("factory.log", O_WRONLY | O_CREAT | O_TRUNC, 0644)) ==
-      -1) {
+  if (log_fd > 0) {
+    if (log_fsync)
+      fdatasync(log_fd);
+    close(log_fd);
+  }
+  segment_path(path, sizeof(path), log_dir, ++log_seq);
+  if ((log_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC,
+                     0644)) == -1) {
     printf("Something's wrong with opening the log file.\n");
     exit(1);
   }
-#ifdef USE_AUDIO
-  init_audio();
-#endif
-  srand(time(NULL));
 
-  // 소켓 생성 및 설정
-  server_sock = socket(PF_INET, SOCK_STREAM, 0);
-  int opt = 1;
-  setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  sh.magic = LOG_MAGIC;
+  sh.version = LOG_VERSION;
+  sh.hdr_size = sizeof(sh);
+  sh.seq = log_seq;
+  sh.wall_ns = now_ns(CLOCK_REALTIME);
+  sh.mono_ns = now_ns(CLOCK_MONOTONIC);
+  write(log_fd, &sh, sizeof(sh));
+  log_seg_bytes = sizeof(sh);
+  log_seg_opened = sh.mono_ns;
 
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  server_addr.sin_port = htons(PORT);
+  // 세그먼트 하나만 있어도 풀어 볼 수 있게 명단을 앞에 다시 적는다.
+  count = __atomic_load_n(&sensor_count, __ATOMIC_ACQUIRE);
+  for (unsigned i = 0; i < count; i++) {
+    struct ev_hdr h = {0};
+    struct iovec iov[2];
 
-  if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) ==
-      -1) {
-    perror("bind error");
-    exit(1);
+    h.len = strlen(sensors[i].id);
+    h.type = EV_REGISTER;
+    h.flags = EVF_DICT;
+    h.sensor = i;
+    h.mono_ns = sh.mono_ns;
+    h.check = ev_check(&h, sensors[i].id);
+    iov[0].iov_base = &h;
+    iov[0].iov_len = sizeof(h);
+    iov[1].iov_base = sensors[i].id;
+    iov[1].iov_len = h.len;
+    writev_all(log_fd, iov, 2);
+    log_seg_bytes += sizeof(h) + h.len;
   }
-  if (listen(server_sock, 5) == -1) {
-    perror("listen error");
-    exit(1);
+  if (log_fsync) { // 새 파일 이름도 디렉터리에 확실히 남긴다
+    int dfd = open(log_dir, O_RDONLY | O_DIRECTORY);
+    fsync(log_fd);
+    if (dfd != -1) {
+      fsync(dfd);
+      close(dfd);
+    }
   }
-  // 쓰레드 만들기 전이기 때문에 락 필요없음.
-  gettime_log();
-  snprintf(log_buffer, LOG_SIZE, "[%s] [INFO] Server has started.\n",
-           time_buffer);
-  write(log_fd, log_buffer, strlen(log_buffer));
+}
 
-  printf("\e[8;48;180t");
-  fflush(stdout);
-  usleep(100000);
-  // [핵심] UI 스레드 별도 실행
-  pthread_create(&ui_tid, NULL, draw_ui_thread, NULL);
-  pthread_detach(ui_tid);
+// 큐에 쌓인 레코드를 최대 LOG_BATCH개씩 모아 한 번에 쓴다. 쓴 개수를 돌려줌.
+static int log_flush_batch() {
+  struct iovec iov[LOG_BATCH];
+  long long now = now_ns(CLOCK_MONOTONIC), bytes = 0;
+  int n = 0;
 
-  // 메인 스레드는 계속 접속만 받음
+  if (log_seg_bytes >= log_rotate_mb * 1024 * 1024 ||
+      now - log_seg_opened >= log_rotate_sec * 1000000000LL)
+    segment_open();
+
+  while (n < LOG_BATCH) {
+    struct log_rec *r = &log_queue[(log_deq_pos + n) & (log_queue_size - 1)];
+    if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != log_deq_pos + n + 1)
+      break; // 아직 채워지지 않은 칸
+
+    r->hdr.check = ev_check(&r->hdr, r->payload);
+    iov[n].iov_base = &r->hdr;
+    iov[n].iov_len = sizeof(r->hdr) + r->hdr.len;
+    bytes += iov[n].iov_len;
+    if (now - r->hdr.mono_ns > LOG_LATE_MS * 1000000LL)
+      log_late++;
+    n++;
+  }
+  if (!n)
+    return 0;
+
+  writev_all(log_fd, iov, n); // 디스크 오류면 이번 묶음은 버린다
+  log_seg_bytes += bytes;
+  if (log_fsync == 2)
+    fdatasync(log_fd);
+
+  // 다 쓴 칸을 생산자에게 돌려준다.
+  for (int i = 0; i < n; i++) {
+    struct log_rec *r = &log_queue[(log_deq_pos + i) & (log_queue_size - 1)];
+    __atomic_store_n(&r->seq, log_deq_pos + i + log_queue_size,
+                     __ATOMIC_RELEASE);
+  }
+  log_deq_pos += n;
+  __atomic_fetch_add(&log_written, n, __ATOMIC_RELAXED);
+  return n;
+}
+
+// [로거 스레드] log_flush_ms마다, 또는 큐가 빨리 차면 그보다 먼저 깨어나
+// 큐를 비운다.
+void *log_thread(void *arg) {
+  long long last_sync = now_ns(CLOCK_MONOTONIC);
+
+  (void)arg;
+  metrics_thread("log", 0);
+  while (1) {
+    int stop = __atomic_load_n(&log_stop, __ATOMIC_ACQUIRE);
+
+    while (log_flush_batch() == LOG_BATCH)
+      ;
+    if (log_fsync == 1 && now_ns(CLOCK_MONOTONIC) - last_sync > 1000000000LL) {
+      fdatasync(log_fd);
+      last_sync = now_ns(CLOCK_MONOTONIC);
+    }
+    if (stop)
+      break; // stop을 본 뒤에 한 번 더 비웠으니 남은 레코드가 없다
+
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += log_flush_ms % 1000 * 1000000L;
+    until.tv_sec += log_flush_ms / 1000 + until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+    sem_timedwait(&log_wake, &until);
+  }
+  return NULL;
+}
+
+// 로그 디렉터리에서 가장 큰 세그먼트 번호를 찾아 그 다음 번호로 연다.
+void log_init() {
+  unsigned long size = 4;
+  struct dirent **names;
+  int n;
+
+  mkdir(log_dir, 0755);
+  if ((n = scandir(log_dir, &names, is_segment, alphasort)) < 0) {
+    printf("Something's wrong with opening the log directory.\n");
+    exit(1);
+  }
+  for (int i = 0; i < n; i++) {
+    unsigned seq;
+    if (sscanf(names[i]->d_name, "factory-%u.seg", &seq) == 1 && seq > log_seq)
+      log_seq = seq;
+    free(names[i]);
+  }
+  free(names);
+  segment_open();
+
+  while (size < log_queue_size)
+    size <<= 1;
+  log_queue_size = size;
+  log_queue = calloc(log_queue_size, sizeof(struct log_rec));
+  if (!log_queue) {
+    printf("Not enough memory for the log queue.\n");
+    exit(1);
+  }
+  for (unsigned long i = 0; i < log_queue_size; i++)
+    log_queue[i].seq = i;
+  sem_init(&log_wake, 0, 0);
+  pthread_create(&log_tid, NULL, log_thread, NULL);
+}
+
+// 남은 로그를 모두 쓰고 로거 스레드를 끝낸다.
+void log_shutdown() {
+  __atomic_store_n(&log_stop, 1, __ATOMIC_RELEASE);
+  sem_post(&log_wake);
+  pthread_join(log_tid, NULL);
+
+  // 로거 스레드가 끝났으니 마지막 통계는 여기서 직접 쓴다. 이 줄 자신은
+  // 아래 log_flush_batch가 실제로 쓸 때 log_written에 더해진다.
+  log_info("Log records written before this one: %lu, dropped: %lu, late: %lu",
+           log_written, log_dropped, log_late);
+  log_flush_batch();
+  if (log_fsync)
+    fdatasync(log_fd);
+  close(log_fd);
+}
+
+// 세그먼트에서 레코드 하나를 읽는다. payload는 64KB 이상이어야 한다.
+// 끝이면 0, 찢긴 꼬리나 깨진 레코드면 -1.
+static int segment_read(FILE *f, struct ev_hdr *h, char *payload) {
+  if (fread(h, sizeof(*h), 1, f) != 1)
+    return 0;
+  if (fread(payload, 1, h->len, f) != h->len || ev_check(h, payload) != h->check)
+    return -1;
+  payload[h->len] = '\0';
+  return 1;
+}
+
+// [디코더] 세그먼트 하나를 읽어 예전 factory.log 형식의 글자로 출력한다.
+// names[]는 센서 인덱스별 ID로, 세그먼트 앞의 명단과 EV_REGISTER로 채운다.
+// 찢긴 꼬리나 깨진 레코드를 만나면 그 세그먼트는 거기까지만 출력한다.
+int decode_segment(const char *path, FILE *out) {
+  static char (*names)[SENSOR_ID_LEN] = NULL;
+  static unsigned names_cap = 0;
+  struct seg_hdr sh;
+  struct ev_hdr h;
+  char payload[65536], stamp[32];
+  FILE *f = fopen(path, "rb");
+  int r;
+
+  if (!f)
+    return -1;
+  if (fread(&sh, sizeof(sh), 1, f) != 1 || sh.magic != LOG_MAGIC ||
+      sh.version != LOG_VERSION) {
+    fprintf(stderr, "%s: not a factory log segment\n", path);
+    fclose(f);
+    return -1;
+  }
+  fseek(f, sh.hdr_size, SEEK_SET);
+
+  while ((r = segment_read(f, &h, payload)) == 1) {
+    if (h.type == EV_REGISTER && h.sensor != NO_SENSOR) {
+      if (h.sensor >= names_cap) {
+        unsigned cap = names_cap ? names_cap : 64;
+        while (cap <= h.sensor)
+          cap *= 2;
+        names = realloc(names, cap * sizeof(*names));
+        memset(names + names_cap, 0, (cap - names_cap) * sizeof(*names));
+        names_cap = cap;
+      }
+      snprintf(names[h.sensor], SENSOR_ID_LEN, "%.*s", SENSOR_ID_LEN - 1,
+               payload);
+      if (h.flags & EVF_DICT)
+        continue;
+    }
+
+    time_t when = (sh.wall_ns + (h.mono_ns - sh.mono_ns)) / 1000000000LL;
+    struct tm tm;
+    localtime_r(&when, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    const char *id = (h.sensor < names_cap && names[h.sensor][0])
+                         ? names[h.sensor]
+                         : "?";
+
+    switch (h.type) {
+    case EV_START:
+      fprintf(out, "[%s] [INFO] Server has started.\n", stamp);
+      break;
+    case EV_STOP:
+      fprintf(out, "[%s] [INFO] Server has been Ctrl^C'd.\n", stamp);
+      break;
+    case EV_CONNECT:
+      fprintf(out,
+              "[%s] [INFO] New client has tried to connect. Check the log "
+              "right below for conformation.\n",
+              stamp);
+      break;
+    case EV_MSG:
+      fprintf(out, "[%s] [MSG] From %s: %s\n", stamp, id, payload);
+      break;
+    case EV_CMD:
+      fprintf(out, "[%s] [MSG] To %s: %s\n", stamp, id, payload);
+      break;
+    case EV_CMD_FAIL:
+      fprintf(out, "[%s] [INFO] Server has failed to send a command!\n", stamp);
+      break;
+    case EV_DISCONNECT:
+      fprintf(out, "[%s] [INFO] Client [%s] has been disconnected.\n", stamp,
+              id);
+      break;
+    case EV_REGISTER:
+      fprintf(out, "[%s] [INFO] Sensor [%s] has been registered.\n", stamp, id);
+      break;
+    case EV_ACK:
+      fprintf(out, "[%s] [MSG] Ack from %s: %s\n", stamp, id, payload);
+      break;
+    case EV_ALERT:
+      fprintf(out, "[%s] [ALERT] %s: %s\n", stamp, id, payload);
+      break;
+    default:
+      fprintf(out, "[%s] [INFO] %s\n", stamp, payload);
+    }
+  }
+  if (r == -1)
+    fprintf(stderr, "%s: truncated or corrupt record at offset %ld\n", path,
+            ftell(f));
+  fclose(f);
+  return 0;
+}
+
+// ./server -d 대상: 디렉터리면 안의 세그먼트를 번호 순서대로, 파일이면
+// 그 파일만 풀어서 표준 출력으로 보낸다.
+int decode_log(const char *target) {
+  struct dirent **names;
+  char path[512];
+  int n;
+
+  if ((n = scandir(target, &names, is_segment, alphasort)) < 0)
+    return decode_segment(target, stdout);
+  for (int i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "%s/%s", target, names[i]->d_name);
+    decode_segment(path, stdout);
+    free(names[i]);
+  }
+  free(names);
+  return 0;
+}
+
+// [시계열 저장소] 센서마다 payload에서 뽑은 숫자 값(TEMP:23.5C의 23.5 등)을
+// 고정 크기 링에 쌓아 둔다. 원본(raw), 1초, 1분 세 단계로 모아 두어서 로그를
+// 다시 읽지 않고도 최근 추세를 바로 물어볼 수 있다. 값과 시각은 열(column)
+// 별로 따로 배열에 두어 집계할 때 float 배열을 그대로 벡터 연산에 넘긴다.
+// 숫자를 보내는 센서에만 처음 값이 들어올 때 할당한다.
+enum { TS_RAW, TS_SEC, TS_MIN };
+
+// 1초/1분 단위 묶음 링. 시간 순서대로 뒤에 붙인다.
+struct ts_tier {
+  unsigned n, size;   // 지금까지 붙인 묶음 수, 링 크기
+  long long *start;   // 묶음 시작 시각 (ms)
+  float *min, *max, *sum;
+  unsigned *count;
+};
+
+struct series {
+  pthread_mutex_t lock; // 쓰는 ingest와 묻는 UI/알림만 잠깐 잡는다
+  char key[8];          // 값을 뽑은 필드 이름 (TEMP 등)
+  unsigned raw_n;       // 지금까지 들어온 원본 수
+  long long raw_t[TS_RAW_SIZE];
+  float raw_v[TS_RAW_SIZE];
+  struct ts_tier tier[2]; // [0]: 1초, [1]: 1분
+};
+
+// 집계 결과
+struct ts_stats {
+  unsigned n;
+  float min, max, mean, pct;
+};
+
+typedef float v4f __attribute__((vector_size(16)));
+typedef int v4i __attribute__((vector_size(16)));
+
+// 마스크로 두 벡터 중 하나를 고른다 (C에서는 벡터 삼항 연산이 안 된다).
+static inline v4f v4f_select(v4i mask, v4f a, v4f b) {
+  return (v4f)(((v4i)a & mask) | ((v4i)b & ~mask));
+}
+
+// min/max/sum을 4개씩 한꺼번에 구하는 커널. 한 구간(연속 배열)을 맡는다.
+static void kernel_minmax_sum(const float *restrict v, unsigned n, float *mn,
+                              float *mx, double *sum) {
+  unsigned i = 0;
+
+  if (n >= 4) {
+    v4f vmin, vmax, vsum = {0, 0, 0, 0};
+    memcpy(&vmin, v, sizeof(v4f));
+    vmax = vmin;
+    for (; i + 4 <= n; i += 4) {
+      v4f x;
+      memcpy(&x, v + i, sizeof(v4f));
+      vmin = v4f_select(x < vmin, x, vmin);
+      vmax = v4f_select(x > vmax, x, vmax);
+      vsum += x;
+    }
+    for (int k = 0; k < 4; k++) {
+      if (vmin[k] < *mn)
+        *mn = vmin[k];
+      if (vmax[k] > *mx)
+        *mx = vmax[k];
+      *sum += vsum[k];
+    }
+  }
+  for (; i < n; i++) {
+    if (v[i] < *mn)
+      *mn = v[i];
+    if (v[i] > *mx)
+      *mx = v[i];
+    *sum += v[i];
+  }
+}
+
+// 묶음 구간의 min은 min 열에서, max는 max 열에서, 합은 sum 열에서 구한다.
+static void kernel_tier(const struct ts_tier *t, unsigned from, unsigned n,
+                        float *mn, float *mx, double *sum, unsigned *count) {
+  float skip_mn = 1e30f, skip_mx = -1e30f;
+  double skip_sum = 0;
+
+  kernel_minmax_sum(t->min + from, n, mn, &skip_mx, &skip_sum);
+  kernel_minmax_sum(t->max + from, n, &skip_mn, mx, &skip_sum);
+  kernel_minmax_sum(t->sum + from, n, &skip_mn, &skip_mx, sum);
+  for (unsigned i = 0; i < n; i++)
+    *count += t->count[from + i];
+}
+
+// 링에서 cutoff 이후인 첫 위치(논리 순번)를 이분 탐색으로 찾는다.
+static unsigned ts_first_after(const long long *t, unsigned total,
+                               unsigned size, long long cutoff) {
+  unsigned lo = total > size ? total - size : 0, hi = total;
+
+  while (lo < hi) {
+    unsigned mid = lo + (hi - lo) / 2;
+    if (t[mid % size] < cutoff)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// k번째로 작은 값 (quickselect). v는 순서가 바뀐다.
+static float select_kth(float *v, unsigned n, unsigned k) {
+  unsigned lo = 0, hi = n - 1;
+
+  while (lo < hi) {
+    float pivot = v[lo + (hi - lo) / 2];
+    unsigned i = lo, j = hi;
+    while (i <= j) {
+      while (v[i] < pivot)
+        i++;
+      while (v[j] > pivot)
+        j--;
+      if (i <= j) {
+        float tmp = v[i];
+        v[i] = v[j];
+        v[j] = tmp;
+        i++;
+        if (j == 0)
+          break;
+        j--;
+      }
+    }
+    if (k <= j)
+      hi = j;
+    else if (k >= i)
+      lo = i;
+    else
+      break;
+  }
+  return v[k];
+}
+
+static struct ts_tier ts_tier_alloc(unsigned size) {
+  struct ts_tier t = {0};
+
+  t.size = size;
+  t.start = calloc(size, sizeof(long long));
+  t.min = calloc(size, sizeof(float));
+  t.max = calloc(size, sizeof(float));
+  t.sum = calloc(size, sizeof(float));
+  t.count = calloc(size, sizeof(unsigned));
+  return t;
+}
+
+static void ts_tier_add(struct ts_tier *t, long long bucket, float v) {
+  unsigned last = (t->n - 1) % t->size;
+
+  if (t->n && t->start[last] == bucket) {
+    if (v < t->min[last])
+      t->min[last] = v;
+    if (v > t->max[last])
+      t->max[last] = v;
+    t->sum[last] += v;
+    t->count[last]++;
+    return;
+  }
+  last = t->n++ % t->size;
+  t->start[last] = bucket;
+  t->min[last] = t->max[last] = t->sum[last] = v;
+  t->count[last] = 1;
+}
+
+static void series_free(struct series *s) {
+  for (int k = 0; k < 2; k++) {
+    free(s->tier[k].start);
+    free(s->tier[k].min);
+    free(s->tier[k].max);
+    free(s->tier[k].sum);
+    free(s->tier[k].count);
+  }
+  pthread_mutex_destroy(&s->lock);
+  free(s);
+}
+
+static struct series *series_alloc(void) {
+  struct series *s = calloc(1, sizeof(struct series));
+
+  if (!s)
+    return NULL;
+  pthread_mutex_init(&s->lock, NULL);
+  s->tier[0] = ts_tier_alloc(TS_SEC_SIZE);
+  s->tier[1] = ts_tier_alloc(TS_MIN_SIZE);
+  if (!s->tier[0].count || !s->tier[1].count) {
+    series_free(s);
+    return NULL;
+  }
+  return s;
+}
+
+// 센서의 시계열에 값 하나를 넣는다. 센서를 맡은 ingest 스레드가 부른다.
+void ts_append(unsigned idx, const char *key, int key_len, float v) {
+  struct sensor *sn = &sensors[idx];
+  struct series *s = __atomic_load_n(&sn->ts, __ATOMIC_ACQUIRE), *none = NULL;
+  long long t = now_ns(CLOCK_REALTIME) / 1000000;
+
+  if (!s) { // 처음 숫자가 들어온 센서만 메모리를 쓴다
+    if (!(s = series_alloc()))
+      return;
+    // 체크포인트 스레드가 지난 실행의 시계열을 먼저 붙였으면 그쪽에 잇는다
+    if (!__atomic_compare_exchange_n(&sn->ts, &none, s, 0, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+      series_free(s);
+      s = none;
+    }
+  }
+
+  metered_lock(&s->lock, LK_SERIES);
+  if (key_len > (int)sizeof(s->key) - 1)
+    key_len = sizeof(s->key) - 1;
+  memcpy(s->key, key, key_len);
+  s->key[key_len] = '\0';
+  s->raw_t[s->raw_n % TS_RAW_SIZE] = t;
+  s->raw_v[s->raw_n % TS_RAW_SIZE] = v;
+  s->raw_n++;
+  ts_tier_add(&s->tier[0], t / 1000 * 1000, v);
+  ts_tier_add(&s->tier[1], t / 60000 * 60000, v);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// 최근 window_ms 동안의 min/max/평균과 pct 백분위(0~100)를 구한다.
+// res가 TS_SEC/TS_MIN이면 미리 모아 둔 묶음으로 계산하므로 창이 길어도
+// 빠르다 (백분위는 묶음 평균들의 백분위). 값이 없으면 -1.
+int ts_query(unsigned idx, int res, long long window_ms, float pct,
+             struct ts_stats *out, char key[8]) {
+  struct series *s = __atomic_load_n(&sensors[idx].ts, __ATOMIC_ACQUIRE);
+  static __thread float scratch[TS_RAW_SIZE > TS_MIN_SIZE
+                                    ? (TS_RAW_SIZE > TS_SEC_SIZE ? TS_RAW_SIZE
+                                                                 : TS_SEC_SIZE)
+                                    : (TS_MIN_SIZE > TS_SEC_SIZE ? TS_MIN_SIZE
+                                                                 : TS_SEC_SIZE)];
+  long long cutoff = now_ns(CLOCK_REALTIME) / 1000000 - window_ms;
+  float mn = 1e30f, mx = -1e30f;
+  double sum = 0;
+  unsigned first, total, size, count = 0, n = 0;
+
+  if (!s)
+    return -1;
+  metered_lock(&s->lock, LK_SERIES);
+  if (key)
+    memcpy(key, s->key, sizeof(s->key));
+
+  if (res == TS_RAW) {
+    total = s->raw_n;
+    size = TS_RAW_SIZE;
+    first = ts_first_after(s->raw_t, total, size, cutoff);
+  } else {
+    struct ts_tier *t = &s->tier[res == TS_SEC ? 0 : 1];
+    total = t->n;
+    size = t->size;
+    // 창 시작이 걸친 묶음도 포함한다
+    first = ts_first_after(t->start, total, size,
+                           cutoff - (res == TS_SEC ? 1000 : 60000) + 1);
+  }
+
+  // 링 안에서 [first, total)는 많아야 두 개의 연속 구간이다.
+  for (unsigned pos = first; pos < total;) {
+    unsigned at = pos % size, len = size - at;
+    if (len > total - pos)
+      len = total - pos;
+    if (res == TS_RAW) {
+      kernel_minmax_sum(s->raw_v + at, len, &mn, &mx, &sum);
+      memcpy(scratch + n, s->raw_v + at, len * sizeof(float));
+      count += len;
+    } else {
+      struct ts_tier *t = &s->tier[res == TS_SEC ? 0 : 1];
+      kernel_tier(t, at, len, &mn, &mx, &sum, &count);
+      for (unsigned i = 0; i < len; i++)
+        scratch[n + i] = t->sum[at + i] / t->count[at + i];
+    }
+    n += len;
+    pos += len;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  if (!count)
+    return -1;
+  out->n = count;
+  out->min = mn;
+  out->max = mx;
+  out->mean = sum / count;
+  out->pct = select_kth(scratch, n, (unsigned)((n - 1) * pct / 100.0f + 0.5f));
+  return 0;
+}
+
+// [페이로드 파서] "MODE:RUNNING TEMP:23.5C", "BUTTON:PRESSED (EMERGENCY)",
+// "LED:ON" 같은 상태 메시지를 한 번 훑으면서 타입이 있는 필드로 바꾼다.
+// 수신 버퍼를 복사하지 않고 가리키기(view)만 하므로 sscanf, strcspn,
+// snprintf를 거치던 예전 경로보다 훨씬 싸다.
+struct str_view {
+  const char *p;
+  int len;
+};
+
+struct payload {
+  unsigned fields;           // 들어 있는 필드 (PF_*)
+  unsigned char mode;        // MODE_*
+  unsigned char button, led; // 1: PRESSED / ON
+  float temp;
+  struct str_view key; // 처음 나온 숫자 필드 이름 (시계열용)
+  float value;         // 그 값
+  struct str_view note; // 괄호 안 설명, 예: "EMERGENCY"
+};
+
+#define VIEW_IS(v, lit)                                                        \
+  ((v).len == (int)sizeof(lit) - 1 && !memcmp((v).p, lit, sizeof(lit) - 1))
+
+// "23.5C", "-4" 같은 숫자를 읽는다. 숫자가 아니면 0을 돌려준다.
+static int parse_number(const char *p, const char *end, float *out) {
+  const char *start = p;
+  float v = 0, scale = 1;
+  int neg = 0, digits = 0;
+
+  if (p < end && *p == '-') {
+    neg = 1;
+    p++;
+  }
+  for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+    v = v * 10 + (*p - '0');
+  if (p < end && *p == '.')
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+      v += (*p - '0') * (scale *= 0.1f);
+  if (!digits)
+    return 0;
+  *out = neg ? -v : v;
+  return p - start;
+}
+
+// msg(센서 ID 뒤의 내용)를 p에 풀어 넣는다. 아는 필드가 하나라도 있으면 1.
+int parse_payload(const char *msg, int len, struct payload *p) {
+  const char *cur = msg, *end = msg + len;
+
+  p->fields = 0;
+  if (len == 5 && !memcmp(msg, "ERROR", 5)) {
+    p->fields = PF_ERROR;
+    return 1;
+  }
+  while (cur < end) {
+    const char *tok = cur, *tok_end, *colon;
+    struct str_view key, val;
+    float num;
+
+    while (tok < end && *tok == ' ')
+      tok++;
+    tok_end = memchr(tok, ' ', end - tok);
+    if (!tok_end)
+      tok_end = end;
+    cur = tok_end + 1;
+    if (tok == tok_end)
+      continue;
+
+    if (*tok == '(' && tok_end[-1] == ')') { // "(EMERGENCY)"
+      p->note.p = tok + 1;
+      p->note.len = tok_end - tok - 2;
+      p->fields |= PF_NOTE;
+      continue;
+    }
+    if (!(colon = memchr(tok, ':', tok_end - tok)))
+      continue;
+    key.p = tok;
+    key.len = colon - tok;
+    val.p = colon + 1;
+    val.len = tok_end - colon - 1;
+
+    if (VIEW_IS(key, "MODE")) {
+      p->fields |= PF_MODE;
+      p->mode = VIEW_IS(val, "RUNNING")     ? MODE_RUNNING
+                : VIEW_IS(val, "EMERGENCY") ? MODE_EMERGENCY
+                                            : MODE_UNKNOWN;
+    } else if (VIEW_IS(key, "BUTTON")) {
+      p->fields |= PF_BUTTON;
+      p->button = VIEW_IS(val, "PRESSED");
+    } else if (VIEW_IS(key, "LED")) {
+      p->fields |= PF_LED;
+      p->led = VIEW_IS(val, "ON");
+    } else if (parse_number(val.p, val.p + val.len, &num)) {
+      if (VIEW_IS(key, "TEMP")) {
+        p->fields |= PF_TEMP;
+        p->temp = num;
+      }
+      if (!(p->fields & PF_VALUE)) { // 처음 나온 숫자 필드만 시계열에 쌓는다
+        p->fields |= PF_VALUE;
+        p->key = key;
+        p->value = num;
+      }
+    }
+  }
+  return p->fields != 0;
+}
+
+// [체크포인트] 센서마다 마지막 상태와 최근 값을 mmap한 파일(-C, 기본
+// factory.ckpt)에 주기적으로(-K초) 적어 둔다. 다시 켜면 이 파일을 바로
+// 매핑해서 명단과 마지막 값을 되살리므로, 센서가 다시 보고하기 전에도
+// 화면에 "Last known ... (stale)"로 보인다. 파일 안에는 같은 크기의 영역이
+// 두 개(A/B) 있어서 번갈아 쓰고, 다 쓴 뒤에야 헤더에 그 영역의 세대 번호와
+// 해시를 적는다. 쓰다가 죽어도 해시가 맞는 나머지 영역이 남는다. 쓰는
+// 쪽은 seqlock으로 센서를 읽기만 하므로 ingest는 기다리지 않는다.
+#define CKPT_MAGIC 0x504b4346u // "FCKP"
+#define CKPT_VERSION 1
+#define CKPT_RAW 16 // 센서별로 남기는 최근 원본 값 수
+#define CKPT_MIN 30 // 센서별로 남기는 최근 1분 묶음 수 (30분)
+
+struct ckpt_entry {
+  char id[SENSOR_ID_LEN];
+  char status[STATUS_LEN];
+  char key[8];      // 시계열 필드 이름 (없으면 빈 글자)
+  int64_t seen_ms;  // 마지막 상태 보고 (벽시계 ms, 0이면 보고 없음)
+  uint64_t msgs, errors;
+  uint32_t fields;
+  float temp;
+  uint8_t mode, button, led, nraw;
+  uint32_t nmin;
+  int64_t raw_t[CKPT_RAW];
+  float raw_v[CKPT_RAW];
+  int64_t min_start[CKPT_MIN];
+  float min_min[CKPT_MIN], min_max[CKPT_MIN], min_sum[CKPT_MIN];
+  uint32_t min_count[CKPT_MIN];
+};
+
+struct ckpt_region {
+  uint64_t gen;    // 클수록 최근 (0이면 아직 안 씀)
+  int64_t wall_ms; // 쓴 시각
+  uint32_t count;  // 적힌 센서 수
+  uint32_t check;  // 적힌 칸들의 해시
+};
+
+// 파일 맨 앞. 칸의 구조가 바뀌면 CKPT_VERSION을 올린다 (예전 파일은 버림).
+struct ckpt_hdr {
+  uint32_t magic;
+  uint16_t version, hdr_size;
+  uint32_t entry_size, cap; // 칸 크기, 영역당 칸 수 (-n)
+  struct ckpt_region region[2];
+};
+
+const char *ckpt_path = "factory.ckpt"; // -C
+int ckpt_interval = 2;                  // -K (0이면 끔)
+struct ckpt_hdr *ckpt_map;
+size_t ckpt_size;
+uint64_t ckpt_gen = 0; // 마지막으로 다 쓴 세대
+pthread_mutex_t ckpt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ckpt_entry *ckpt_entries(int r) {
+  return (struct ckpt_entry *)((char *)ckpt_map + ckpt_map->hdr_size) +
+         (size_t)r * ckpt_map->cap;
+}
+
+// 8바이트씩 FNV-1a 비슷하게 섞는다. 칸 크기는 8의 배수다.
+static unsigned ckpt_check(const void *p, size_t n) {
+  const uint64_t *w = p;
+  uint64_t h = 1469598103934665603ULL;
+
+  for (size_t i = 0; i < n / 8; i++)
+    h = (h ^ w[i]) * 1099511628211ULL;
+  return (unsigned)(h ^ (h >> 32));
+}
+
+// 센서 하나를 칸에 옮긴다. mono_to_wall은 단조 시계 ms를 벽시계로 바꾸는 차이.
+static void ckpt_fill(unsigned idx, struct ckpt_entry *e,
+                      long long mono_to_wall) {
+  struct sensor *sn = &sensors[idx];
+  struct series *s = __atomic_load_n(&sn->ts, __ATOMIC_ACQUIRE);
+  long long last = __atomic_load_n(&sn->last_ms, __ATOMIC_RELAXED);
+  struct sensor_view v;
+
+  sensor_snapshot(idx, &v);
+  memset(e, 0, sizeof(*e));
+  memcpy(e->id, sn->id, SENSOR_ID_LEN);
+  memcpy(e->status, v.status, STATUS_LEN);
+  e->seen_ms = v.restored ? v.seen_ms : last ? last + mono_to_wall : 0;
+  e->msgs = __atomic_load_n(&sn->msgs, __ATOMIC_RELAXED);
+  e->errors = __atomic_load_n(&sn->errors, __ATOMIC_RELAXED);
+  e->fields = v.fields;
+  e->temp = v.temp;
+  e->mode = v.mode;
+  e->button = v.button;
+  e->led = v.led;
+  if (!s)
+    return;
+
+  metered_lock(&s->lock, LK_SERIES);
+  memcpy(e->key, s->key, sizeof(e->key));
+  e->nraw = s->raw_n < CKPT_RAW ? s->raw_n : CKPT_RAW;
+  for (unsigned i = 0; i < e->nraw; i++) {
+    unsigned at = (s->raw_n - e->nraw + i) % TS_RAW_SIZE;
+    e->raw_t[i] = s->raw_t[at];
+    e->raw_v[i] = s->raw_v[at];
+  }
+  const struct ts_tier *t = &s->tier[1];
+  e->nmin = t->n < CKPT_MIN ? t->n : CKPT_MIN;
+  for (unsigned i = 0; i < e->nmin; i++) {
+    unsigned at = (t->n - e->nmin + i) % t->size;
+    e->min_start[i] = t->start[at];
+    e->min_min[i] = t->min[at];
+    e->min_max[i] = t->max[at];
+    e->min_sum[i] = t->sum[at];
+    e->min_count[i] = t->count[at];
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+// 칸 하나의 마지막 값을 센서로 되살린다. 명단에 없던 ID도 지난번에
+// 있었으니 등록한다. 센서 인덱스를 돌려준다 (못 하면 -1).
+static int ckpt_restore_entry(const struct ckpt_entry *e) {
+  struct sensor *sn;
+  int idx;
+
+  if (!e->id[0] || memchr(e->id, '\0', SENSOR_ID_LEN) == NULL ||
+      (idx = sensor_register(e->id, strlen(e->id))) == -1)
+    return -1;
+  sn = &sensors[idx];
+  sensor_write_begin(sn);
+  memcpy(sn->status, e->status, STATUS_LEN);
+  sn->status[STATUS_LEN - 1] = '\0';
+  sn->fields = e->fields & (PF_MODE | PF_TEMP | PF_BUTTON | PF_LED);
+  sn->temp = e->temp;
+  sn->mode = e->mode;
+  sn->button = e->button;
+  sn->led = e->led;
+  sn->msgs = e->msgs;
+  sn->errors = e->errors;
+  sn->restored = e->seen_ms != 0;
+  sn->restored_ms = e->seen_ms;
+  sensor_write_end(sn);
+  return idx;
+}
+
+// 칸에 남긴 최근 값으로 시계열을 다시 만든다. 1초 묶음은 원본 값으로
+// 다시 모은다. 그새 ingest가 새 시계열을 만들었으면 그쪽을 둔다.
+static void ckpt_restore_series(int idx, const struct ckpt_entry *e) {
+  struct series *s, *none = NULL;
+  unsigned nraw = e->nraw < CKPT_RAW ? e->nraw : CKPT_RAW;
+  unsigned nmin = e->nmin < CKPT_MIN ? e->nmin : CKPT_MIN;
+
+  if ((!nraw && !nmin) || __atomic_load_n(&sensors[idx].ts, __ATOMIC_ACQUIRE) ||
+      !(s = series_alloc()))
+    return;
+  memcpy(s->key, e->key, sizeof(s->key));
+  s->key[sizeof(s->key) - 1] = '\0';
+  for (unsigned i = 0; i < nraw; i++) {
+    s->raw_t[i] = e->raw_t[i];
+    s->raw_v[i] = e->raw_v[i];
+    ts_tier_add(&s->tier[0], e->raw_t[i] / 1000 * 1000, e->raw_v[i]);
+  }
+  s->raw_n = nraw;
+  for (unsigned i = 0; i < nmin; i++) {
+    s->tier[1].start[i] = e->min_start[i];
+    s->tier[1].min[i] = e->min_min[i];
+    s->tier[1].max[i] = e->min_max[i];
+    s->tier[1].sum[i] = e->min_sum[i];
+    s->tier[1].count[i] = e->min_count[i];
+  }
+  s->tier[1].n = nmin;
+  if (!__atomic_compare_exchange_n(&sensors[idx].ts, &none, s, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    series_free(s);
+}
+
+// 되살릴 영역. 시계열은 메모리를 많이 잡으므로 시작할 때는 마지막 값만
+// 되살리고, 시계열은 체크포인트 스레드가 처음 쓰기 전에 채운다.
+static const struct ckpt_hdr *ckpt_old;
+static size_t ckpt_old_size;
+static int ckpt_old_region;
+
+static void ckpt_restore_old_series(void) {
+  const struct ckpt_hdr *h = ckpt_old;
+  const struct ckpt_entry *e;
+  int idx;
+
+  if (!h)
+    return;
+  e = (const struct ckpt_entry *)((const char *)h + h->hdr_size +
+                                  (size_t)ckpt_old_region * h->cap *
+                                      h->entry_size);
+  for (unsigned i = 0; i < h->region[ckpt_old_region].count; i++)
+    if ((idx = sensor_lookup(e[i].id, strnlen(e[i].id, SENSOR_ID_LEN))) != -1)
+      ckpt_restore_series(idx, &e[i]);
+  munmap((void *)h, ckpt_old_size);
+  ckpt_old = NULL;
+}
+
+// 체크포인트 파일을 열어 매핑하고, 쓸 만한 영역이 있으면 되살린다.
+// 되살린 센서 수를 돌려준다. 구조가 다르거나 깨진 파일이면 새로 만든다.
+int ckpt_open(void) {
+  struct ckpt_hdr old = {0};
+  struct stat st;
+  int fd, r = -1, restored = 0;
+  void *map;
+
+  if (!ckpt_interval || !ckpt_path[0])
+    return 0;
+  if ((fd = open(ckpt_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+    perror("checkpoint open error");
+    return 0;
+  }
+  // 1. 예전 파일에서 해시가 맞는 가장 최근 영역의 마지막 값을 되살린다
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct ckpt_hdr) &&
+      (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) !=
+          MAP_FAILED) {
+    const struct ckpt_hdr *h = map;
+    if (h->magic == CKPT_MAGIC && h->version == CKPT_VERSION &&
+        h->entry_size == sizeof(struct ckpt_entry) &&
+        h->hdr_size >= sizeof(*h) &&
+        (off_t)h->hdr_size + 2 * (off_t)h->cap * h->entry_size <= st.st_size) {
+      old = *h;
+      for (int k = 0; k < 2; k++) {
+        const char *body = (const char *)map + h->hdr_size +
+                           (size_t)k * h->cap * h->entry_size;
+        if (h->region[k].gen && h->region[k].count <= h->cap &&
+            (r == -1 || h->region[k].gen > h->region[r].gen) &&
+            ckpt_check(body, (size_t)h->region[k].count * h->entry_size) ==
+                h->region[k].check)
+          r = k;
+      }
+      if (r != -1) {
+        const struct ckpt_entry *e =
+            (const struct ckpt_entry *)((const char *)map + h->hdr_size +
+                                        (size_t)r * h->cap * h->entry_size);
+        for (unsigned i = 0; i < h->region[r].count; i++)
+          restored += ckpt_restore_entry(&e[i]) != -1;
+        ckpt_gen = h->region[r].gen;
+      }
+    }
+    ckpt_old = map;
+    ckpt_old_size = st.st_size;
+    ckpt_old_region = r;
+    // 구조가 같으면 다음 쓰기는 다른 영역에 하므로 시계열은 나중에 채워도
+    // 된다. 구조가 바뀌면 곧 덮어쓸 수 있으니 지금 채운다.
+    if (r == -1) {
+      munmap(map, st.st_size);
+      ckpt_old = NULL;
+    } else if (old.cap != sensor_cap)
+      ckpt_restore_old_series();
+  }
+
+  // 2. 지금 -n에 맞는 크기로 다시 매핑한다. 같은 구조면 헤더는 그대로 둔다.
+  ckpt_size = 4096 + 2 * (size_t)sensor_cap * sizeof(struct ckpt_entry);
+  if (ftruncate(fd, ckpt_size) == -1 ||
+      (map = mmap(NULL, ckpt_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                  0)) == MAP_FAILED) {
+    perror("checkpoint mmap error");
+    close(fd);
+    ckpt_restore_old_series();
+    return restored;
+  }
+  close(fd);
+  ckpt_map = map;
+  if (old.magic != CKPT_MAGIC || old.cap != sensor_cap ||
+      old.hdr_size != 4096) {
+    memset(ckpt_map, 0, sizeof(*ckpt_map));
+    ckpt_map->magic = CKPT_MAGIC;
+    ckpt_map->version = CKPT_VERSION;
+    ckpt_map->hdr_size = 4096;
+    ckpt_map->entry_size = sizeof(struct ckpt_entry);
+    ckpt_map->cap = sensor_cap;
+  }
+  return restored;
+}
+
+// 지금 상태를 덜 최근인 영역에 다 쓰고 나서 헤더에 그 영역을 알린다.
+void ckpt_write(void) {
+  unsigned count = __atomic_load_n(&sensor_count, __ATOMIC_ACQUIRE);
+  long long mono_to_wall =
+      now_ns(CLOCK_REALTIME) / 1000000 - now_ns(CLOCK_MONOTONIC) / 1000000;
+  struct ckpt_entry *e;
+  size_t bytes, off;
+  int r;
+
+  if (!ckpt_map)
+    return;
+  pthread_mutex_lock(&ckpt_lock);
+  ckpt_restore_old_series(); // 스레드가 아직 못 채웠으면 지금
+  r = (ckpt_gen + 1) & 1;
+  e = ckpt_entries(r);
+  if (count > ckpt_map->cap)
+    count = ckpt_map->cap;
+  for (unsigned i = 0; i < count; i++)
+    ckpt_fill(i, &e[i], mono_to_wall);
+  bytes = (size_t)count * sizeof(*e);
+
+  // 본문이 디스크에 닿은 뒤에 헤더를 바꿔야 전원이 나가도 A/B 중 하나는 온전하다
+  off = (char *)e - (char *)ckpt_map;
+  msync((char *)ckpt_map + off / 4096 * 4096, bytes + off % 4096, MS_SYNC);
+  ckpt_map->region[r].count = count;
+  ckpt_map->region[r].check = ckpt_check(e, bytes);
+  ckpt_map->region[r].wall_ms = now_ns(CLOCK_REALTIME) / 1000000;
+  ckpt_map->region[r].gen = ++ckpt_gen;
+  msync(ckpt_map, sizeof(*ckpt_map), MS_SYNC);
+  pthread_mutex_unlock(&ckpt_lock);
+}
+
+void *ckpt_thread(void *arg) {
+  (void)arg;
+
+  metrics_thread("checkpoint", 0);
+  pthread_mutex_lock(&ckpt_lock);
+  ckpt_restore_old_series();
+  pthread_mutex_unlock(&ckpt_lock);
+  while (keep_running) {
+    for (int i = 0; i < ckpt_interval * 10 && keep_running; i++)
+      usleep(100000);
+    if (keep_running)
+      ckpt_write();
+  }
+  return NULL;
+}
+
+// [이벤트 버스] ingest는 일어난 일(센서 접속, 상태 보고, ERROR 보고, 연결
+// 끊김, 명령 전송과 ACK, 경보)을 bus_publish로 한 번만 알리고, 화면, 로그,
+// 소리는 각자 구독자로 받아 간다. 그래서 느린 소비자(디스크, SDL, curses)가
+// ingest를 붙잡지 않는다. 경보 규칙은 잃으면 안 되므로 구독자가 아니라
+// ingest가 직접 평가한다 ([경보 스레드] 참고). 구독자마다 받을 종류(mask)와,
+// 따라오지 못할 때의 정책이 있다.
+//   BUS_DIRECT   : 락 없는 자기 큐를 이미 가진 구독자(로그 링, UI의 dirty
+//                  표시 + eventfd)는 그 자리에서 자기 큐에 넣는다. 넘칠 때는
+//                  그 큐의 규칙을 따른다 (로그는 버리고 센다, UI는 합친다).
+//   BUS_DROP_NEW : 칸이 없으면 새 이벤트를 버린다.
+//   BUS_DROP_OLD : 칸이 없으면 가장 오래된 것을 버리고 넣는다 (소리).
+//                  버린 수는 factory_bus_dropped_total로 센다.
+// 생산자는 ingest 루프라서 어떤 구독자 때문에도 기다리지 않는다.
+// 구독자 큐는 로그 큐와 같이 칸마다 순번을 두는 고정 크기 링이라 생산자도
+// 소비자도 락을 잡지 않는다. 구독은 ingest를 띄우기 전에만 한다.
+enum {
+  BUS_CONNECT,    // 센서가 접속에 붙음
+  BUS_SAMPLE,     // 상태 보고 (p, text)
+  BUS_ERROR,      // ERROR 상태 보고 (p, text)
+  BUS_DISCONNECT, // 연결 끊김
+  BUS_CMD_SENT,   // 명령을 보냄 (corr, text)
+  BUS_CMD_ACKED,  // 명령 ACK (corr, rtt_us)
+  BUS_ALERT,      // 경보가 켜지거나 꺼짐 (on, text)
+  NUM_BUS_TYPES
+};
+#define BUS_MASK(t) (1u << (t))
+enum { BUS_DIRECT, BUS_DROP_NEW, BUS_DROP_OLD };
+static const char *BUS_POLICY_NAMES[] = {"direct", "drop_new", "drop_old"};
+#define MAX_BUS_SUBS 8
+
+struct bus_event {
+  int type;
+  int sensor;
+  long long mono_ns;
+  struct payload p; // SAMPLE, ERROR: 읽어낸 값 (key는 큐에 넣을 때 복사,
+                    // 수신 링을 가리키는 note는 큐에 넣을 때 지운다)
+  unsigned corr;
+  long rtt_us;
+  int on;
+  const char *text; // SAMPLE/ERROR: ID 뒤의 상태, CMD_SENT: 명령, ALERT: 문구
+  int text_len;
+};
+
+// 큐 칸. 꺼내면 ev의 포인터들이 이 칸의 복사본(key, text)을 가리킨다.
+struct bus_slot {
+  unsigned long seq;
+  struct bus_event ev;
+  char key[8];
+  char text[STATUS_LEN];
+};
+
+struct bus_sub {
+  const char *name;
+  unsigned mask;
+  int policy;
+  void (*deliver)(const struct bus_event *ev); // BUS_DIRECT
+  struct bus_slot *q;
+  unsigned long size, enq, deq;
+  unsigned long dropped;
+  int sleeping; // 소비자가 기다리는 중이면 1 (생산자가 깨운다)
+  sem_t wake;
+};
+
+struct bus_sub bus_subs[MAX_BUS_SUBS];
+int bus_nsubs = 0;
+
+// 구독자를 더한다. direct가 아니면 size칸(2의 거듭제곱으로 올림) 큐를 만든다.
+struct bus_sub *bus_subscribe(const char *name, unsigned mask, int policy,
+                              unsigned long size,
+                              void (*deliver)(const struct bus_event *)) {
+  struct bus_sub *s = &bus_subs[bus_nsubs];
+  unsigned long n = 4;
+
+  if (bus_nsubs == MAX_BUS_SUBS)
+    return NULL;
+  s->name = name;
+  s->mask = mask;
+  s->policy = policy;
+  s->deliver = deliver;
+  if (policy != BUS_DIRECT) {
+    while (n < size)
+      n <<= 1;
+    if (!(s->q = calloc(n, sizeof(struct bus_slot)))) {
+      printf("Not enough memory for the %s event queue.\n", name);
+      exit(1);
+    }
+    s->size = n;
+    for (unsigned long i = 0; i < n; i++)
+      s->q[i].seq = i;
+    sem_init(&s->wake, 0, 0);
+  }
+  __atomic_store_n(&bus_nsubs, bus_nsubs + 1, __ATOMIC_RELEASE);
+  return s;
+}
+
+static int bus_push(struct bus_sub *s, const struct bus_event *ev) {
+  unsigned long pos = __atomic_load_n(&s->enq, __ATOMIC_RELAXED);
+  struct bus_slot *slot;
+  int len;
+
+  while (1) {
+    slot = &s->q[pos & (s->size - 1)];
+    long diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&s->enq, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) // 가득 참
+      return -1;
+    else
+      pos = __atomic_load_n(&s->enq, __ATOMIC_RELAXED);
+  }
+  slot->ev = *ev;
+  len = ev->text_len < STATUS_LEN ? ev->text_len : STATUS_LEN;
+  if (len > 0)
+    memcpy(slot->text, ev->text, len);
+  slot->ev.text_len = len;
+  if (ev->p.fields & PF_VALUE) {
+    int klen = ev->p.key.len < 8 ? ev->p.key.len : 8;
+    memcpy(slot->key, ev->p.key.p, klen);
+    slot->ev.p.key.len = klen;
+  }
+  slot->ev.p.note.p = NULL; // 꺼낼 때쯤이면 수신 링이 덮였을 수 있다
+  slot->ev.p.note.len = 0;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// 하나 꺼내서 out에 복사한다. 비었으면 0. DROP_OLD면 생산자도 부른다.
+static int bus_take(struct bus_sub *s, struct bus_slot *out) {
+  unsigned long pos = __atomic_load_n(&s->deq, __ATOMIC_RELAXED);
+  struct bus_slot *slot;
+
+  while (1) {
+    slot = &s->q[pos & (s->size - 1)];
+    long diff =
+        (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&s->deq, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) // 비었음
+      return 0;
+    else
+      pos = __atomic_load_n(&s->deq, __ATOMIC_RELAXED);
+  }
+  out->ev = slot->ev;
+  memcpy(out->key, slot->key, sizeof(out->key));
+  memcpy(out->text, slot->text, slot->ev.text_len);
+  __atomic_store_n(&slot->seq, pos + s->size, __ATOMIC_RELEASE);
+  out->ev.text = out->text;
+  out->ev.p.key.p = out->key;
+  return 1;
+}
+
+// 소비자: 하나 꺼낸다. 비었으면 timeout_ms까지 기다려 보고 그래도 없으면 0.
+int bus_next(struct bus_sub *s, struct bus_slot *out, int timeout_ms) {
+  struct timespec until;
+
+  if (bus_take(s, out))
+    return 1;
+  if (timeout_ms <= 0)
+    return 0;
+  __atomic_store_n(&s->sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST); // 잠든다고 알린 뒤에 다시 본다
+  if (!bus_take(s, out)) {
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += timeout_ms % 1000 * 1000000L;
+    until.tv_sec += timeout_ms / 1000 + until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+    sem_timedwait(&s->wake, &until);
+    __atomic_store_n(&s->sleeping, 0, __ATOMIC_RELAXED);
+    return bus_take(s, out);
+  }
+  __atomic_store_n(&s->sleeping, 0, __ATOMIC_RELAXED);
+  return 1;
+}
+
+// 이벤트 하나를 받을 구독자 모두에게 나눠 준다.
+void bus_publish(const struct bus_event *ev) {
+  int n = __atomic_load_n(&bus_nsubs, __ATOMIC_ACQUIRE);
+
+  for (int i = 0; i < n; i++) {
+    struct bus_sub *s = &bus_subs[i];
+    struct bus_slot old;
+
+    if (!(s->mask & BUS_MASK(ev->type)))
+      continue;
+    if (s->policy == BUS_DIRECT) {
+      s->deliver(ev);
+      continue;
+    }
+    if (bus_push(s, ev) == -1) {
+      switch (s->policy) {
+      case BUS_DROP_NEW:
+        __atomic_fetch_add(&s->dropped, 1, __ATOMIC_RELAXED);
+        continue;
+      case BUS_DROP_OLD:
+        do {
+          if (bus_take(s, &old))
+            __atomic_fetch_add(&s->dropped, 1, __ATOMIC_RELAXED);
+        } while (bus_push(s, ev) == -1);
+        break;
+      }
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // 넣은 뒤에 잠들었는지 본다
+    if (__atomic_load_n(&s->sleeping, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&s->sleeping, 0, __ATOMIC_ACQ_REL))
+      sem_post(&s->wake);
+  }
+}
+
+// 로그 구독자: 이벤트를 예전과 같은 로그 레코드로 로그 링에 넣는다.
+static void log_deliver(const struct bus_event *ev) {
+  static const int types[NUM_BUS_TYPES] = {
+      [BUS_SAMPLE] = EV_MSG,     [BUS_ERROR] = EV_MSG,
+      [BUS_DISCONNECT] = EV_DISCONNECT, [BUS_CMD_SENT] = EV_CMD,
+      [BUS_ALERT] = EV_ALERT,
+  };
+  char text[64];
+  int len;
+
+  if (ev->type == BUS_CMD_ACKED) {
+    len = snprintf(text, sizeof(text), "#%u (%.1f ms)", ev->corr,
+                   ev->rtt_us / 1000.0);
+    log_event(EV_ACK, ev->sensor, text, len);
+  } else if (types[ev->type])
+    log_event(types[ev->type], ev->sensor, ev->text, ev->text_len);
+}
+
+// UI 구독자: 그 줄을 다시 그리라고 표시한다 (보이는 줄이면 UI를 깨운다).
+static void ui_deliver(const struct bus_event *ev) {
+  if (ev->type == BUS_CMD_ACKED)
+    ui_wake();
+  else
+    ui_notify(ev->sensor);
+}
+
+#define BUS_LOG_MASK                                                           \
+  (BUS_MASK(BUS_SAMPLE) | BUS_MASK(BUS_ERROR) | BUS_MASK(BUS_DISCONNECT) |     \
+   BUS_MASK(BUS_CMD_SENT) | BUS_MASK(BUS_CMD_ACKED) | BUS_MASK(BUS_ALERT))
+#define BUS_UI_MASK                                                            \
+  (BUS_MASK(BUS_CONNECT) | BUS_MASK(BUS_SAMPLE) | BUS_MASK(BUS_ERROR) |        \
+   BUS_MASK(BUS_DISCONNECT) | BUS_MASK(BUS_CMD_ACKED) | BUS_MASK(BUS_ALERT))
+
+// [경보 규칙] 규칙 파일(-e, 기본 rules.conf)에서 읽은 조건으로 센서마다
+// 경보를 켜고 끈다. 한 줄에 규칙 하나, '#'부터는 주석.
+//   대상  조건
+//   대상: ID, 접두어* (TEMP*), * (모두), 또는 쉼표로 이은 목록
+//   조건: ERROR                   상태 보고가 ERROR
+//         KEY > 값 [clear 값]     숫자 필드가 값을 넘으면. clear를 주면
+//         KEY < 값 [clear 값]     그 값을 다시 넘어와야 꺼진다 (히스테리시스)
+//         KEY rate 값 [clear 값]  초당 변화량(절댓값)이 값을 넘으면
+//         stale 초                그 시간 동안 상태 보고가 없으면
+// 규칙 파일이 없으면 "* ERROR" 하나만 쓴다 (예전과 같은 동작).
+// 센서에 걸리는 규칙은 그 센서의 첫 보고 때(규칙을 다시 읽었으면 그 뒤 첫
+// 보고 때) 한 번만 골라 두고, 보고마다는 그 센서에 걸린 규칙만 본다. 그래서
+// 규칙이 수천 개여도 보고 하나를 평가하는 비용은 늘지 않는다. 평가는
+// 경보 스레드가 이벤트 버스에서 보고를 받아 센서의 seqlock 쓰기 구간
+// 안에서 하므로 ingest를 붙잡지 않고 따로 잡는 락도 없다.
+enum { RULE_ERROR, RULE_ABOVE, RULE_BELOW, RULE_RATE, RULE_STALE };
+
+struct rule {
+  char target[64];
+  int kind;
+  char key[8]; // 숫자 필드 이름 ("TEMP" 등)
+  int key_len;
+  float on, off;            // 켜는 값, 끄는 값
+  char name[RULE_NAME_LEN]; // 화면과 로그에 보일 이름
+};
+
+struct ruleset {
+  struct rule *rules;
+  unsigned n;
+};
+
+// 센서에 걸린 규칙 하나의 상태
+struct rule_state {
+  const struct rule *r;
+  int on;            // 경보 중이면 1
+  float last;        // rate: 지난 값
+  long long last_ms; // rate: 지난 값의 시각 (0이면 아직 없음)
+};
+
+const char *rules_file = "rules.conf";
+// 지금 쓰는 규칙 묶음. 다시 읽으면 통째로 바꾸고, 예전 묶음은 아직 그것을
+// 가리키는 센서가 있을 수 있어서 풀지 않는다 (SIGHUP 때만 생긴다).
+struct ruleset *ruleset = NULL;
+
+static struct rule DEFAULT_RULE = {"*", RULE_ERROR, "", 0, 0, 0, "ERROR"};
+static struct ruleset DEFAULT_RULES = {&DEFAULT_RULE, 1};
+
+// 대상 목록 중 하나라도 id와 맞으면 1
+static int rule_matches(const char *target, const char *id) {
+  size_t id_len = strlen(id);
+
+  for (const char *p = target; *p;) {
+    size_t n = strcspn(p, ",");
+    if (n && p[n - 1] == '*') {
+      if (n - 1 <= id_len && !memcmp(p, id, n - 1))
+        return 1;
+    } else if (n == id_len && !memcmp(p, id, n))
+      return 1;
+    p += n + (p[n] == ',');
+  }
+  return 0;
+}
+
+// 한 줄을 규칙으로 바꾼다. 틀린 줄이면 -1.
+static int rule_parse(const char *line, struct rule *r) {
+  char key[16], op[8];
+  int used, n = 0;
+  float on, off;
+
+  memset(r, 0, sizeof(*r));
+  if (sscanf(line, "%63s %15s%n", r->target, key, &used) != 2)
+    return -1;
+  line += used;
+  if (!strcmp(key, "ERROR")) {
+    r->kind = RULE_ERROR;
+    snprintf(r->name, RULE_NAME_LEN, "ERROR");
+    return 0;
+  }
+  if (!strcmp(key, "stale")) {
+    if (sscanf(line, "%f", &on) != 1 || on <= 0)
+      return -1;
+    r->kind = RULE_STALE;
+    r->on = on;
+    snprintf(r->name, RULE_NAME_LEN, "stale%gs", on);
+    return 0;
+  }
+  if (strlen(key) >= sizeof(r->key) ||
+      sscanf(line, "%7s %f%n", op, &on, &n) != 2)
+    return -1;
+  off = on;
+  sscanf(line + n, " clear %f", &off);
+  if (!strcmp(op, ">")) {
+    r->kind = RULE_ABOVE;
+    off = off < on ? off : on;
+    snprintf(r->name, RULE_NAME_LEN, "%.7s>%g", key, on);
+  } else if (!strcmp(op, "<")) {
+    r->kind = RULE_BELOW;
+    off = off > on ? off : on;
+    snprintf(r->name, RULE_NAME_LEN, "%.7s<%g", key, on);
+  } else if (!strcmp(op, "rate")) {
+    r->kind = RULE_RATE;
+    off = off < on ? off : on;
+    snprintf(r->name, RULE_NAME_LEN, "%.7s~%g/s", key, on);
+  } else
+    return -1;
+  memcpy(r->key, key, strlen(key) + 1);
+  r->key_len = strlen(key);
+  r->on = on;
+  r->off = off;
+  return 0;
+}
+
+// 규칙 파일을 읽는다. 파일이 없으면 기본 규칙. 틀린 줄은 건너뛰고 로그에
+// 남기며, report가 있으면 거기에도 적는다.
+struct ruleset *rules_load(const char *path, FILE *report) {
+  struct ruleset *set;
+  char line[BUF_SIZE];
+  unsigned cap = 0, lineno = 0;
+  FILE *f;
+
+  if (!(f = fopen(path, "r")))
+    return &DEFAULT_RULES;
+  if (!(set = calloc(1, sizeof(*set)))) {
+    fclose(f);
+    return &DEFAULT_RULES;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    struct rule r;
+    lineno++;
+    line[strcspn(line, "#\r\n")] = '\0';
+    if (strspn(line, " \t") == strlen(line))
+      continue;
+    if (rule_parse(line, &r) == -1) {
+      log_info("%s:%u: bad alert rule", path, lineno);
+      if (report)
+        fprintf(report, "%s:%u: bad alert rule: %s\n", path, lineno, line);
+      continue;
+    }
+    if (set->n == cap) {
+      struct rule *grown;
+      cap = cap ? cap * 2 : 16;
+      if (!(grown = realloc(set->rules, cap * sizeof(*grown))))
+        break;
+      set->rules = grown;
+    }
+    set->rules[set->n++] = r;
+  }
+  fclose(f);
+  log_info("Loaded %u alert rules from %s", set->n, path);
+  return set;
+}
+
+// 센서에 걸릴 규칙을 고르고 상태를 처음부터 다시 잡는다. 쓰기 구간 안에서.
+static void rules_bind(struct sensor *sn, const struct ruleset *set) {
+  unsigned n = 0;
+
+  free(sn->rule_state);
+  sn->rule_state = NULL;
+  sn->rules = set;
+  sn->nrules = sn->alerts = 0;
+  sn->stale_rule = NULL;
+  sn->stale_ms = sn->stale = 0;
+  sn->error = 0;
+  if (!set)
+    return;
+  for (unsigned i = 0; i < set->n; i++)
+    n += rule_matches(set->rules[i].target, sn->id);
+  if (n && !(sn->rule_state = calloc(n, sizeof(struct rule_state))))
+    return;
+  for (unsigned i = 0; i < set->n; i++) {
+    const struct rule *r = &set->rules[i];
+    if (!rule_matches(r->target, sn->id))
+      continue;
+    if (r->kind == RULE_STALE) { // 무응답은 가장 짧은 한도 하나만 본다
+      if (!sn->stale_rule || r->on * 1000 < sn->stale_ms) {
+        sn->stale_rule = r;
+        __atomic_store_n(&sn->stale_ms, (int)(r->on * 1000), __ATOMIC_RELAXED);
+      }
+      continue;
+    }
+    sn->rule_state[sn->nrules++].r = r;
+  }
+}
+
+// 규칙 r이 보는 숫자 필드가 이 보고에 있으면 1
+static int rule_value(const struct rule *r, const struct payload *p,
+                      float *v) {
+  if (r->key_len == 4 && !memcmp(r->key, "TEMP", 4)) {
+    *v = p->temp;
+    return (p->fields & PF_TEMP) != 0;
+  }
+  *v = p->value;
+  return (p->fields & PF_VALUE) && p->key.len == r->key_len &&
+         !memcmp(p->key.p, r->key, r->key_len);
+}
+
+// 경보 하나를 켜거나 끈다. 쓰기 구간 안에서. 화면, 로그, 소리는 BUS_ALERT
+// 이벤트로 받아 간다.
+static void rule_change(unsigned idx, struct sensor *sn, const struct rule *r,
+                       int on, int has_value, float v) {
+  char text[64];
+  int len;
+
+  sn->alerts += on ? 1 : -1;
+  sn->error = sn->alerts > 0;
+  if (on)
+    memcpy(sn->alert_name, r->name, RULE_NAME_LEN);
+  len = snprintf(text, sizeof(text), "%s %s", on ? "RAISE" : "CLEAR", r->name);
+  if (has_value)
+    len += snprintf(text + len, sizeof(text) - len, " (%g)", v);
+  bus_publish(&(struct bus_event){.type = BUS_ALERT,
+                                  .sensor = idx,
+                                  .mono_ns = now_ns(CLOCK_MONOTONIC),
+                                  .on = on,
+                                  .text = text,
+                                  .text_len = len});
+}
+
+// 보고 하나로 이 센서의 규칙을 평가한다. 쓰기 구간 안에서 부른다.
+// 켜지거나 꺼진 경보 수를 돌려준다.
+static int rules_eval(unsigned idx, struct sensor *sn, const struct payload *p,
+                      long long now_ms) {
+  const struct ruleset *set = __atomic_load_n(&ruleset, __ATOMIC_ACQUIRE);
+  int changed = 0;
+
+  if (sn->rules != set)
+    rules_bind(sn, set);
+  __atomic_store_n(&sn->last_ms, now_ms, __ATOMIC_RELAXED);
+  if (sn->stale) { // 다시 보고가 왔으니 무응답 경보를 끈다
+    sn->stale = 0;
+    rule_change(idx, sn, sn->stale_rule, 0, 0, 0);
+  }
+  for (unsigned i = 0; i < sn->nrules; i++) {
+    struct rule_state *st = &sn->rule_state[i];
+    const struct rule *r = st->r;
+    int on = st->on, has_value = 1;
+    float v = 0, rate = 0;
+
+    switch (r->kind) {
+    case RULE_ERROR:
+      on = (p->fields & PF_ERROR) != 0;
+      has_value = 0;
+      break;
+    case RULE_ABOVE:
+      if (rule_value(r, p, &v))
+        on = v > (on ? r->off : r->on);
+      break;
+    case RULE_BELOW:
+      if (rule_value(r, p, &v))
+        on = v < (on ? r->off : r->on);
+      break;
+    case RULE_RATE:
+      if (!rule_value(r, p, &v) || now_ms <= st->last_ms)
+        break;
+      if (st->last_ms) {
+        rate = (v - st->last) * 1000 / (now_ms - st->last_ms);
+        rate = rate < 0 ? -rate : rate;
+        on = rate > (on ? r->off : r->on);
+      }
+      st->last = v;
+      st->last_ms = now_ms;
+      v = rate;
+      break;
+    }
+    if (on != st->on) {
+      st->on = on;
+      rule_change(idx, sn, r, on, has_value, v);
+      changed++;
+    }
+  }
+  return changed;
+}
+
+// 규칙 파일을 다시 읽는다 (SIGHUP). 센서들은 다음 보고 때 새 규칙을 고른다.
+void rules_reload() {
+  struct ruleset *set = rules_load(rules_file, NULL);
+  __atomic_store_n(&ruleset, set, __ATOMIC_RELEASE);
+}
+
+// [경보 스레드] 보고로 켜지고 꺼지는 규칙은 ingest가 보고를 반영할 때 바로
+// 평가한다 (publish_status). 센서마다 걸린 규칙 몇 개만 보므로 싸고, 큐가
+// 밀려서 ERROR나 한도를 넘은 값을 놓치는 일이 없다. 밖으로 나가는 일(로그,
+// 소리, 화면)만 BUS_ALERT로 버스에 맡긴다. stale은 시간이 지나서 켜지므로
+// 이 스레드가 0.25초마다 센서들의 마지막 보고 시각을 본다. 규칙 파일 다시
+// 읽기도 여기서 한다.
+
+static void stale_sweep(long long now_ms) {
+  unsigned count = __atomic_load_n(&sensor_count, __ATOMIC_ACQUIRE);
+
+  for (unsigned i = 0; i < count; i++) {
+    struct sensor *sn = &sensors[i];
+    int limit = __atomic_load_n(&sn->stale_ms, __ATOMIC_RELAXED);
+    long long last = __atomic_load_n(&sn->last_ms, __ATOMIC_RELAXED);
+
+    if (!limit || !last || now_ms - last < limit ||
+        __atomic_load_n(&sn->stale, __ATOMIC_RELAXED))
+      continue;
+    sensor_write_begin(sn);
+    if (sn->stale_rule && !sn->stale &&
+        sn->last_ms == last) { // 그새 보고가 왔으면 그만
+      sn->stale = 1;
+      rule_change(i, sn, sn->stale_rule, 1, 0, 0);
+    }
+    sensor_write_end(sn);
+  }
+}
+
+void *alerts_thread(void *arg) {
+  (void)arg;
+  metrics_thread("alerts", 0);
+  while (keep_running) {
+    if (reload_rules) {
+      reload_rules = 0;
+      rules_reload();
+    }
+    stale_sweep(now_ns(CLOCK_MONOTONIC) / 1000000);
+    usleep(250000);
+  }
+  return NULL;
+}
+
+#ifdef USE_AUDIO
+// [소리] 경보가 켜질 때와 명령을 보낼 때. SDL이 느려도 다른 일은 기다리지
+// 않고, 밀리면 오래된 소리부터 버린다.
+struct bus_sub *audio_sub;
+
+void *audio_thread(void *arg) {
+  struct bus_slot slot;
+
+  (void)arg;
+  metrics_thread("audio", 0);
+  while (keep_running) {
+    if (!bus_next(audio_sub, &slot, 250))
+      continue;
+    if (slot.ev.type == BUS_ALERT && slot.ev.on && alert)
+      Mix_PlayChannel(-1, alert, 0);
+    else if (slot.ev.type == BUS_CMD_SENT && sent)
+      Mix_PlayChannel(-1, sent, 0);
+  }
+  return NULL;
+}
+#endif
+
+#ifdef USE_AUDIO
+void init_audio() {
+
+  if (SDL_Init(SDL_INIT_AUDIO) < 0)
+    return;
+  if (Mix_OpenAudio(48000, MIX_DEFAULT_FORMAT, 2, 4096) < 0)
+    return;
+
+  Ambience = Mix_LoadMUS("Ambience.mp3");
+  Intro = Mix_LoadMUS("Intro.mp3");
+  alert = Mix_LoadWAV("Alert.wav");
+  sent = Mix_LoadWAV("Sent.wav");
+
+  Mix_VolumeMusic(64);
+  if (alert)
+    Mix_VolumeChunk(alert, 128);
+  if (sent)
+    Mix_VolumeChunk(sent, 32);
+}
+
+// 소리를 켜고 소리 스레드를 버스에 붙인다.
+void audio_start() {
+  pthread_t tid;
+
+  init_audio();
+  audio_sub = bus_subscribe("audio", BUS_MASK(BUS_ALERT) | BUS_MASK(BUS_CMD_SENT),
+                            BUS_DROP_OLD, 64, NULL);
+  pthread_create(&tid, NULL, audio_thread, NULL);
+  pthread_detach(tid);
+}
+#endif
+
+// [인트로] intro.txt의 글자 세 덩어리가 위아래로 흔들리며 밝아지는 10초짜리
+// 장면. 프레임마다 달라지는 것은 덩어리별 흔들림과 16칸 묶음별 색뿐이라서
+// 시작할 때 그 값을 100프레임 모두 미리 계산해 두고, 색(232~248번)마다 색
+// 쌍을 하나씩 고정해 둔다. 그리는 쪽은 init_pair 없이 16칸씩 한 번에 쓴다.
+// UI 루프가 틱마다 한 프레임씩 그리므로 그동안에도 ingest와 키 입력은 살아
+// 있고, 아무 키나 누르거나 -N이면 건너뛴다.
+#define INTRO_FRAMES 100
+#define INTRO_WIDTH 163
+#define INTRO_GROUPS ((INTRO_WIDTH + 15) / 16) // 색이 같은 16칸 묶음 수
+#define INTRO_PAIR 10   // 인트로 색 쌍 번호의 시작 (INTRO_PAIR + 색 - 232)
+#define INTRO_COLORS 17 // 232 ~ 248
+
+struct intro_frame {
+  signed char dy[3];                 // 세 덩어리의 위아래 흔들림
+  unsigned char pair[INTRO_GROUPS];  // 16칸 묶음마다 쓸 색 쌍
+};
+
+struct intro {
+  char text[3][12][165];
+  struct intro_frame frames[INTRO_FRAMES];
+  int frame; // 다음에 그릴 프레임 (INTRO_FRAMES면 끝남)
+};
+
+int skip_intro = 0; // -N
+
+// intro.txt를 읽고 모든 프레임을 미리 계산한다. 파일이 없으면 -1.
+static int intro_load(struct intro *in) {
+  const int float_cycle[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+  int add_pulse[INTRO_GROUPS] = {0};
+  FILE *f;
+
+  if (!(f = fopen("intro.txt", "r")))
+    return -1;
+  for (int b = 0; b < 3; b++) {
+    if (b)
+      fseek(f, 2 * 164, SEEK_CUR); // 덩어리 사이의 두 줄은 건너뛴다
+    for (int j = 0; j < 12; j++) {
+      if (fread(in->text[b][j], 1, 164, f) != 164)
+        memset(in->text[b][j], ' ', 164);
+      in->text[b][j][164] = '\0';
+    }
+  }
+  fclose(f);
+
+  for (int frame = 0; frame < INTRO_FRAMES; frame++) {
+    struct intro_frame *fr = &in->frames[frame];
+    int fade = frame > 20 ? frame - 20 : 0;  // 21번째 프레임부터 밝아진다
+    int wave = frame / 4 + 2;                // 흔들림 위상
+    int base = 232 + (fade / 4 < 8 ? fade / 4 : 8);
+
+    for (int k = INTRO_GROUPS - 1; k >= 0; k--) // 맥박이 오른쪽으로 번진다
+      add_pulse[k] = k ? add_pulse[k - 1]
+                       : (frame % 32 == 0 ? 8 : add_pulse[0] / 2);
+    for (int b = 0; b < 3; b++)
+      fr->dy[b] = float_cycle[(wave - b) % 8];
+    for (int g = 0; g < INTRO_GROUPS; g++)
+      fr->pair[g] = INTRO_PAIR + base + add_pulse[g] - 232;
+  }
+  for (int c = 0; c < INTRO_COLORS; c++)
+    init_pair(INTRO_PAIR + c, 232 + c, COLOR_BLACK);
+  in->frame = 0;
+  return 0;
+}
+
+// 미리 계산한 프레임 하나를 그린다. 맨 아랫줄에는 지금 붙은 기계 수.
+static void intro_draw(const struct intro *in, int frame) {
+  const struct intro_frame *fr = &in->frames[frame];
+  unsigned count = __atomic_load_n(&sensor_count, __ATOMIC_ACQUIRE), active = 0;
+
+  erase();
+  for (int b = 0; b < 3; b++)
+    for (int i = 0; i < 12; i++)
+      for (int g = 0; g < INTRO_GROUPS; g++) {
+        int n = INTRO_WIDTH - g * 16 < 16 ? INTRO_WIDTH - g * 16 : 16;
+        attron(COLOR_PAIR(fr->pair[g]));
+        mvaddnstr(i + 4 + 14 * b + fr->dy[b], g * 16 + 8,
+                  in->text[b][i] + g * 16, n);
+        attroff(COLOR_PAIR(fr->pair[g]));
+      }
+  for (unsigned i = 0; i < count; i++)
+    active += __atomic_load_n(&sensors[i].active, __ATOMIC_RELAXED);
+  attron(COLOR_PAIR(5));
+  mvprintw(LINES - 1, 2, "Press any key to skip.  %u/%u machines connected",
+           active, count);
+  attroff(COLOR_PAIR(5));
+  refresh();
+}
+
+// 인트로를 끝내고 창을 대시보드 크기로 되돌린다. 창 크기가 바뀌면
+// ncurses가 KEY_RESIZE를 주므로 endwin/initscr 없이 그대로 이어 그린다.
+static void intro_finish(struct intro *in) {
+  in->frame = INTRO_FRAMES;
+#ifdef USE_AUDIO
+  Mix_HaltMusic();
+  if (Ambience)
+    Mix_PlayMusic(Ambience, -1);
+#endif
+  printf("\e[8;23;60t");
+  fflush(stdout);
+  erase();
+}
+
+// [송신 큐] 어느 스레드에서든 접속에 보낼 데이터를 넣는다. 소켓에는 직접
+// 쓰지 않고, 이 접속을 돌보는 epoll 루프에 EPOLLOUT을 켜서 그 루프가
+// 비우게 한다. 큐가 OUT_MAX를 넘으면 -1.
+int conn_send(struct conn *c, const char *data, size_t len) {
+  int ret = 0;
+
+  metered_lock(&c->out_lock, LK_OUT);
+  if (c->out_len + len > OUT_MAX) {
+    ret = -1;
+  } else {
+    if (c->out_len + len > c->out_cap) {
+      unsigned cap = c->out_cap ? c->out_cap : 256;
+      while (cap < c->out_len + len)
+        cap *= 2;
+      char *out = realloc(c->out, cap);
+      if (!out) {
+        pthread_mutex_unlock(&c->out_lock);
+        return -1;
+      }
+      c->out = out;
+      c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    if (!c->want_out) {
+      struct epoll_event ev;
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+      ev.data.ptr = c;
+      c->want_out = 1;
+      epoll_ctl(c->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+  }
+  pthread_mutex_unlock(&c->out_lock);
+  return ret;
+}
+
+// [송신] EPOLLOUT 때 epoll 루프가 부른다. 쓸 수 있는 만큼만 쓰고, 다 비면
+// EPOLLOUT을 끈다. 연결에 문제가 있으면 -1.
+int conn_flush(struct conn *c) {
+  int ret = 0;
+
+  metered_lock(&c->out_lock, LK_OUT);
+  while (c->out_len) {
+    ssize_t w = write(c->fd, c->out, c->out_len);
+    if (w < 0) {
+      if (errno != EAGAIN && errno != EINTR)
+        ret = -1;
+      break;
+    }
+    memmove(c->out, c->out + w, c->out_len - w);
+    c->out_len -= w;
+  }
+  if (!c->out_len && c->want_out) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = c;
+    c->want_out = 0;
+    epoll_ctl(c->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+  }
+  pthread_mutex_unlock(&c->out_lock);
+  return ret;
+}
+
+// 명령을 그 기계 접속의 송신 큐에 "ID:CMD:번호:명령\n" 형식으로 넣는다.
+// 클라이언트는 "ID:ACK:번호\n"으로 답하고, 그때까지 걸린 시간을 잰다.
+// 소켓에 직접 쓰지 않으므로 느린 기계가 있어도 UI는 멈추지 않는다.
+// 성공하면 상관 번호, 실패하면 0을 돌려준다.
+unsigned cmd_next_corr = 0;
+// 이 화면에서 보낸 마지막 명령. UI 스레드의 키 처리만 쓴다 (제어 소켓의
+// CMD는 다른 스레드에서 queue_command를 부르므로 여기를 건드리지 않는다).
+int last_cmd_sensor = -1, last_cmd_failed = 0;
+
+// 제어 소켓의 "OK 번호" / "FAIL" 답
+static void attach_cmd_reply(char *line, void *arg) {
+  sscanf(line, "OK %u", (unsigned *)arg);
+}
+
+unsigned queue_command(unsigned idx, const char *command) {
+  struct sensor *sn = &sensors[idx];
+  char line[BUF_SIZE];
+  unsigned corr = 0;
+
+  if (attach_path) { // 붙는 UI는 서버에게 대신 보내 달라고 한다
+    int len = snprintf(line, sizeof(line), "CMD %u %s\n", idx, command);
+    if (len < (int)sizeof(line))
+      attach_request(line, attach_cmd_reply, &corr);
+    if (corr) {
+      sensor_write_begin(sn);
+      sn->cmd_corr = corr;
+      sn->cmd_state = CMD_PENDING;
+      sn->cmd_rtt_us = 0;
+      sensor_write_end(sn);
+    }
+  }
+  metered_lock(&cmd_lock, LK_CMD);
+  if (sn->conn && !attach_path) {
+    unsigned next = __atomic_add_fetch(&cmd_next_corr, 1, __ATOMIC_RELAXED);
+    int len = snprintf(line, sizeof(line), "%s:CMD:%u:%s\n", sn->id, next,
+                       command);
+    if (len < (int)sizeof(line)) {
+      // 큐에 넣는 순간 ingest 루프가 보내고 ACK까지 받을 수 있으므로
+      // 기다리는 번호를 먼저 적고, 못 보내면 예전 값으로 되돌린다.
+      unsigned old_corr = sn->cmd_corr;
+      int old_state = sn->cmd_state;
+      long long old_sent = sn->cmd_sent;
+      long old_rtt = sn->cmd_rtt_us;
+
+      sensor_write_begin(sn);
+      sn->cmd_corr = next;
+      sn->cmd_state = CMD_PENDING;
+      sn->cmd_sent = now_ns(CLOCK_MONOTONIC);
+      sn->cmd_rtt_us = 0;
+      sensor_write_end(sn);
+      if (conn_send(sn->conn, line, len) == 0)
+        corr = next;
+      else {
+        sensor_write_begin(sn);
+        sn->cmd_corr = old_corr;
+        sn->cmd_state = old_state;
+        sn->cmd_sent = old_sent;
+        sn->cmd_rtt_us = old_rtt;
+        sensor_write_end(sn);
+      }
+    }
+  }
+  pthread_mutex_unlock(&cmd_lock);
+
+  if (!corr)
+    log_event(EV_CMD_FAIL, idx, NULL, 0);
+  else
+    bus_publish(&(struct bus_event){.type = BUS_CMD_SENT,
+                                    .sensor = idx,
+                                    .mono_ns = now_ns(CLOCK_MONOTONIC),
+                                    .corr = corr,
+                                    .text = command,
+                                    .text_len = strlen(command)});
+  return corr;
+}
+
+// 마지막 명령의 상태 (17번째 줄)
+static void draw_command_status() {
+  struct sensor_view v;
+
+  move(17, 0);
+  clrtoeol();
+  if (last_cmd_sensor < 0)
+    return;
+  sensor_snapshot(last_cmd_sensor, &v);
+  if (last_cmd_failed) {
+    attron(COLOR_PAIR(3));
+    mvprintw(17, 2, "Failed to send to %s!", sensors[last_cmd_sensor].id);
+    attroff(COLOR_PAIR(3));
+  } else if (v.cmd_state == CMD_ACKED) {
+    attron(COLOR_PAIR(2));
+    mvprintw(17, 2, "#%u to %s: acked in %.1f ms", v.cmd_corr,
+             sensors[last_cmd_sensor].id, v.cmd_rtt_us / 1000.0);
+    attroff(COLOR_PAIR(2));
+  } else {
+    attron(COLOR_PAIR(4));
+    mvprintw(17, 2, "#%u to %s: sent, waiting for ack", v.cmd_corr,
+             sensors[last_cmd_sensor].id);
+    attroff(COLOR_PAIR(4));
+  }
+}
+
+// 선택 화면의 기계 목록 그리기. top부터 UI_ROWS개만 보여준다.
+void draw_select_list(int top) {
+  unsigned count = __atomic_load_n(&sensor_count, __ATOMIC_ACQUIRE);
+  struct sensor_view v;
+
+  for (int i = 0; i < UI_ROWS; i++) {
+    int row = 6 + i; // 6번째 줄부터 한 줄씩 출력
+    unsigned idx = top + i;
+
+    move(row, 0);
+    clrtoeol();
+    if (idx >= count)
+      continue;
+    sensor_snapshot(idx, &v);
+    if (v.active) {
+      // 접속된 경우
+      attron(COLOR_PAIR(4));
+      mvprintw(row, 2, "[Machine %s]", sensors[idx].id);
+      attroff(COLOR_PAIR(4));
+    } else {
+      // 접속 안 된 경우
+      attron(COLOR_PAIR(5)); // 회색
+      mvprintw(row, 2, "Not available");
+      attroff(COLOR_PAIR(5));
+    }
+  }
+}
+
+void send_command(char command[]) {
+  int ch, select = 0, top = 0;
+  unsigned count = __atomic_load_n(&sensor_count, __ATOMIC_ACQUIRE);
+  clear();
+
+  attron(COLOR_PAIR(1));
+  mvprintw(1, 10, "========================================");
+  mvprintw(2, 10, "           SELECT THE CLIENT            ");
+  mvprintw(3, 10, "========================================");
+  attroff(COLOR_PAIR(1));
+
+  // 2. 기계 상태 목록 그리기
+  draw_select_list(top);
+  mvaddch(6, 59, '<');
+  refresh();
+  if (!count)
+    return;
+
+  while (1) {
+    while ((ch = getch()) != -1) {
+      mvaddch(6 + select - top, 59, ' ');
+
+      switch (ch) {
+      case KEY_UP:
+        if (!select)
+          select = count - 1;
+        else
+          select -= 1;
+        break;
+      case KEY_DOWN:
+        select = (select + 1) % count;
+        break;
+      case KEY_PPAGE:
+        select = (select >= UI_ROWS) ? select - UI_ROWS : 0;
+        break;
+      case KEY_NPAGE:
+        select = (select + UI_ROWS < (int)count) ? select + UI_ROWS
+                                                  : (int)count - 1;
+        break;
+      case '\n':
+      case '\r':
+        last_cmd_failed = !queue_command(select, command);
+        last_cmd_sensor = select;
+        return;
+      }
+      // 선택한 줄이 화면 밖으로 나가면 목록을 밀어준다.
+      if (select < top || select >= top + UI_ROWS) {
+        top = (select / UI_ROWS) * UI_ROWS;
+        draw_select_list(top);
+      }
+    }
+
+    mvaddch(6 + select - top, 59, '<');
+  }
+  refresh();
+}
+
+// 목록의 한 줄(기계 하나)을 그린다. 깜빡이거나 도는 표시가 있는 줄이면
+// 1을 돌려줘서 애니메이션 틱마다 다시 그리게 한다.
+static int draw_sensor_row(unsigned idx, int row, int global_timer) {
+  const char loading[4] = {'|', '/', '-', '\\'};
+  struct sensor_view v;
+  int mes_color;
+
+  sensor_snapshot(idx, &v);
+  move(row, 0);
+  clrtoeol();
+  if (v.active) { // 접속된 경우
+    if (v.error) {
+      mes_color = 9;
+    } else
+      mes_color = 2;
+    attron(COLOR_PAIR(mes_color)); // 초록색
+    mvprintw(row, 2, "[Machine %s] Status: %s", sensors[idx].id,
+             v.status); // 프로토콜 구체화 필요
+    if (v.alert[0])
+      printw("  [%s]", v.alert);
+    attroff(COLOR_PAIR(mes_color));
+    return v.error;
+  }
+  if (v.restored) { // 다시 켠 뒤 아직 보고가 없으면 지난 실행의 마지막 값
+    long long age = (now_ns(CLOCK_REALTIME) / 1000000 - v.seen_ms) / 1000;
+    attron(COLOR_PAIR(4)); // 노란색
+    mvprintw(row, 2, "[Machine %s] Last known: %s  (stale, ", sensors[idx].id,
+             v.status);
+    if (age < 120)
+      printw("%llds ago)", age < 0 ? 0 : age);
+    else if (age < 7200)
+      printw("%lldm ago)", age / 60);
+    else
+      printw("%lldh ago)", age / 3600);
+    attroff(COLOR_PAIR(4));
+    return 1; // 지난 시간을 늘려 보여야 하므로 틱마다 다시 그린다
+  }
+  // 접속 안 된 경우
+  attron(COLOR_PAIR(3)); // 빨간색
+  if (ui_animations)
+    mvprintw(row, 2, "[Machine %s] Waiting for connection.\t\t  %c",
+             sensors[idx].id,
+             loading[(global_timer % 4)]); // 프로토콜 구체화 필요
+  else
+    mvprintw(row, 2, "[Machine %s] Waiting for connection.", sensors[idx].id);
+  attroff(COLOR_PAIR(3));
+  return 1;
+}
+
+// 기계의 최근 1분 추세(최소/평균/최대/95% 값) 한 줄. 제어 소켓의 TREND도 쓴다.
+// buf는 TREND_TEXT_LEN이면 충분하고, 값이 터무니없이 커서 잘리면 "..."로 끝낸다.
+static void trend_text(unsigned idx, char *buf, int size) {
+  struct ts_stats st;
+  char key[8];
+  int n;
+
+  if (ts_query(idx, TS_SEC, 60000, 95, &st, key) == 0)
+    n = snprintf(buf, size, "%s %s 1m min %.1f avg %.1f max %.1f p95 %.1f (%u)",
+                 sensors[idx].id, key, st.min, st.mean, st.max, st.pct, st.n);
+  else
+    n = snprintf(buf, size, "%s: no numeric samples", sensors[idx].id);
+  if (n >= size && size > 4)
+    memcpy(buf + size - 4, "...", 4);
+}
+
+static void attach_copy_line(char *line, void *arg) {
+  snprintf(arg, TREND_TEXT_LEN, "%s", line);
+}
+
+// 선택된 기계의 추세를 4번째 줄에 그린다. 붙는 UI는 서버에 물어본다.
+static void draw_trend(unsigned idx) {
+  char text[TREND_TEXT_LEN] = "";
+  char req[32];
+
+  if (attach_path) {
+    snprintf(req, sizeof(req), "TREND %u\n", idx);
+    attach_request(req, attach_copy_line, text);
+  } else
+    trend_text(idx, text, sizeof(text));
+  move(4, 0);
+  clrtoeol();
+  attron(COLOR_PAIR(4));
+  mvprintw(4, 2, "%s", text);
+  attroff(COLOR_PAIR(4));
+}
+
+// 바뀌지 않는 글자들(제목 테두리, 안내 문구)을 그린다.
+static void draw_static() {
+  clear();
+  attron(COLOR_PAIR(1));
+  mvprintw(1, 10, "========================================");
+  mvprintw(3, 10, "========================================");
+  if (!ui_animations)
+    mvprintw(2, 17, "FACTORY MONITORING SYSTEM");
+  attroff(COLOR_PAIR(1));
+
+  mvprintw(18, 2, "Command: ");
+  if (attach_path)
+    mvprintw(20, 2, "Attached to %s", attach_path);
+  else
+    mvprintw(20, 2, "Listening on Port %d", PORT);
+  attron(COLOR_PAIR(5));
+  mvprintw(21, 2, "Press Ctrl+C to exit.  Tab: stats");
+  attroff(COLOR_PAIR(5));
+}
+
+struct panel_buf {
+  char lines[UI_ROWS][64];
+  int n;
+};
+
+static void attach_panel_line(char *line, void *arg) {
+  struct panel_buf *pb = arg;
+  if (pb->n < UI_ROWS)
+    snprintf(pb->lines[pb->n++], sizeof(pb->lines[0]), "%s", line);
+}
+
+// 기계 목록 자리(6~15번째 줄)에 통계 패널을 그린다. 붙는 UI는 서버가
+// 만든 글자를 받아 온다.
+static void draw_stats_panel(struct metrics_window *w) {
+  struct panel_buf pb = {.n = 0};
+
+  if (attach_path)
+    attach_request("PANEL\n", attach_panel_line, &pb);
+  else
+    pb.n = metrics_panel(w, pb.lines, UI_ROWS);
+  for (int r = 0; r < UI_ROWS; r++) {
+    move(6 + r, 0);
+    clrtoeol();
+    if (r < pb.n)
+      mvprintw(6 + r, 2, "%s", pb.lines[r]);
+  }
+}
+
+// 움직이는 장식(흐르는 제목, 점, 막대)을 그린다.
+static void draw_decorations(int global_timer, const int move_bar[7]) {
+  const char *logo = "FACTORY MONITORING SYSTEM";
+  int logo_starts = 49 - (global_timer % 64), logo_pos;
+
+  attron(COLOR_PAIR(1));
+  mvhline(2, 10, ' ', 40);
+  for (int k = 0; k < 25; k++) {
+    logo_pos = logo_starts + k;
+    if ((logo_pos >= 10) && (logo_pos < 50))
+      mvaddch(2, logo_pos, logo[k]);
+  }
+  attroff(COLOR_PAIR(1));
+
+  mvhline(20, 24, ' ', 3);
+  for (int i = 0; i < (global_timer % 8) / 2; i++) {
+    mvprintw(20, 24 + i, ".");
+  }
+
+  for (int i = 0; i < 7; i++) {
+    for (int j = 0; j < 5; j++) {
+      if (j < move_bar[i]) {
+        attron(COLOR_PAIR(90 + j));
+        mvaddch(21 - j, 44 + 2 * i, '#');
+        attroff(COLOR_PAIR(90 + j));
+      } else
+        mvaddch(21 - j, 44 + 2 * i, ' ');
+    }
+  }
+}
+
+// 남은 로그를 쓰고 제어 소켓을 지운 뒤 Ctrl+C 기본 동작으로 끝낸다.
+void server_stop() {
+  ckpt_write(); // 다음에 켤 때 되살릴 마지막 상태
+  if (log_queue)
+    log_shutdown();
+  if (ctl_fd != -1)
+    unlink(ctl_path);
+  signal(SIGINT, SIG_DFL);
+  kill(getpid(), SIGINT);
+}
+
+// [UI 스레드] 바뀐 곳만 다시 그립니다. ingest가 보이는 기계의 상태를
+// 바꾸면 ui_event_fd로 깨우고, 키 입력이 있거나 장식 애니메이션 틱
+// (0.1초)이 되었을 때만 일어납니다. 화면 갱신은 초당 ui_fps번을 넘지 않습니다.
+void *draw_ui_thread(void *arg) {
+  const int red_fade[] = {160, 124, 88, 52, 0, 0, 0, 0};
+  int move_bar[7] = {0}, row_anim[UI_ROWS] = {0};
+  char command[32];
+  int index = -1;
+  int global_timer = 0, full = 1, cmd_dirty = 1;
+  unsigned top = 0, count = 0, shown_count = 0; // 화면 맨 위 기계 인덱스
+  unsigned focus = 0; // 추세를 보여줄 줄 (화면 안에서의 위치)
+  unsigned long shown_dropped = -1, shown_late = -1;
+  long long next_anim = 0, last_frame = 0, next_trend = 0, next_panel = 0;
+  static struct metrics_window panel_w; // 16KB가 넘어 스택에 두지 않는다
+  static struct intro intro;
+  long long next_intro = 0;
+  int show_stats = 0;                   // Tab: 목록 대신 통계 패널
+  struct pollfd pfd[2];
+  memset(command, 0, sizeof(command));
+  int ch;
+  metrics_thread("ui", 0);
+  if (!skip_intro) { // 인트로는 큰 창에서 그린다
+    printf("\e[8;48;180t");
+    fflush(stdout);
+    usleep(100000);
+  }
+  initscr();     // ncurses 시작
+  curs_set(0);   // 커서 숨김
+  noecho();      // 키 입력 화면 노출 방지
+  start_color(); // 색상 모드 시작
+  keypad(stdscr, TRUE);
+  timeout(10);
+
+  // 색상 정의 (번호, 글자색, 배경색)
+  init_pair(1, COLOR_CYAN, COLOR_BLACK); // 제목 (하늘색)
+  init_pair(2, COLOR_GREEN, COLOR_BLACK); // 클라이언트 연결됨 (초록색)
+  init_pair(3, COLOR_RED, COLOR_BLACK);   // 클라이언트 끊김 (빨간색)
+  init_pair(4, COLOR_YELLOW, COLOR_BLACK);
+  init_pair(5, 240, COLOR_BLACK);
+  init_pair(9, COLOR_WHITE, red_fade[0]); // 에러 (애니메이션이 꺼지면 고정)
+  for (int i = 0; i < 5; i++) {
+    init_pair(90 + i, 243 - 2 * i, COLOR_BLACK);
+  }
+  intro.frame = INTRO_FRAMES;
+  if (!skip_intro && intro_load(&intro) == -1)
+    intro_finish(&intro); // intro.txt가 없으면 바로 대시보드
+#ifdef USE_AUDIO
+  if (intro.frame < INTRO_FRAMES && Intro)
+    Mix_PlayMusic(Intro, 1);
+  if (Ambience && !Mix_PlayingMusic())
+    Mix_PlayMusic(Ambience, -1);
+#endif
+  pfd[0].fd = STDIN_FILENO;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = ui_event_fd;
+  pfd[1].events = POLLIN;
+  timeout(0);
+
+  while (keep_running) {
+    long long now = now_ns(CLOCK_MONOTONIC) / 1000000;
+    int anim_tick = 0, wait_ms;
+
+    if (reload_sensors) {
+      reload_sensors = 0;
+      sensor_load(sensor_file);
+    }
+
+    // 다음 애니메이션 틱까지, 애니메이션이 꺼져 있으면 최대 1초까지 잔다.
+    wait_ms = ui_animations ? (int)(next_anim - now) : 1000;
+    if (intro.frame < INTRO_FRAMES)
+      wait_ms = (int)(next_intro - now);
+    if (wait_ms > 0 && (!full || intro.frame < INTRO_FRAMES) &&
+        poll(pfd, 2, wait_ms) > 0 &&
+        (pfd[1].revents & POLLIN)) {
+      uint64_t n;
+      read(ui_event_fd, &n, sizeof(n));
+    }
+    __atomic_store_n(&ui_wake_pending, 0, __ATOMIC_RELEASE);
+
+    // 초당 ui_fps번을 넘지 않게, 너무 이르면 남은 시간만큼 모아서 그린다.
+    now = now_ns(CLOCK_MONOTONIC) / 1000000;
+    if (now - last_frame < 1000 / ui_fps) {
+      napms(1000 / ui_fps - (now - last_frame));
+      now = now_ns(CLOCK_MONOTONIC) / 1000000;
+    }
+    last_frame = now;
+
+    // 인트로 중에는 0.1초마다 한 프레임. 아무 키나 누르면 건너뛴다.
+    if (intro.frame < INTRO_FRAMES) {
+      while ((ch = getch()) != -1)
+        if (ch != KEY_RESIZE)
+          intro.frame = INTRO_FRAMES;
+      if (intro.frame < INTRO_FRAMES && now >= next_intro) {
+        intro_draw(&intro, intro.frame++);
+        next_intro = now + 100;
+      }
+      if (intro.frame == INTRO_FRAMES)
+        intro_finish(&intro);
+      else
+        continue;
+    }
+
+    // 커맨드 입력 처리
+    while ((ch = getch()) != -1) {
+      switch (ch) {
+      case '\n':
+      case '\r':
+        timeout(10);
+        send_command(command);
+        timeout(0);
+        memset(command, 0, sizeof(command));
+        index = -1;
+        full = 1;
+        break;
+      case KEY_BACKSPACE:
+        if (index > -1)
+          command[index--] = '\0';
+        cmd_dirty = 1;
+        break;
+      case KEY_PPAGE:
+        top = (top >= UI_ROWS) ? top - UI_ROWS : 0;
+        full = 1;
+        break;
+      case KEY_NPAGE:
+        if (top + UI_ROWS < count)
+          top += UI_ROWS;
+        full = 1;
+        break;
+      case KEY_UP:
+        if (focus > 0)
+          focus--;
+        full = 1;
+        break;
+      case KEY_DOWN:
+        if (focus + 1 < UI_ROWS && top + focus + 1 < count)
+          focus++;
+        full = 1;
+        break;
+      case KEY_RESIZE:
+        full = 1;
+        break;
+      case '\t':
+        show_stats = !show_stats;
+        full = 1;
+        break;
+      default:
+        if ((index < 31) && (ch >= 32 && ch <= 126)) {
+          command[++index] = (char)ch;
+          command[index + 1] = '\0';
+          cmd_dirty = 1;
+        }
+      }
+    }
+
+    if (ui_animations && now >= next_anim) {
+      anim_tick = 1;
+      next_anim = now + 100;
+      global_timer = (global_timer + 1) % 128;
+      if (global_timer % 2 == 0) {
+        for (int i = 0; i < 7; i++) {
+          if (move_bar[i] <= 1)
+            move_bar[i] = rand() % 4 + 2;
+          else
+            --move_bar[i];
+        }
+      }
+      init_pair(9, COLOR_WHITE, red_fade[global_timer % 8]);
+    }
+
+    count = __atomic_load_n(&sensor_count, __ATOMIC_ACQUIRE);
+    if (top >= count)
+      top = count > UI_ROWS ? count - UI_ROWS : 0;
+    if (top + focus >= count)
+      focus = count > top ? count - top - 1 : 0;
+    __atomic_store_n(&ui_top, top, __ATOMIC_RELAXED);
+
+    if (full) { // 처음, 페이지 이동, 명령 전송 뒤에는 전부 다시 그린다
+      draw_static();
+      cmd_dirty = 1;
+      shown_count = -1;
+      shown_dropped = shown_late = -1;
+      anim_tick = ui_animations;
+    }
+
+    // 1. 제목과 장식 (애니메이션 틱일 때만)
+    if (anim_tick)
+      draw_decorations(global_timer, move_bar);
+
+    // 2. 기계 상태 목록 그리기 (top부터 UI_ROWS개, 바뀐 줄만).
+    //    Tab을 눌렀으면 그 자리에 통계 패널을 1초마다 그린다.
+    if (show_stats && (full || now >= next_panel)) {
+      draw_stats_panel(&panel_w);
+      next_panel = now + 1000;
+    }
+    for (unsigned r = 0; r < UI_ROWS && !show_stats; r++) {
+      unsigned i = top + r;
+      int dirty;
+
+      if (i >= count) {
+        if (full || count != shown_count) {
+          move(6 + r, 0);
+          clrtoeol();
+        }
+        continue;
+      }
+      dirty = __atomic_exchange_n(&sensors[i].dirty, 0, __ATOMIC_ACQUIRE);
+      if (full || dirty || count != shown_count || (anim_tick && row_anim[r])) {
+        row_anim[r] = draw_sensor_row(i, 6 + r, global_timer);
+        if (r == focus)
+          mvaddch(6 + r, 0, '>');
+      }
+      if (r == focus && (full || dirty))
+        next_trend = 0; // 선택된 기계에 새 값이 오면 추세도 다시 계산
+    }
+    // 값이 안 와도 창이 밀리므로 1초마다는 다시 그린다
+    if (top + focus < count && now >= next_trend) {
+      draw_trend(top + focus);
+      next_trend = now + 1000;
+    }
+    if (count != shown_count) {
+      move(16, 0);
+      clrtoeol();
+      if (count > UI_ROWS) {
+        attron(COLOR_PAIR(5));
+        mvprintw(16, 2, "%u-%u of %u (PgUp/PgDn)", top + 1,
+                 (top + UI_ROWS < count) ? top + UI_ROWS : count, count);
+        attroff(COLOR_PAIR(5));
+      }
+      shown_count = count;
+    }
+
+    // 3. 안내 문구 (바뀐 것만, 명령 상태 줄은 ncurses가 바뀐 칸만 보낸다)
+    draw_command_status();
+    if (cmd_dirty) {
+      move(18, 11);
+      clrtoeol();
+      mvprintw(18, 11, "%s", command);
+      cmd_dirty = 0;
+    }
+    if (__atomic_load_n(&log_dropped, __ATOMIC_RELAXED) != shown_dropped ||
+        __atomic_load_n(&log_late, __ATOMIC_RELAXED) != shown_late) {
+      shown_dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+      shown_late = __atomic_load_n(&log_late, __ATOMIC_RELAXED);
+      attron(COLOR_PAIR(5));
+      mvprintw(22, 2, "Log dropped: %lu  late: %lu", shown_dropped,
+               shown_late);
+      attroff(COLOR_PAIR(5));
+    }
+
+    full = 0;
+    refresh(); // 실제 화면 업데이트 (바뀐 칸만 터미널로 나간다)
+  }
+
+  log_event(EV_STOP, -1, NULL, 0);
+
+#ifdef USE_AUDIO
+  if (Ambience)
+    Mix_FreeMusic(Ambience);
+  if (Intro)
+    Mix_FreeMusic(Intro);
+  if (alert)
+    Mix_FreeChunk(alert);
+  if (sent)
+    Mix_FreeChunk(sent);
+
+  Mix_CloseAudio();
+  SDL_Quit();
+#endif
+
+  endwin();
+  server_stop();
+  return NULL;
+}
+
+// 연결 종료 처리. epoll 등록은 close()로 자동 해제된다.
+void close_client(struct conn *c) {
+  metered_lock(&cmd_lock, LK_CMD);
+  for (int k = 0; k < c->nchan; k++) {
+    struct sensor *sn = &sensors[c->ids[k]];
+
+    sensor_write_begin(sn);
+    if (sn->conn == c) { // 같은 ID로 새로 접속한 쪽이면 그대로 둔다
+      sn->active = 0;
+      sn->conn = NULL;
+    }
+    sensor_write_end(sn);
+  }
+  close(c->fd);
+  pthread_mutex_unlock(&cmd_lock);
+
+  for (int k = 0; k < c->nchan; k++)
+    bus_publish(&(struct bus_event){.type = BUS_DISCONNECT,
+                                    .sensor = c->ids[k],
+                                    .mono_ns = now_ns(CLOCK_MONOTONIC)});
+  my_metrics->closes++;
+  pthread_mutex_destroy(&c->out_lock);
+  free(c->out);
+  free(c);
+}
+
+// 명령 응답("ID:ACK:번호" 또는 BIN_ACK 프레임) 처리. 마지막 명령의
+// 번호와 맞으면 걸린 시간을 기록한다.
+static int handle_ack(int id, unsigned corr) {
+  struct sensor *sn = &sensors[id];
+  long long rtt_ns;
+  long rtt_us;
+
+  // cmd_* 는 queue_command가 cmd_lock을 잡고 고치므로 같은 락 안에서 본다
+  metered_lock(&cmd_lock, LK_CMD);
+  if (corr != sn->cmd_corr || sn->cmd_state != CMD_PENDING) {
+    pthread_mutex_unlock(&cmd_lock);
+    return 0; // 예전 명령의 응답이거나 모르는 번호
+  }
+  rtt_ns = now_ns(CLOCK_MONOTONIC) - sn->cmd_sent;
+  rtt_us = rtt_ns / 1000;
+  sensor_write_begin(sn);
+  sn->cmd_state = CMD_ACKED;
+  sn->cmd_rtt_us = rtt_us;
+  sensor_write_end(sn);
+  pthread_mutex_unlock(&cmd_lock);
+  hist_record(my_metrics->hist_cmd, &my_metrics->cmd_sum_ns, rtt_ns);
+
+  bus_publish(&(struct bus_event){.type = BUS_CMD_ACKED,
+                                  .sensor = id,
+                                  .mono_ns = now_ns(CLOCK_MONOTONIC),
+                                  .corr = corr,
+                                  .rtt_us = rtt_us});
+  return 0;
+}
+
+// 지연 측정용 PING. 같은 접속의 앞선 보고는 이미 다 반영했으므로 PONG이
+// 돌아가기까지가 보고 하나가 화면과 로그에 닿는 시간이다.
+static int handle_ping(struct conn *c, int id, unsigned seq) {
+  char reply[64];
+  int n = snprintf(reply, sizeof(reply), "%s:PONG:%u\n", sensors[id].id, seq);
+
+  conn_send(c, reply, n); // 큐가 넘치면 PONG 하나쯤 버려도 된다
+  return 0;
+}
+
+static void publish_status(int id, const struct payload *p, const char *status,
+                           size_t len, int skip);
+
+// 이 접속에 이미 실린 채널 중 ID가 같은 센서 (없으면 -1). 채널은 몇 개
+// 안 되므로 해시 대신 차례로 비교한다.
+static int conn_channel(struct conn *c, const char *id, size_t len) {
+  if (len >= SENSOR_ID_LEN)
+    return -1;
+  for (int k = 0; k < c->nchan; k++) {
+    const char *name = sensors[c->ids[k]].id;
+    if (!memcmp(name, id, len) && name[len] == '\0')
+      return c->ids[k];
+  }
+  return -1;
+}
+
+// 센서 ID를 이 접속의 새 채널로 붙이고 답장을 보낸다. hello가 있으면
+// ("HELLO PROTO=" 뒤의 이름) 센서 번호(handle)를 같이 알려 주고, BIN1이면
+// 이 뒤로 오는 것은 프레임으로 읽는다. 못 찾으면 DENIED를 보내고 -1.
+// -P에서 첫 ID가 다른 루프 몫이면 아무것도 붙이지 않고 -2 (넘겨야 함).
+static int conn_bind(struct conn *c, const char *id, size_t len,
+                     const char *hello, int hello_len) {
+  char reply[64];
+  int idx = -1, n;
+
+  if (c->nchan < MAX_CHANNELS) {
+    // 명단에서 해시로 자리를 찾는다 (-a면 모르는 ID도 새로 등록)
+    idx = sensor_lookup(id, len);
+    if (idx == -1 && (auto_register || c->replay))
+      idx = sensor_register(id, len);
+  }
+  // 재생 접속은 재생 스레드가 그 자리에서 처리하므로 넘기지 않는다 (재생
+  // 중에는 ingest 루프가 없다)
+  if (idx != -1 && sharded && !c->replay &&
+      sensor_shard(idx) != c->shard) {
+    if (!c->nchan) {
+      c->shard = sensor_shard(idx);
+      return -2;
+    }
+    idx = -1; // 한 접속의 ID는 모두 같은 루프 몫이어야 한다
+  }
+  if (idx == -1) {
+    char *msg = "DENIED\n";
+    if (c->nchan)
+      conn_send(c, msg, strlen(msg));
+    else
+      write(c->fd, msg, strlen(msg)); // 곧 닫으므로 큐를 거치지 않는다
+    return -1;
+  }
+
+  struct sensor *sn = &sensors[idx];
+  sensor_write_begin(sn);
+  sn->active = 1;
+  sn->conn = c;
+  sensor_write_end(sn);
+  bus_publish(&(struct bus_event){
+      .type = BUS_CONNECT, .sensor = idx, .mono_ns = now_ns(CLOCK_MONOTONIC)});
+  c->ids[c->nchan++] = idx;
+
+  if (!hello)
+    n = snprintf(reply, sizeof(reply), "ACCEPTED\n"); // 예전 장비
+  else if (hello_len == sizeof(PROTO_NAME) - 1 &&
+           !memcmp(hello, PROTO_NAME, hello_len)) {
+    n = snprintf(reply, sizeof(reply), PROTO_ACCEPTED PROTO_NAME " HANDLE=%d\n",
+                 idx);
+    c->binary = 1;
+  } else
+    n = snprintf(reply, sizeof(reply), PROTO_ACCEPTED PROTO_TEXT " HANDLE=%d\n",
+                 idx);
+  conn_send(c, reply, n);
+  return idx;
+}
+
+// [메시지 처리] 줄 하나("ID:STATUS")를 처리합니다. msg는 수신 버퍼를
+// 직접 가리키는 뷰라서 NUL로 끝나지 않습니다. 줄 앞의 ID로 이 접속의
+// 어느 채널인지 정하고, 처음 보는 ID면 채널로 붙입니다. 첫 ID부터
+// 거절되면 연결을 끊어야 하므로 -1, 첫 ID가 다른 루프 몫이면 1.
+int handle_message(struct conn *c, const char *msg, size_t len) {
+  const char *colon = memchr(msg, ':', len);
+  const char *message = colon ? colon + 1 : msg + len;
+  size_t id_len = colon ? (size_t)(colon - msg) : len;
+  int message_len = (int)(msg + len - message);
+  int id = conn_channel(c, msg, id_len);
+  struct payload p;
+
+  if (id == -1) { // 이 접속에서 처음 보는 ID
+    const char *hello = NULL;
+    int hello_len = 0;
+
+    if (message_len > (int)sizeof(PROTO_HELLO) - 1 &&
+        !memcmp(message, PROTO_HELLO, sizeof(PROTO_HELLO) - 1)) {
+      hello = message + sizeof(PROTO_HELLO) - 1;
+      hello_len = message_len - (sizeof(PROTO_HELLO) - 1);
+    }
+    if ((id = conn_bind(c, msg, id_len, hello, hello_len)) == -2)
+      return 1; // 맡을 루프가 이 줄부터 처리한다
+    if (id == -1)
+      return c->nchan ? 0 : -1; // 다른 채널이 있으면 이 줄만 버린다
+    if (hello)
+      return 0; // 인사 줄은 상태 보고가 아니다
+  }
+
+  if (message_len > 4 && (!memcmp("ACK:", message, 4) ||
+                          !memcmp("PING:", message, 5))) { // 응답, 지연 측정
+    int skip = message[1] == 'C' ? 4 : 5;
+    unsigned corr = 0;
+    for (int i = skip; i < message_len && isdigit((unsigned char)message[i]);
+         i++)
+      corr = corr * 10 + (message[i] - '0');
+    return skip == 4 ? handle_ack(id, corr) : handle_ping(c, id, corr);
+  }
+  parse_payload(message, message_len, &p);
+  publish_status(id, &p, msg, len, message - msg);
+  return 0;
+}
+
+// 이 스레드가 마지막으로 소켓을 읽은 시각. 상태 반영까지의 지연을 잰다.
+static __thread long long read_ns;
+
+// 읽어낸 상태를 센서 레코드와 시계열에 반영하고 이벤트 버스에 알린다.
+// status는 화면에 보일 "ID:STATUS" 전체이고 로그에는 ID 뒤(skip)부터 남긴다.
+static void publish_status(int id, const struct payload *p, const char *status,
+                           size_t len, int skip) {
+  struct sensor *sn = &sensors[id];
+  int error = (p->fields & PF_ERROR) != 0;
+
+  if (p->fields & PF_VALUE)
+    ts_append(id, p->key.p, p->key.len, p->value);
+
+  // 상태를 고치는 동안 UI는 기다리지 않고 다시 읽기만 한다.
+  sensor_write_begin(sn);
+  sn->restored = 0;
+  sn->msgs++;
+  sn->errors += error;
+  sn->fields |= p->fields & (PF_MODE | PF_TEMP | PF_BUTTON | PF_LED);
+  if (p->fields & PF_MODE)
+    sn->mode = p->mode;
+  if (p->fields & PF_TEMP)
+    sn->temp = p->temp;
+  if (p->fields & PF_BUTTON)
+    sn->button = p->button;
+  if (p->fields & PF_LED)
+    sn->led = p->led;
+  memcpy(sn->status, status, len < STATUS_LEN ? len : STATUS_LEN - 1);
+  sn->status[len < STATUS_LEN ? len : STATUS_LEN - 1] = '\0';
+  sensor_write_end(sn);
+
+  // 화면, 로그는 버스 구독자가 받아 간다
+  bus_publish(&(struct bus_event){.type = error ? BUS_ERROR : BUS_SAMPLE,
+                                  .sensor = id,
+                                  .mono_ns = read_ns,
+                                  .p = *p,
+                                  .text = status + skip,
+                                  .text_len = len - skip});
+
+  // 경보는 보고 로그 뒤에 남도록 보고를 알린 다음에 평가한다
+  sensor_write_begin(sn);
+  rules_eval(id, sn, p, read_ns / 1000000);
+  sensor_write_end(sn);
+
+  my_metrics->msgs++;
+  my_metrics->errors += error;
+  hist_record(my_metrics->hist_publish, &my_metrics->publish_sum_ns,
+              now_ns(CLOCK_MONOTONIC) - read_ns);
+}
+
+// BIN1 프레임 하나 처리. 상태 보고는 글자 형식으로도 바꿔서 화면과 로그에
+// 예전과 똑같이 보이게 한다. 연결을 끊어야 하면 -1.
+static int handle_frame(struct conn *c, const uint8_t *frame) {
+  char status[STATUS_LEN];
+  struct sample smp;
+  struct payload p;
+  uint32_t corr = 0;
+  int id, k, n;
+
+  if (bin_decode(frame, &smp, &corr))
+    return -1; // 깨진 프레임
+  if (frame[1] == BIN_HELLO) { // 채널 추가. 거절돼도 접속은 유지
+    if ((smp.fields & SF_TEXT) &&
+        conn_channel(c, smp.text, smp.text_len) == -1)
+      conn_bind(c, smp.text, smp.text_len, PROTO_NAME, sizeof(PROTO_NAME) - 1);
+    return 0;
+  }
+
+  // handle은 이 접속에 붙인 채널이어야 한다
+  id = get_u32(frame + 4) < sensor_cap ? (int)get_u32(frame + 4) : -1;
+  for (k = 0; k < c->nchan && c->ids[k] != id; k++)
+    ;
+  if (k == c->nchan)
+    return -1; // 받은 적 없는 handle
+  if (frame[1] == BIN_ACK)
+    return handle_ack(id, corr);
+  if (frame[1] == BIN_PING)
+    return handle_ping(c, id, corr);
+  if (frame[1] != BIN_SAMPLE)
+    return 0; // 모르는 종류는 건너뜀
+
+  // 이미 타입이 있는 값이라 글자를 다시 훑을 필요가 없다.
+  p.fields = 0;
+  if (smp.fields & SF_MODE) {
+    p.fields |= PF_MODE;
+    p.mode = smp.mode;
+  }
+  if ((smp.fields & SF_TEMP) && smp.temp == smp.temp) { // NaN이면 N/A
+    p.fields |= PF_TEMP | PF_VALUE;
+    p.temp = p.value = smp.temp;
+    p.key.p = "TEMP";
+    p.key.len = 4;
+  }
+  if (smp.fields & SF_BUTTON) {
+    p.fields |= PF_BUTTON;
+    p.button = smp.button;
+  }
+  if (smp.fields & SF_LED) {
+    p.fields |= PF_LED;
+    p.led = smp.led;
+  }
+  if (smp.fields & SF_ERROR)
+    p.fields |= PF_ERROR;
+
+  n = snprintf(status, sizeof(status), "%s:", sensors[id].id);
+  n += sample_to_text(status + n, sizeof(status) - n, &smp);
+  publish_status(id, &p, status, n, strlen(sensors[id].id) + 1);
+  return 0;
+}
+
+// 링에 쌓인 완성된 프레임을 모두 처리한다. 프레임은 링보다 훨씬 작으므로
+// 덜 온 프레임은 다음 read까지 남겨 둔다.
+static int deliver_frames(struct conn *c) {
+  uint8_t frame[BIN_HDR_SIZE + BIN_MAX_PAYLOAD];
+
+  while (c->head != c->tail) {
+    unsigned avail = c->head - c->tail, t = c->tail & (RBUF_SIZE - 1);
+    unsigned peek = avail < sizeof(frame) ? avail : sizeof(frame);
+    int n;
+
+    // 링 끝에서 잘려 있을 수 있으니 최대 프레임 크기만큼 펴서 본다.
+    if (t + peek > RBUF_SIZE) {
+      memcpy(frame, c->rbuf + t, RBUF_SIZE - t);
+      memcpy(frame + RBUF_SIZE - t, c->rbuf, peek - (RBUF_SIZE - t));
+    } else
+      memcpy(frame, c->rbuf + t, peek);
+    n = bin_frame_len(frame, peek);
+    if (n == -1)
+      return -1; // 프레임 경계를 잃으면 다시 맞출 방법이 없다
+    if (n == 0 || (unsigned)n > avail)
+      break;
+    if (handle_frame(c, frame) == -1)
+      return -1;
+    c->tail += n;
+  }
+  c->scan = c->tail;
+  return 0;
+}
+
+// 완성된 줄 하나를 꺼내 handle_message로 넘긴다. 링 끝에서 줄이 잘려
+// 있을 때만 scratch에 이어 붙이고, 나머지는 링 안을 그대로 가리킨다.
+static int deliver_line(struct conn *c, unsigned start, unsigned end) {
+  char scratch[RBUF_SIZE];
+  unsigned s = start & (RBUF_SIZE - 1), n = end - start;
+  const char *line = c->rbuf + s;
+
+  if (s + n > RBUF_SIZE) {
+    unsigned first = RBUF_SIZE - s;
+    memcpy(scratch, c->rbuf + s, first);
+    memcpy(scratch + first, c->rbuf, n - first);
+    line = scratch;
+  }
+  if (n && line[n - 1] == '\r') // telnet 등에서 오는 CRLF 허용
+    n--;
+  if (!n)
+    return 0; // 빈 줄은 무시
+  return handle_message(c, line, n);
+}
+
+// 링에 쌓인 것 중 새로 들어온 부분만 훑어서 '\n'을 찾아 처리한다. HELLO
+// 줄 뒤로는 프레임. 연결을 끊어야 하면 -1, 다른 루프에 넘겨야 하면 1.
+// 넘길 때는 그 줄을 읽지 않은 채로 두어 맡은 루프가 처음부터 처리한다.
+static int conn_process(struct conn *c) {
+  int r;
+
+  while (c->scan != c->head) {
+    if (c->binary)
+      return deliver_frames(c);
+    unsigned s = c->scan & (RBUF_SIZE - 1), n = c->head - c->scan;
+    char *nl;
+
+    if (s + n > RBUF_SIZE)
+      n = RBUF_SIZE - s;
+    if (!(nl = memchr(c->rbuf + s, '\n', n))) {
+      c->scan += n;
+      continue;
+    }
+    c->scan += (unsigned)(nl - (c->rbuf + s));
+    if ((r = deliver_line(c, c->tail, c->scan)) != 0) {
+      if (r == 1)
+        c->scan = c->tail;
+      return r;
+    }
+    c->tail = ++c->scan;
+  }
+
+  // 한 줄이 링 전체보다 길면 더 기다릴 수 없으니 있는 만큼 처리한다.
+  if (c->head - c->tail == RBUF_SIZE) {
+    if ((r = deliver_line(c, c->tail, c->head)) != 0)
+      return r;
+    c->tail = c->scan = c->head;
+  }
+  return 0;
+}
+
+// [이벤트 처리] 읽을 데이터가 있는 소켓 하나를 처리합니다.
+// 한 번의 read에 들어온 모든 완성된 줄을 처리하고, 덜 온 줄은 링에 남겨
+// 다음 read에 이어 붙입니다. 연결을 끊어야 하면 -1, 다른 루프에 넘겨야
+// 하면 1을 돌려줍니다.
+int handle_client(struct conn *c) {
+  unsigned used = c->head - c->tail;
+  unsigned h = c->head & (RBUF_SIZE - 1), t = c->tail & (RBUF_SIZE - 1);
+  struct iovec iov[2];
+  int iovcnt = 1;
+  ssize_t str_len;
+
+  // 링의 빈 공간을 최대 두 조각으로 나눠 한 번에 읽는다.
+  iov[0].iov_base = c->rbuf + h;
+  if (used && h <= t) {
+    iov[0].iov_len = t - h;
+  } else {
+    iov[0].iov_len = RBUF_SIZE - h;
+    if (t) {
+      iov[1].iov_base = c->rbuf;
+      iov[1].iov_len = used ? t : 0;
+      iovcnt = used ? 2 : 1;
+    }
+  }
+  if (used == 0) { // 비어 있으면 처음부터 다시 채워 줄이 잘릴 일을 줄임
+    c->head = c->tail = c->scan = 0;
+    iov[0].iov_base = c->rbuf;
+    iov[0].iov_len = RBUF_SIZE;
+    iovcnt = 1;
+  }
+
+  str_len = readv(c->fd, iov, iovcnt);
+
+  if (str_len < 0 && (errno == EAGAIN || errno == EINTR))
+    return 0; // 아직 읽을 게 없음
+  if (str_len <= 0)
+    return -1; // 연결 종료
+  c->head += str_len;
+  read_ns = now_ns(CLOCK_MONOTONIC);
+  my_metrics->reads++;
+  my_metrics->bytes += str_len;
+  return conn_process(c);
+}
+
+// 대기 중인 접속을 모두 받아서 이 루프의 epoll에 등록합니다.
+void accept_clients(int epfd, int listen_fd) {
+  struct sockaddr_in client_addr;
+  socklen_t client_addr_size;
+  struct epoll_event ev;
+
+  while (1) {
+    client_addr_size = sizeof(client_addr);
+    int client_sock =
+        accept4(listen_fd, (struct sockaddr *)&client_addr,
+                &client_addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_sock == -1)
+      return; // EAGAIN: 다른 루프가 먼저 가져갔거나 더 없음
+
+    struct conn *c = calloc(1, sizeof(struct conn));
+    if (!c) {
+      close(client_sock);
+      continue;
+    }
+    c->fd = client_sock;
+    c->epfd = epfd;
+    c->shard = my_shard;
+    pthread_mutex_init(&c->out_lock, NULL);
+
+    log_event(EV_CONNECT, -1, NULL, 0);
+    my_metrics->accepts++;
+
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_sock, &ev) == -1) {
+      close(client_sock);
+      free(c);
+    }
+  }
+}
+
+// PORT에 리스닝 소켓을 하나 연다. -P면 SO_REUSEPORT로 여러 개를 같이 연다.
+static int open_listener(void) {
+  struct sockaddr_in server_addr;
+  int fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int opt = 1;
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  if (sharded && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+    perror("SO_REUSEPORT error");
+    exit(1);
+  }
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  server_addr.sin_port = htons(PORT);
+
+  if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+    perror("bind error");
+    exit(1);
+  }
+  // 접속 폭주 때 SYN이 버려지지 않도록 백로그는 커널 최대치로
+  if (listen(fd, SOMAXCONN) == -1) {
+    perror("listen error");
+    exit(1);
+  }
+  return fd;
+}
+
+// 접속을 맡을 루프의 epoll로 옮긴다. 옮긴 뒤로는 이 루프가 c를 만지지
+// 않는다. 소켓은 쓸 수 있는 상태라 EPOLLOUT이 바로 오므로, 맡은 루프는
+// 그때 링에 남은 줄(resume)을 첫 줄부터 처리한다.
+static void conn_handoff(struct conn *c) {
+  struct epoll_event ev;
+
+  my_metrics->handoffs++;
+  metered_lock(&c->out_lock, LK_OUT);
+  epoll_ctl(c->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  c->epfd = ingest_epfd[c->shard];
+  c->resume = 1;
+  c->want_out = 1;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+  ev.data.ptr = c;
+  epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+  pthread_mutex_unlock(&c->out_lock);
+}
+
+// [ingest 스레드] epoll 루프 하나가 수천 개의 접속을 같이 돌봅니다.
+// 리스닝 소켓을 같이 쓸 때는 모든 루프에 EPOLLEXCLUSIVE로 등록되어 있어
+// 한 번에 한 루프만 깨어나 accept 합니다. -P면 루프마다 자기 소켓이 있다.
+void *ingest_loop(void *arg) {
+  struct epoll_event ev, events[MAX_EVENTS];
+  int shard = (int)(intptr_t)arg, epfd = ingest_epfd[shard];
+
+  my_shard = shard;
+  metrics_thread("ingest-%d", shard);
+  if (num_pin_cores) { // -c: 이 루프를 코어 하나에 묶는다
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(pin_cores[shard % num_pin_cores], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+  ev.events = EPOLLIN | (sharded ? 0 : EPOLLEXCLUSIVE);
+  ev.data.ptr = NULL; // NULL이면 리스닝 소켓
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fds[shard], &ev) == -1) {
+    perror("epoll_ctl error");
+    exit(1);
+  }
+
+  while (1) {
+    int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+
+    for (int i = 0; i < n; i++) {
+      struct conn *c = events[i].data.ptr;
+      int r = 0;
+
+      if (!c) {
+        accept_clients(epfd, listen_fds[shard]);
+        continue;
+      }
+      if (c->resume) { // 다른 루프에서 넘겨받은 접속
+        c->resume = 0;
+        read_ns = now_ns(CLOCK_MONOTONIC);
+        r = conn_process(c);
+      }
+      if (r == 0 && (events[i].events & (EPOLLERR | EPOLLHUP)))
+        r = -1;
+      if (r == 0 && (events[i].events & EPOLLOUT) && conn_flush(c) == -1)
+        r = -1;
+      if (r == 0 && (events[i].events & (EPOLLIN | EPOLLRDHUP)))
+        r = handle_client(c);
+      if (r == -1)
+        close_client(c);
+      else if (r == 1)
+        conn_handoff(c);
+    }
+  }
+  return NULL;
+}
+
+static const char *fmt_ns(char buf[12], unsigned long ns) {
+  if (ns < 10000)
+    snprintf(buf, 12, "%luns", ns);
+  else if (ns < 10000000)
+    snprintf(buf, 12, "%.1fus", ns / 1e3);
+  else if (ns < 10000000000UL)
+    snprintf(buf, 12, "%.1fms", ns / 1e6);
+  else
+    snprintf(buf, 12, "%.1fs", ns / 1e9);
+  return buf;
+}
+
+// 통계 패널 글자. w에 둔 지난번 합계 이후(최근 구간)의 값을 보여주고
+// w를 지금 합계로 바꾼다. 대시보드(Tab)와 제어 소켓 PANEL이 쓴다.
+int metrics_panel(struct metrics_window *w, char lines[][64], int max) {
+  struct metrics cur, d;
+  long long now = now_ns(CLOCK_MONOTONIC);
+  double dt = (now - (w->prev_ns ? w->prev_ns : start_ns)) / 1e9;
+  unsigned long depth = __atomic_load_n(&log_enq_pos, __ATOMIC_RELAXED) -
+                        __atomic_load_n(&log_deq_pos, __ATOMIC_RELAXED);
+  unsigned threads = __atomic_load_n(&metric_threads, __ATOMIC_RELAXED);
+  char a[4][12];
+  int n = 0, len;
+
+  metrics_sum(&cur);
+  metrics_diff(&cur, &w->prev, &d);
+  if (dt <= 0)
+    dt = 1;
+#define PANEL_LINE(...)                                                        \
+  do {                                                                         \
+    if (n < max)                                                               \
+      snprintf(lines[n++], 64, __VA_ARGS__);                                   \
+  } while (0)
+  PANEL_LINE("Ingest   %7.0f msg/s %6.2f MB/s  errors %.0f/s", d.msgs / dt,
+             d.bytes / dt / 1e6, d.errors / dt);
+  PANEL_LINE("Publish  p50 %s  p99 %s  p99.9 %s",
+             fmt_ns(a[0], hist_pct(d.hist_publish, 50)),
+             fmt_ns(a[1], hist_pct(d.hist_publish, 99)),
+             fmt_ns(a[2], hist_pct(d.hist_publish, 99.9)));
+  PANEL_LINE("Command  %lu acked  p50 %s  p99 %s  max %s",
+             hist_count(d.hist_cmd), fmt_ns(a[0], hist_pct(d.hist_cmd, 50)),
+             fmt_ns(a[1], hist_pct(d.hist_cmd, 99)),
+             fmt_ns(a[2], hist_pct(d.hist_cmd, 100)));
+  PANEL_LINE("Conns    %lu open  +%lu -%lu  handoff %lu",
+             cur.accepts - cur.closes, d.accepts, d.closes, d.handoffs);
+  PANEL_LINE("Log q    %lu/%lu  max %lu  dropped %lu  late %lu", depth,
+             log_queue_size, cur.log_depth_max,
+             __atomic_load_n(&log_dropped, __ATOMIC_RELAXED),
+             __atomic_load_n(&log_late, __ATOMIC_RELAXED));
+  for (int k = 0; k < NUM_LOCKS; k++)
+    PANEL_LINE("Lock %-8s %7.0f/s  contended %5.1f%%  wait %s/s",
+               LOCK_NAMES[k], d.lock_acq[k] / dt,
+               d.lock_acq[k] ? 100.0 * d.lock_contended[k] / d.lock_acq[k] : 0,
+               fmt_ns(a[0], d.lock_wait_ns[k] / dt));
+  // 마지막 줄: 스레드별 처리량 (들어가는 만큼)
+  if (n < max) {
+    len = snprintf(lines[n], 64, "Ingest threads");
+    for (unsigned i = 1; i < threads && i < MAX_METRIC_THREADS; i++) {
+      unsigned long m = __atomic_load_n(&all_metrics[i].msgs, __ATOMIC_RELAXED);
+      unsigned long before = 0;
+      if (strncmp(all_metrics[i].name, "ingest", 6))
+        continue;
+      before = w->prev_ns ? w->thread_msgs[i] : 0;
+      w->thread_msgs[i] = m;
+      if (len < 60)
+        len += snprintf(lines[n] + len, 64 - len, " #%s %.0f/s",
+                        all_metrics[i].name + 7, (m - before) / dt);
+    }
+    n++;
+  }
+#undef PANEL_LINE
+  w->prev = cur;
+  w->prev_ns = now;
+  return n;
+}
+
+// 히스토그램 하나를 Prometheus 글자 형식으로 (빈 칸은 건너뛴다).
+static void expose_hist(FILE *out, const char *name, const char *help,
+                        const unsigned long *h, unsigned long sum_ns) {
+  unsigned long cum = 0;
+
+  fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    if (!h[b])
+      continue;
+    cum += h[b];
+    fprintf(out, "%s_bucket{le=\"%.9g\"} %lu\n", name, hist_upper(b) / 1e9,
+            cum);
+  }
+  fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.9f\n%s_count %lu\n",
+          name, cum, name, sum_ns / 1e9, name, cum);
+}
+
+// METRICS 요청: 모든 계측을 Prometheus 글자 형식으로 내보낸다.
+static void metrics_expose(FILE *out) {
+  unsigned threads = __atomic_load_n(&metric_threads, __ATOMIC_RELAXED);
+  unsigned count = __atomic_load_n(&sensor_count, __ATOMIC_ACQUIRE);
+  struct metrics t;
+  static const struct {
+    const char *name, *help;
+    size_t off;
+  } per_thread[] = {
+      {"factory_messages_total", "Status messages published",
+       offsetof(struct metrics, msgs)},
+      {"factory_bytes_total", "Bytes read from sensors",
+       offsetof(struct metrics, bytes)},
+      {"factory_reads_total", "Socket reads", offsetof(struct metrics, reads)},
+      {"factory_errors_total", "ERROR status messages",
+       offsetof(struct metrics, errors)},
+      {"factory_handoffs_total",
+       "Connections passed to the ingest loop that owns their sensors",
+       offsetof(struct metrics, handoffs)},
+  };
+
+  metrics_sum(&t);
+  if (threads > MAX_METRIC_THREADS)
+    threads = MAX_METRIC_THREADS;
+  for (size_t k = 0; k < sizeof(per_thread) / sizeof(per_thread[0]); k++) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", per_thread[k].name,
+            per_thread[k].help, per_thread[k].name);
+    for (unsigned i = 0; i < threads; i++)
+      fprintf(out, "%s{thread=\"%s\"} %lu\n", per_thread[k].name,
+              all_metrics[i].name,
+              __atomic_load_n((unsigned long *)((char *)&all_metrics[i] +
+                                                per_thread[k].off),
+                              __ATOMIC_RELAXED));
+  }
+  fprintf(out, "# TYPE factory_connections_open gauge\n"
+               "factory_connections_open %lu\n"
+               "# TYPE factory_connections_accepted_total counter\n"
+               "factory_connections_accepted_total %lu\n",
+          t.accepts - t.closes, t.accepts);
+
+  fprintf(out, "# HELP factory_lock_wait_seconds_total Time spent waiting "
+               "for a contended lock\n"
+               "# TYPE factory_lock_wait_seconds_total counter\n");
+  for (int k = 0; k < NUM_LOCKS; k++)
+    fprintf(out,
+            "factory_lock_acquired_total{lock=\"%s\"} %lu\n"
+            "factory_lock_contended_total{lock=\"%s\"} %lu\n"
+            "factory_lock_wait_seconds_total{lock=\"%s\"} %.9f\n",
+            LOCK_NAMES[k], t.lock_acq[k], LOCK_NAMES[k], t.lock_contended[k],
+            LOCK_NAMES[k], t.lock_wait_ns[k] / 1e9);
+
+  fprintf(out,
+          "# TYPE factory_log_queue_depth gauge\n"
+          "factory_log_queue_depth %lu\n"
+          "factory_log_queue_depth_max %lu\n"
+          "factory_log_queue_capacity %lu\n"
+          "# TYPE factory_log_dropped_total counter\n"
+          "factory_log_dropped_total %lu\n"
+          "factory_log_late_total %lu\n"
+          "factory_log_written_total %lu\n",
+          __atomic_load_n(&log_enq_pos, __ATOMIC_RELAXED) -
+              __atomic_load_n(&log_deq_pos, __ATOMIC_RELAXED),
+          t.log_depth_max, log_queue_size,
+          __atomic_load_n(&log_dropped, __ATOMIC_RELAXED),
+          __atomic_load_n(&log_late, __ATOMIC_RELAXED),
+          __atomic_load_n(&log_written, __ATOMIC_RELAXED));
+
+  // 이벤트 버스 구독자 (direct 구독자는 자기 큐의 계측을 쓴다)
+  fprintf(out, "# TYPE factory_bus_subscriber info\n"
+               "# TYPE factory_bus_events_total counter\n"
+               "# TYPE factory_bus_dropped_total counter\n"
+               "# TYPE factory_bus_queue_depth gauge\n");
+  for (int i = 0; i < __atomic_load_n(&bus_nsubs, __ATOMIC_ACQUIRE); i++) {
+    struct bus_sub *b = &bus_subs[i];
+    unsigned long enq = __atomic_load_n(&b->enq, __ATOMIC_RELAXED);
+
+    fprintf(out, "factory_bus_subscriber{sub=\"%s\",policy=\"%s\"} 1\n",
+            b->name, BUS_POLICY_NAMES[b->policy]);
+    if (b->policy == BUS_DIRECT)
+      continue;
+    fprintf(out,
+            "factory_bus_events_total{sub=\"%s\"} %lu\n"
+            "factory_bus_dropped_total{sub=\"%s\"} %lu\n"
+            "factory_bus_queue_depth{sub=\"%s\"} %lu\n",
+            b->name, enq, b->name,
+            __atomic_load_n(&b->dropped, __ATOMIC_RELAXED), b->name,
+            enq - __atomic_load_n(&b->deq, __ATOMIC_RELAXED));
+  }
+
+  expose_hist(out, "factory_publish_latency_seconds",
+              "From socket read to the status being visible", t.hist_publish,
+              t.publish_sum_ns);
+  expose_hist(out, "factory_command_rtt_seconds",
+              "From queueing a command to its ACK", t.hist_cmd, t.cmd_sum_ns);
+
+  // 기계별 (보고가 있었던 것만)
+  fprintf(out, "# TYPE factory_sensor_messages_total counter\n"
+               "# TYPE factory_sensor_errors_total counter\n");
+  for (unsigned i = 0; i < count; i++) {
+    unsigned long m = __atomic_load_n(&sensors[i].msgs, __ATOMIC_RELAXED);
+    if (!m)
+      continue;
+    fprintf(out,
+            "factory_sensor_messages_total{id=\"%s\"} %lu\n"
+            "factory_sensor_errors_total{id=\"%s\"} %lu\n",
+            sensors[i].id, m, sensors[i].id,
+            __atomic_load_n(&sensors[i].errors, __ATOMIC_RELAXED));
+  }
+}
+
+// [제어 소켓] 유닉스 소켓으로 한 줄짜리 요청을 받는다. 답은 몇 줄이든
+// 마지막에 "END" 줄을 붙인다.
+//   STATS           -> "STATS msgs=.. bytes=.. conns=.. sensors=.. dropped=.. late=.."
+//   METRICS         -> 모든 계측 (Prometheus 글자 형식)
+//   PANEL           -> 통계 패널 줄들 (이 접속에서 지난번 PANEL 이후 구간)
+//   LIST 시작 개수  -> "COUNT 전체" 다음 기계마다 "S 인덱스 ID active error
+//                      fields mode button led temp 명령번호 명령상태 rtt_us
+//                      경보 되살린값시각(ms, 없으면 0) 상태"
+//   TREND 인덱스    -> 대시보드 4번째 줄과 같은 추세 한 줄
+//   CMD 인덱스 명령 -> "OK 번호" 또는 "FAIL"
+static void ctl_handle(FILE *out, char *line, struct metrics_window *w) {
+  unsigned count = __atomic_load_n(&sensor_count, __ATOMIC_ACQUIRE);
+  unsigned from, n;
+  int off = 0;
+
+  if (!strcmp(line, "STATS")) {
+    struct metrics t;
+    metrics_sum(&t);
+    fprintf(out, "STATS msgs=%lu bytes=%lu conns=%lu sensors=%u dropped=%lu "
+                 "late=%lu acks=%lu\n",
+            t.msgs, t.bytes, t.accepts - t.closes, count,
+            __atomic_load_n(&log_dropped, __ATOMIC_RELAXED),
+            __atomic_load_n(&log_late, __ATOMIC_RELAXED),
+            hist_count(t.hist_cmd));
+  } else if (!strcmp(line, "METRICS")) {
+    metrics_expose(out);
+  } else if (!strcmp(line, "PANEL")) {
+    char lines[UI_ROWS][64];
+    int k = metrics_panel(w, lines, UI_ROWS);
+    for (int i = 0; i < k; i++)
+      fprintf(out, "%s\n", lines[i]);
+  } else if (sscanf(line, "LIST %u %u", &from, &n) == 2) {
+    fprintf(out, "COUNT %u\n", count);
+    for (unsigned i = from; i < count && i - from < n; i++) {
+      struct sensor_view v;
+      sensor_snapshot(i, &v);
+      fprintf(out, "S %u %s %d %d %u %u %u %u %g %u %d %ld %s %lld %s\n", i,
+              sensors[i].id, v.active, v.error, v.fields, v.mode, v.button,
+              v.led, v.temp, v.cmd_corr, v.cmd_state, v.cmd_rtt_us,
+              v.alert[0] ? v.alert : "-", v.restored ? v.seen_ms : 0,
+              v.status);
+    }
+  } else if (sscanf(line, "TREND %u", &from) == 1 && from < count) {
+    char text[TREND_TEXT_LEN];
+    trend_text(from, text, sizeof(text));
+    fprintf(out, "%s\n", text);
+  } else if (sscanf(line, "CMD %u %n", &from, &off) == 1 && off &&
+             from < count) {
+    unsigned corr = queue_command(from, line + off);
+    if (corr)
+      fprintf(out, "OK %u\n", corr);
+    else
+      fprintf(out, "FAIL\n");
+  } else
+    fprintf(out, "ERROR unknown request\n");
+}
+
+static void *ctl_client(void *arg) {
+  int fd = (int)(intptr_t)arg;
+  FILE *in = fdopen(fd, "r"), *out = fdopen(dup(fd), "w");
+  struct metrics_window *w = calloc(1, sizeof(*w));
+  char line[BUF_SIZE];
+
+  while (in && out && w && fgets(line, sizeof(line), in)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    ctl_handle(out, line, w);
+    fputs("END\n", out);
+    if (fflush(out) == EOF)
+      break;
+  }
+  free(w);
+  if (out)
+    fclose(out);
+  if (in)
+    fclose(in);
+  else
+    close(fd);
+  return NULL;
+}
+
+// 제어 소켓에 붙는 프로세스마다 스레드 하나. 몇 개 안 되고 드물다.
+static void *ctl_thread(void *arg) {
+  (void)arg;
   while (1) {
-    client_addr_size = sizeof(client_addr);
-    client_sock =
-        accept(server_sock, (struct sockaddr *)&client_addr, &client_addr_size);
+    int fd = accept4(ctl_fd, NULL, NULL, SOCK_CLOEXEC);
+    pthread_t tid;
 
-    if (client_sock == -1)
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      break;
+    }
+    if (pthread_create(&tid, NULL, ctl_client, (void *)(intptr_t)fd) != 0)
+      close(fd);
+    else
+      pthread_detach(tid);
+  }
+  return NULL;
+}
+
+// 제어 소켓을 연다. 안 되면 경고만 하고 서버는 그대로 돈다.
+void ctl_open() {
+  struct sockaddr_un addr;
+  pthread_t tid;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(ctl_path) >= sizeof(addr.sun_path))
+    return;
+  strcpy(addr.sun_path, ctl_path);
+  unlink(ctl_path); // 예전 실행이 남긴 소켓 파일
+  ctl_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (ctl_fd == -1 ||
+      bind(ctl_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(ctl_fd, 4) == -1) {
+    log_info("Control socket %s unavailable: %s", ctl_path, strerror(errno));
+    if (ctl_fd != -1)
+      close(ctl_fd);
+    ctl_fd = -1;
+    return;
+  }
+  pthread_create(&tid, NULL, ctl_thread, NULL);
+  pthread_detach(tid);
+}
+
+// [헤드리스 통계] stats_interval초마다 한 줄씩 표준 출력에 찍는다.
+// Ctrl+C를 받으면 로그를 마저 쓰고 끝낸다 (UI 스레드가 하던 일).
+void *stats_thread(void *arg) {
+  static struct metrics prev, cur, d;
+  long long last = now_ns(CLOCK_MONOTONIC), next = last;
+  (void)arg;
+
+  metrics_thread("stats", 0);
+  if (replay_path)
+    printf("Headless replay of %s, control socket %s\n", replay_path,
+           ctl_fd != -1 ? ctl_path : "(none)");
+  else
+    printf("Headless server on port %d, control socket %s\n", PORT,
+           ctl_fd != -1 ? ctl_path : "(none)");
+  fflush(stdout);
+  while (keep_running) {
+    unsigned count, active = 0;
+    unsigned long wait_ns = 0;
+    long long now;
+    time_t t;
+    char when[16], a[4][12];
+    double dt;
+
+    // Ctrl+C가 와도 이 스레드는 깨지 않으므로 0.1초씩 나눠 잔다
+    next += stats_interval * 1000000000LL;
+    while (keep_running && now_ns(CLOCK_MONOTONIC) < next)
+      usleep(100000);
+    if (!keep_running)
+      break;
+    now = now_ns(CLOCK_MONOTONIC);
+    count = __atomic_load_n(&sensor_count, __ATOMIC_ACQUIRE);
+    t = time(NULL);
+    dt = (now - last) / 1e9;
+    last = now;
+
+    metrics_sum(&cur);
+    metrics_diff(&cur, &prev, &d);
+    prev = cur;
+    for (int k = 0; k < NUM_LOCKS; k++)
+      wait_ns += d.lock_wait_ns[k];
+    for (unsigned i = 0; i < count; i++)
+      active += __atomic_load_n(&sensors[i].active, __ATOMIC_RELAXED);
+    strftime(when, sizeof(when), "%H:%M:%S", localtime(&t));
+
+    printf("[%s] msgs %.0f/s  %.2f MB/s  conns %lu  sensors %u/%u  "
+           "publish p50 %s p99 %s  acks %lu (p99 %s)  lock wait %s/s  "
+           "log q max %lu dropped %lu late %lu\n",
+           when, d.msgs / dt, d.bytes / dt / 1e6, cur.accepts - cur.closes,
+           active, count, fmt_ns(a[0], hist_pct(d.hist_publish, 50)),
+           fmt_ns(a[1], hist_pct(d.hist_publish, 99)), hist_count(d.hist_cmd),
+           fmt_ns(a[2], hist_pct(d.hist_cmd, 99)), fmt_ns(a[3], wait_ns / dt),
+           cur.log_depth_max, __atomic_load_n(&log_dropped, __ATOMIC_RELAXED),
+           __atomic_load_n(&log_late, __ATOMIC_RELAXED));
+    fflush(stdout);
+  }
+
+  log_event(EV_STOP, -1, NULL, 0);
+  metrics_sum(&cur);
+  printf("Stopping: %lu messages handled.\n", cur.msgs);
+  fflush(stdout);
+  server_stop();
+  return NULL;
+}
+
+// [붙는 UI] 다른 서버의 제어 소켓으로 기계 목록을 주기적으로 받아 와서
+// 이 프로세스의 sensors[]에 그대로 옮긴다. 그러면 대시보드 코드는 바뀐
+// 것 없이 sensor_snapshot으로 읽고 dirty인 줄만 다시 그린다. 보이는 줄은
+// 화면 갱신 주기마다, 전체 목록(명령 선택 화면용)과 통계는 1초마다 받는다.
+int attach_fd = -1;
+FILE *attach_in;
+pthread_mutex_t attach_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 요청 한 줄을 보내고 "END"까지 온 줄을 on_line에 넘긴다. 서버가
+// 사라졌으면 UI도 끝내도록 keep_running을 내리고 -1.
+int attach_request(const char *req, void (*on_line)(char *line, void *arg),
+                   void *arg) {
+  char line[BUF_SIZE];
+  int ret = -1;
+
+  pthread_mutex_lock(&attach_lock);
+  if (write(attach_fd, req, strlen(req)) == (ssize_t)strlen(req)) {
+    while (fgets(line, sizeof(line), attach_in)) {
+      line[strcspn(line, "\n")] = '\0';
+      if (!strcmp(line, "END")) {
+        ret = 0;
+        break;
+      }
+      if (on_line)
+        on_line(line, arg);
+    }
+  }
+  pthread_mutex_unlock(&attach_lock);
+  if (ret == -1)
+    keep_running = 0;
+  return ret;
+}
+
+// "COUNT n" 또는 "S ..." 한 줄을 sensors[]에 반영한다. 서버가 준 인덱스
+// 순서대로 등록하므로 인덱스가 서버와 같다.
+static void attach_row(char *line, void *arg) {
+  struct sensor_view v;
+  struct sensor *sn;
+  unsigned idx, fields, mode, button, led, corr;
+  int active, error, state, off = 0;
+  char id[SENSOR_ID_LEN], alert_name[RULE_NAME_LEN];
+  long rtt;
+  long long seen;
+  float temp;
+
+  if (sscanf(line, "COUNT %u", (unsigned *)arg) == 1)
+    return;
+  if (sscanf(line, "S %u %23s %d %d %u %u %u %u %f %u %d %ld %23s %lld %n",
+             &idx, id, &active, &error, &fields, &mode, &button, &led, &temp,
+             &corr, &state, &rtt, alert_name, &seen, &off) != 14 ||
+      !off)
+    return;
+  if (!strcmp(alert_name, "-"))
+    alert_name[0] = '\0';
+  if (idx == sensor_count)
+    sensor_register(id, strlen(id));
+  if (idx >= sensor_count || strcmp(sensors[idx].id, id))
+    return; // 아직 앞쪽 목록을 못 받았다
+
+  sn = &sensors[idx];
+  sensor_snapshot(idx, &v);
+  if (v.active == active && v.error == error && v.fields == fields &&
+      v.cmd_corr == corr && v.cmd_state == state && v.cmd_rtt_us == rtt &&
+      !strcmp(v.alert, alert_name) && v.restored == (seen != 0) &&
+      (!seen || v.seen_ms == seen) && !strcmp(v.status, line + off))
+    return; // 바뀐 게 없으면 다시 그리지 않는다
+  sensor_write_begin(sn);
+  sn->active = active;
+  sn->error = error;
+  sn->fields = fields;
+  sn->mode = mode;
+  sn->button = button;
+  sn->led = led;
+  sn->temp = temp;
+  sn->cmd_corr = corr;
+  sn->cmd_state = state;
+  sn->cmd_rtt_us = rtt;
+  memcpy(sn->alert_name, alert_name, RULE_NAME_LEN);
+  sn->restored = seen != 0;
+  sn->restored_ms = seen;
+  snprintf(sn->status, STATUS_LEN, "%s", line + off);
+  sensor_write_end(sn);
+  ui_notify(idx);
+}
+
+static void attach_stats(char *line, void *arg) {
+  const char *p;
+  (void)arg;
+
+  if ((p = strstr(line, "dropped=")))
+    log_dropped = strtoul(p + 8, NULL, 10);
+  if ((p = strstr(line, "late=")))
+    log_late = strtoul(p + 5, NULL, 10);
+}
+
+void *attach_thread(void *arg) {
+  long long next_full = 0;
+  (void)arg;
+
+  while (keep_running) {
+    long long now = now_ns(CLOCK_MONOTONIC) / 1000000;
+    char req[64];
+
+    if (now >= next_full) {
+      unsigned total = 1;
+      for (unsigned from = 0; from < total && keep_running; from += 512) {
+        snprintf(req, sizeof(req), "LIST %u 512\n", from);
+        attach_request(req, attach_row, &total);
+      }
+      attach_request("STATS\n", attach_stats, NULL);
+      next_full = now + 1000;
+    } else {
+      unsigned total;
+      snprintf(req, sizeof(req), "LIST %u %d\n",
+               __atomic_load_n(&ui_top, __ATOMIC_RELAXED), UI_ROWS);
+      attach_request(req, attach_row, &total);
+    }
+    usleep(1000000 / ui_fps);
+  }
+  ui_wake(); // 서버가 사라졌으면 UI를 깨워서 끝내게 한다
+  return NULL;
+}
+
+// 제어 소켓에 접속한다. 실패하면 -1.
+int attach_open() {
+  struct sockaddr_un addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, attach_path, sizeof(addr.sun_path) - 1);
+  attach_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (attach_fd == -1 ||
+      connect(attach_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "Cannot attach to %s: %s\n", attach_path,
+            strerror(errno));
+    return -1;
+  }
+  attach_in = fdopen(dup(attach_fd), "r");
+  return attach_in ? 0 : -1;
+}
+
+// [벤치마크] ./server -b 이름 : 화면(ncurses)이나 소켓 없이 서버 안쪽의
+// 한 부분만 돌려서 재고 끝난다. 이름은 parse, wire, lookup, log, publish,
+// all. -j를 붙이면 결과를 JSON 한 덩어리로 출력해서 실행마다 모아 두고
+// 비교할 수 있다. 종단간(접속, 전송, 발행) 측정은 loadgen -X가 한다.
+#define BENCH_ITERS 1000000
+#define BENCH_SENSORS 10000
+
+int bench_json = 0; // -j
+
+// JSON으로 낼 측정값. 같은 벤치마크의 값은 이어서 넣는다.
+struct bench_metric {
+  const char *bench, *key;
+  double value;
+};
+static struct bench_metric bench_metrics[64];
+static int bench_nmetrics = 0;
+
+static void bench_metric(const char *bench, const char *key, double value) {
+  if (bench_nmetrics < (int)(sizeof(bench_metrics) / sizeof(bench_metrics[0])))
+    bench_metrics[bench_nmetrics++] = (struct bench_metric){bench, key, value};
+}
+
+// 사람이 읽는 한 줄은 JSON이 아닐 때만
+#define BENCH_PRINT(...)                                                       \
+  do {                                                                         \
+    if (!bench_json)                                                           \
+      printf(__VA_ARGS__);                                                     \
+  } while (0)
+
+static const char *BENCH_LINES[] = {
+    "ARM01:MODE:RUNNING TEMP:23.5C", "TEMP02:TEMP:23.5C",
+    "BUTTON01:BUTTON:PRESSED (EMERGENCY)", "LED01:LED:ON", "ARM01:ERROR",
+};
+#define BENCH_NLINES (sizeof(BENCH_LINES) / sizeof(BENCH_LINES[0]))
+
+// 예전 handle_client가 메시지 하나마다 하던 일
+static int bench_parse_sscanf(const char *line, size_t len) {
+  char buffer[BUF_SIZE], temp_id[BUF_SIZE], message[BUF_SIZE];
+  char status[BUF_SIZE];
+
+  memcpy(buffer, line, len + 1);
+  sscanf(buffer, "%[^:]:%[^\n]", temp_id, message);
+  buffer[strcspn(buffer, "\n")] = 0;
+  message[strcspn(buffer, "\n")] = 0;
+  snprintf(status, BUF_SIZE, "%s", buffer);
+  return !strcmp("ERROR", message) + status[0];
+}
+
+static int bench_parse_view(const char *line, size_t len) {
+  const char *colon = memchr(line, ':', len);
+  struct payload p;
+
+  parse_payload(colon + 1, line + len - colon - 1, &p);
+  return p.fields + (int)p.temp;
+}
+
+static double bench_run(int (*fn)(const char *, size_t), size_t lens[]) {
+  long long t0 = now_ns(CLOCK_MONOTONIC);
+  volatile int sink = 0;
+
+  for (int i = 0; i < BENCH_ITERS; i++) {
+    unsigned k = i % BENCH_NLINES;
+    sink += fn(BENCH_LINES[k], lens[k]);
+  }
+  (void)sink;
+  return (double)(now_ns(CLOCK_MONOTONIC) - t0) / BENCH_ITERS;
+}
+
+// 글자와 BIN1로 같은 상태 보고를 보낼 때 바이트 수와, 클라이언트가 만들고
+// 서버가 읽는 데 드는 시간을 비교한다.
+static const struct sample BENCH_SAMPLES[] = {
+    {SF_MODE | SF_TEMP, MODE_RUNNING, 0, 0, 23.5f, NULL, NULL, 0, 0},
+    {SF_TEMP, 0, 0, 0, 23.5f, NULL, NULL, 0, 0},
+    {SF_BUTTON | SF_NOTE, 0, 1, 0, 0, NULL, "EMERGENCY", 0, 9},
+    {SF_LED, 0, 0, 1, 0, NULL, NULL, 0, 0},
+};
+#define BENCH_NSAMPLES (sizeof(BENCH_SAMPLES) / sizeof(BENCH_SAMPLES[0]))
+
+static int bench_wire(int binary, long *bytes) {
+  uint8_t buf[BIN_HDR_SIZE + BIN_MAX_PAYLOAD];
+  int sink = 0;
+
+  for (int i = 0; i < BENCH_ITERS; i++) {
+    const struct sample *s = &BENCH_SAMPLES[i % BENCH_NSAMPLES];
+    int n;
+
+    if (binary) { // 클라이언트: 프레임 만들기 -> 서버: 길이 확인, TLV 풀기
+      struct sample out;
+      n = sample_to_bin(buf, sizeof(buf), 3, s);
+      if (bin_frame_len(buf, n) == n && !bin_decode(buf, &out, NULL))
+        sink += out.fields;
+    } else { // 클라이언트: "ID:STATUS\n" 만들기 -> 서버: 줄 자르기, 파싱
+      struct payload p;
+      const char *colon;
+      n = snprintf((char *)buf, sizeof(buf), "ARM01:");
+      n += sample_to_text((char *)buf + n, sizeof(buf) - n, s);
+      buf[n++] = '\n';
+      colon = memchr(buf, ':', n);
+      sink += parse_payload(colon + 1, (char *)memchr(buf, '\n', n) - colon - 1,
+                            &p);
+    }
+    *bytes += n;
+  }
+  return sink;
+}
+
+static void bench_parse() {
+  size_t lens[BENCH_NLINES];
+  double old_ns, new_ns;
+
+  for (size_t k = 0; k < BENCH_NLINES; k++)
+    lens[k] = strlen(BENCH_LINES[k]);
+  old_ns = bench_run(bench_parse_sscanf, lens);
+  new_ns = bench_run(bench_parse_view, lens);
+  BENCH_PRINT("parse: sscanf %.1f ns/msg, view %.1f ns/msg (%.1fx, %d msgs)\n",
+              old_ns, new_ns, old_ns / new_ns, BENCH_ITERS);
+  bench_metric("parse", "sscanf_ns", old_ns);
+  bench_metric("parse", "view_ns", new_ns);
+}
+
+static void bench_wire_both() {
+  long text_bytes = 0, bin_bytes = 0;
+  long long t0 = now_ns(CLOCK_MONOTONIC), t1, t2;
+  volatile int sink = bench_wire(0, &text_bytes);
+
+  t1 = now_ns(CLOCK_MONOTONIC);
+  sink += bench_wire(1, &bin_bytes);
+  t2 = now_ns(CLOCK_MONOTONIC);
+  (void)sink;
+  BENCH_PRINT("wire: text %.1f B/sample %.1f ns/sample, " PROTO_NAME
+              " %.1f B/sample %.1f ns/sample\n",
+              (double)text_bytes / BENCH_ITERS, (double)(t1 - t0) / BENCH_ITERS,
+              (double)bin_bytes / BENCH_ITERS, (double)(t2 - t1) / BENCH_ITERS);
+  bench_metric("wire", "text_bytes", (double)text_bytes / BENCH_ITERS);
+  bench_metric("wire", "text_ns", (double)(t1 - t0) / BENCH_ITERS);
+  bench_metric("wire", "bin_bytes", (double)bin_bytes / BENCH_ITERS);
+  bench_metric("wire", "bin_ns", (double)(t2 - t1) / BENCH_ITERS);
+}
+
+// lookup과 publish가 같이 쓰는 명단: VS00000.. BENCH_SENSORS개
+static char (*bench_ids)[SENSOR_ID_LEN];
+
+static double bench_sensors() {
+  long long t0;
+
+  if (bench_ids)
+    return 0;
+  sensor_cap = BENCH_SENSORS;
+  sensor_alloc();
+  bench_ids = calloc(BENCH_SENSORS, sizeof(*bench_ids));
+  if (!bench_ids)
+    exit(1);
+  for (unsigned i = 0; i < BENCH_SENSORS; i++)
+    snprintf(bench_ids[i], SENSOR_ID_LEN, "VS%05u", i);
+  t0 = now_ns(CLOCK_MONOTONIC);
+  for (unsigned i = 0; i < BENCH_SENSORS; i++)
+    sensor_register(bench_ids[i], 7);
+  return (double)(now_ns(CLOCK_MONOTONIC) - t0) / BENCH_SENSORS;
+}
+
+// 섞인 순서로 찾기 (캐시에 다 들어가지 않게), 없는 ID 찾기
+static void bench_lookup() {
+  double reg_ns = bench_sensors(), hit_ns, miss_ns;
+  volatile int sink = 0;
+  unsigned k = 1;
+  long long t0;
+
+  t0 = now_ns(CLOCK_MONOTONIC);
+  for (int i = 0; i < BENCH_ITERS; i++) {
+    k = k * 1103515245u + 12345u;
+    sink += sensor_lookup(bench_ids[(k >> 8) % BENCH_SENSORS], 7);
+  }
+  hit_ns = (double)(now_ns(CLOCK_MONOTONIC) - t0) / BENCH_ITERS;
+  t0 = now_ns(CLOCK_MONOTONIC);
+  for (int i = 0; i < BENCH_ITERS; i++) {
+    char id[8];
+    memcpy(id, bench_ids[i % BENCH_SENSORS], 8);
+    id[0] = 'X';
+    sink += sensor_lookup(id, 7);
+  }
+  miss_ns = (double)(now_ns(CLOCK_MONOTONIC) - t0) / BENCH_ITERS;
+  (void)sink;
+  BENCH_PRINT("lookup: hit %.1f ns, miss %.1f ns, register %.1f ns "
+              "(%d sensors)\n",
+              hit_ns, miss_ns, reg_ns, BENCH_SENSORS);
+  bench_metric("lookup", "hit_ns", hit_ns);
+  bench_metric("lookup", "miss_ns", miss_ns);
+  if (reg_ns > 0)
+    bench_metric("lookup", "register_ns", reg_ns);
+}
+
+static int bench_rm(const char *dir) {
+  struct dirent **names;
+  char path[PATH_MAX];
+  int n = scandir(dir, &names, is_segment, alphasort);
+
+  for (int i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name);
+    unlink(path);
+    free(names[i]);
+  }
+  if (n >= 0)
+    free(names);
+  return rmdir(dir);
+}
+
+// 로그 레코드를 큐에 넣는 시간과, 로거 스레드가 세그먼트 파일까지 쓰는
+// 처리량. 큐를 반씩 채우고 비워질 때까지 기다려서 버려지는 레코드가 없게
+// 한다. 임시 디렉터리에 쓰고 끝나면 지운다.
+static void bench_log() {
+  char dir[] = "/tmp/factory-bench-XXXXXX";
+  const char *line = BENCH_LINES[0];
+  int len = strlen(line);
+  long long enq = 0, t0;
+  double total;
+  unsigned long batch;
+
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  log_dir = dir;
+  log_init();
+  batch = log_queue_size / 2;
+  t0 = now_ns(CLOCK_MONOTONIC);
+  for (unsigned long done = 0; done < BENCH_ITERS; done += batch) {
+    long long t1 = now_ns(CLOCK_MONOTONIC);
+    for (unsigned long i = 0; i < batch && done + i < BENCH_ITERS; i++)
+      log_event(EV_MSG, i & 1023, line, len);
+    enq += now_ns(CLOCK_MONOTONIC) - t1;
+    sem_post(&log_wake);
+    while (__atomic_load_n(&log_written, __ATOMIC_RELAXED) < done + batch &&
+           __atomic_load_n(&log_written, __ATOMIC_RELAXED) < BENCH_ITERS)
+      usleep(50);
+  }
+  total = (double)(now_ns(CLOCK_MONOTONIC) - t0) / 1e9;
+  BENCH_PRINT("log: enqueue %.1f ns/record, written %.0f records/s "
+              "(%.1f MB/s), dropped %lu\n",
+              (double)enq / BENCH_ITERS, BENCH_ITERS / total,
+              BENCH_ITERS * (sizeof(struct ev_hdr) + len) / total / 1e6,
+              log_dropped);
+  bench_metric("log", "enqueue_ns", (double)enq / BENCH_ITERS);
+  bench_metric("log", "records_per_s", BENCH_ITERS / total);
+  bench_metric("log", "dropped", log_dropped);
+  log_shutdown();
+  free(log_queue);
+  log_queue = NULL; // 다음 벤치마크의 log_event는 아무것도 안 한다
+  bench_rm(dir);
+}
+
+// 파싱이 끝난 상태를 센서에 반영하기: 시계열, seqlock 쓰기, UI 알림
+// (UI가 없어서 dirty 표시만), 로그(꺼져 있음)를 모두 지난다.
+static void bench_publish() {
+  struct payload p[BENCH_NLINES];
+  int skip[BENCH_NLINES], lens[BENCH_NLINES];
+  struct metrics *m = my_metrics;
+  long long t0;
+  double ns;
+
+  bench_sensors();
+  for (size_t k = 0; k < BENCH_NLINES; k++) {
+    const char *colon = strchr(BENCH_LINES[k], ':');
+    lens[k] = strlen(BENCH_LINES[k]);
+    skip[k] = colon - BENCH_LINES[k] + 1;
+    parse_payload(colon + 1, lens[k] - skip[k], &p[k]);
+  }
+  memset(m->hist_publish, 0, sizeof(m->hist_publish));
+  t0 = now_ns(CLOCK_MONOTONIC);
+  for (int i = 0; i < BENCH_ITERS; i++) {
+    unsigned k = i % BENCH_NLINES;
+    read_ns = now_ns(CLOCK_MONOTONIC);
+    publish_status(i % 1024, &p[k], BENCH_LINES[k], lens[k], skip[k]);
+  }
+  ns = (double)(now_ns(CLOCK_MONOTONIC) - t0) / BENCH_ITERS;
+  BENCH_PRINT("publish: %.1f ns/msg, p50 %lu ns, p99 %lu ns, p99.9 %lu ns\n",
+              ns, hist_pct(m->hist_publish, 50), hist_pct(m->hist_publish, 99),
+              hist_pct(m->hist_publish, 99.9));
+  bench_metric("publish", "ns", ns);
+  bench_metric("publish", "p50_ns", hist_pct(m->hist_publish, 50));
+  bench_metric("publish", "p99_ns", hist_pct(m->hist_publish, 99));
+  bench_metric("publish", "p999_ns", hist_pct(m->hist_publish, 99.9));
+}
+
+// 경보 규칙 평가: 규칙 수를 10개에서 5000개로 늘려도 보고 하나의 평가
+// 비용이 그대로인지 본다. 규칙은 "VSxxxxx TEMP > 50 clear 40" 꼴이고 "*"
+// 규칙 둘이 모든 센서에 더 걸린다. 센서마다 규칙을 고르는 첫 보고는 재기
+// 전에 한 번 돌려 둔다.
+static void bench_rules() {
+  static const unsigned counts[] = {10, 5000};
+  struct payload p[2];
+  char line[64];
+
+  bench_sensors();
+  parse_payload("TEMP:45.0C", 10, &p[0]);
+  parse_payload("TEMP:55.0C", 10, &p[1]);
+  for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+    struct ruleset *set = calloc(1, sizeof(*set));
+    long long t0;
+    double ns;
+
+    set->rules = calloc(counts[c], sizeof(struct rule));
+    set->n = counts[c];
+    for (unsigned i = 0; i < set->n - 2; i++) {
+      snprintf(line, sizeof(line), "VS%05u TEMP > 50 clear 40",
+               i % BENCH_SENSORS);
+      rule_parse(line, &set->rules[i]);
+    }
+    rule_parse("* ERROR", &set->rules[set->n - 2]);
+    rule_parse("* TEMP rate 100", &set->rules[set->n - 1]);
+    __atomic_store_n(&ruleset, set, __ATOMIC_RELEASE);
+    for (int i = 0; i < 1024; i++) { // 규칙 고르기
+      sensor_write_begin(&sensors[i]);
+      rules_eval(i, &sensors[i], &p[0], 1);
+      sensor_write_end(&sensors[i]);
+    }
+    t0 = now_ns(CLOCK_MONOTONIC);
+    for (int i = 0; i < BENCH_ITERS; i++) {
+      struct sensor *sn = &sensors[i % 1024];
+      sensor_write_begin(sn);
+      rules_eval(i % 1024, sn, &p[(i >> 10) & 1], 2 + i / 1024);
+      sensor_write_end(sn);
+    }
+    ns = (double)(now_ns(CLOCK_MONOTONIC) - t0) / BENCH_ITERS;
+    BENCH_PRINT("rules: %u rules %.1f ns/sample\n", set->n, ns);
+    bench_metric("rules", c ? "many_ns" : "few_ns", ns);
+  }
+  __atomic_store_n(&ruleset, NULL, __ATOMIC_RELEASE);
+}
+
+static const struct {
+  const char *name;
+  void (*fn)();
+} BENCHES[] = {
+    {"parse", bench_parse},     {"wire", bench_wire_both},
+    {"lookup", bench_lookup},   {"log", bench_log},
+    {"publish", bench_publish}, {"rules", bench_rules},
+};
+#define BENCH_COUNT (sizeof(BENCHES) / sizeof(BENCHES[0]))
+
+// {"time":..,"iters":..,"cpus":..,"results":{"parse":{..},..}}
+void bench_print_json(void) {
+  printf("{\"time\":%ld,\"iters\":%d,\"cpus\":%ld,\"results\":{", time(NULL),
+         BENCH_ITERS, sysconf(_SC_NPROCESSORS_ONLN));
+  for (int i = 0; i < bench_nmetrics; i++) {
+    const struct bench_metric *b = &bench_metrics[i];
+    if (!i || strcmp(b->bench, bench_metrics[i - 1].bench))
+      printf("%s\"%s\":{", i ? "}," : "", b->bench);
+    else
+      printf(",");
+    printf("\"%s\":%.6g", b->key, b->value);
+  }
+  printf("%s}}\n", bench_nmetrics ? "}" : "");
+}
+
+int run_bench(const char *name) {
+  int ran = 0;
+
+  for (size_t i = 0; i < BENCH_COUNT; i++) {
+    if (strcmp(name, "all") && strcmp(name, BENCHES[i].name))
+      continue;
+    BENCHES[i].fn();
+    fflush(stdout);
+    ran++;
+  }
+  if (!ran) {
+    printf("Unknown benchmark: %s "
+           "(parse, wire, lookup, log, publish, rules, all)\n",
+           name);
+    return 1;
+  }
+  if (bench_json)
+    bench_print_json();
+  return 0;
+}
+
+// [로그 재생] 기록된 로그(log/ 세그먼트 또는 예전 글자 factory.log와 -d
+// 출력)에서 센서가 보낸 줄을 꺼내 실제 접속과 같은 길로 다시 넣는다. ID마다
+// 가짜 접속을 하나 만들고 "ID:상태\n"을 그 수신 링에 써서 conn_process부터
+// 태우므로, 줄 찾기, 채널 붙이기, 파싱, 반영, 버스(화면, 로그, 경보)까지
+// 장애 때 서버가 본 것과 똑같이 흘러간다. 답장은 /dev/null로 버린다.
+// 기록된 시각 간격을 -x 배로 줄여서 재생하고, 0(max)이면 쉬지 않고 넣는다.
+// 글자 로그는 시각이 초 단위라 같은 초의 줄은 한꺼번에 들어간다.
+// 재생하는 동안은 TCP 포트를 열지 않는다. 실제 장비가 같은 센서에 붙어
+// 명령이 가짜 접속으로 가거나, 두 스레드가 한 센서를 같이 고치는 일이 없다.
+double replay_speed = 1;        // -x
+
+struct replay {
+  struct conn **conns; // 서버 센서 인덱스별 재생 접속
+  char (*names)[SENSOR_ID_LEN]; // 세그먼트 안의 센서 인덱스 -> ID
+  unsigned names_cap;
+  long long first_ns, start_ns; // 기록상 첫 시각, 재생을 시작한 시각
+  unsigned long msgs, skipped, disconnects;
+};
+
+// 기록상 시각 when(ns)의 줄을 넣을 때가 될 때까지 잔다.
+static void replay_wait(struct replay *r, long long when) {
+  long long due, now;
+
+  if (!r->start_ns) {
+    r->first_ns = when;
+    r->start_ns = now_ns(CLOCK_MONOTONIC);
+  }
+  if (replay_speed <= 0)
+    return;
+  due = r->start_ns + (long long)((when - r->first_ns) / replay_speed);
+  // Ctrl+C에 바로 멈추도록 0.1초씩 나눠 잔다
+  while (keep_running && (now = now_ns(CLOCK_MONOTONIC)) < due) {
+    long long ns = due - now < 100000000LL ? due - now : 100000000LL;
+    struct timespec ts = {ns / 1000000000LL, ns % 1000000000LL};
+    nanosleep(&ts, NULL);
+  }
+}
+
+// 센서 하나를 흉내 내는 접속. 송신 큐는 /dev/null로 비운다.
+static struct conn *replay_conn(void) {
+  struct conn *c = calloc(1, sizeof(struct conn));
+
+  if (!c)
+    return NULL;
+  c->fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  c->epfd = -1; // epoll에 없으므로 EPOLLOUT을 켜려는 시도는 그냥 실패한다
+  c->shard = my_shard;
+  c->replay = 1;
+  pthread_mutex_init(&c->out_lock, NULL);
+  my_metrics->accepts++;
+  return c;
+}
+
+// "ID:text" 한 줄을 그 ID의 재생 접속에 받은 것처럼 처리한다.
+static void replay_msg(struct replay *r, const char *id, size_t id_len,
+                       const char *text, size_t len) {
+  int idx = sensor_lookup(id, id_len);
+  struct conn *c = idx != -1 ? r->conns[idx] : NULL;
+  char line[RBUF_SIZE];
+  unsigned n, h;
+
+  // 예전 로그에 남은 HELLO 줄은 상태가 아니므로 넣지 않는다
+  if (len >= sizeof(PROTO_HELLO) - 1 &&
+      !memcmp(text, PROTO_HELLO, sizeof(PROTO_HELLO) - 1)) {
+    r->skipped++;
+    return;
+  }
+  if (!c && !(c = replay_conn())) {
+    r->skipped++;
+    return;
+  }
+  if (id_len + 2 + len > sizeof(line))
+    len = sizeof(line) - id_len - 2;
+  n = snprintf(line, sizeof(line), "%.*s:%.*s\n", (int)id_len, id, (int)len,
+               text);
+  h = c->head & (RBUF_SIZE - 1);
+  if (h + n > RBUF_SIZE) {
+    memcpy(c->rbuf + h, line, RBUF_SIZE - h);
+    memcpy(c->rbuf, line + RBUF_SIZE - h, n - (RBUF_SIZE - h));
+  } else
+    memcpy(c->rbuf + h, line, n);
+  c->head += n;
+  read_ns = now_ns(CLOCK_MONOTONIC);
+  my_metrics->reads++;
+  my_metrics->bytes += n;
+
+  if (conn_process(c) == -1) { // 명단이 가득 차서 첫 ID부터 거절됨
+    r->skipped++;
+    if (c->nchan)
+      r->conns[c->ids[0]] = NULL;
+    close_client(c);
+    return;
+  }
+  conn_flush(c);
+  r->conns[c->ids[0]] = c;
+  r->msgs++;
+}
+
+static void replay_disconnect(struct replay *r, const char *id, size_t len) {
+  int idx = sensor_lookup(id, len);
+
+  if (idx != -1 && r->conns[idx]) {
+    close_client(r->conns[idx]);
+    r->conns[idx] = NULL;
+    r->disconnects++;
+  }
+}
+
+// 바이너리 세그먼트 하나를 재생한다. 읽기 시작할 때의 크기까지만 읽으므로
+// 지금 쓰고 있는 로그 디렉터리를 재생해도 끝이 난다.
+static void replay_segment(struct replay *r, FILE *f, long size) {
+  static char payload[65536];
+  struct seg_hdr sh;
+  struct ev_hdr h;
+
+  if (fread(&sh, sizeof(sh), 1, f) != 1)
+    return;
+  fseek(f, sh.hdr_size, SEEK_SET);
+  while (keep_running && ftell(f) < size && segment_read(f, &h, payload) == 1) {
+    const char *id = h.sensor < r->names_cap ? r->names[h.sensor] : "";
+
+    switch (h.type) {
+    case EV_REGISTER:
+      if (h.sensor == NO_SENSOR)
+        break;
+      if (h.sensor >= r->names_cap) {
+        unsigned cap = r->names_cap ? r->names_cap : 64;
+        while (cap <= h.sensor)
+          cap *= 2;
+        r->names = realloc(r->names, cap * sizeof(*r->names));
+        memset(r->names + r->names_cap, 0,
+               (cap - r->names_cap) * sizeof(*r->names));
+        r->names_cap = cap;
+      }
+      snprintf(r->names[h.sensor], SENSOR_ID_LEN, "%.*s", SENSOR_ID_LEN - 1,
+               payload);
+      break;
+    case EV_MSG:
+      if (!id[0])
+        break;
+      replay_wait(r, sh.wall_ns + (h.mono_ns - sh.mono_ns));
+      replay_msg(r, id, strlen(id), payload, h.len);
+      break;
+    case EV_DISCONNECT:
+      if (id[0])
+        replay_disconnect(r, id, strlen(id));
+      break;
+    }
+  }
+}
+
+// 글자 로그 한 파일을 재생한다. "[날짜 시각] [MSG] From ID: 상태"와
+// "[날짜 시각] [INFO] Client [ID] has been disconnected."만 본다.
+static void replay_text(struct replay *r, FILE *f, long size) {
+  char line[BUF_SIZE * 2];
+
+  while (keep_running && ftell(f) < size && fgets(line, sizeof(line), f)) {
+    struct tm tm = {0};
+    char *p, *id, *end;
+
+    if (sscanf(line, "[%d-%d-%d %d:%d:%d]", &tm.tm_year, &tm.tm_mon,
+               &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 ||
+        !(p = strstr(line, "] ")))
       continue;
+    line[strcspn(line, "\r\n")] = '\0';
+    p += 2;
+    tm.tm_year -= 1900;
+    tm.tm_mon--;
+    tm.tm_isdst = -1;
+    if (!strncmp(p, "[MSG] From ", 11) && (end = strstr(p + 11, ": "))) {
+      id = p + 11;
+      replay_wait(r, mktime(&tm) * 1000000000LL);
+      replay_msg(r, id, end - id, end + 2, strlen(end + 2));
+    } else if (!strncmp(p, "[INFO] Client [", 15) &&
+               (end = strstr(p + 15, "] has been disconnected"))) {
+      replay_disconnect(r, p + 15, end - (p + 15));
+    }
+  }
+}
+
+// 파일 하나를 재생한다. 세그먼트 헤더가 있으면 바이너리, 아니면 글자.
+static int replay_file(struct replay *r, const char *path) {
+  FILE *f = fopen(path, "rb");
+  uint32_t magic = 0;
+  long size;
+
+  if (!f)
+    return -1;
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  rewind(f);
+  if (fread(&magic, sizeof(magic), 1, f) == 1 && magic == LOG_MAGIC) {
+    rewind(f);
+    replay_segment(r, f, size);
+  } else {
+    rewind(f);
+    replay_text(r, f, size);
+  }
+  fclose(f);
+  return 0;
+}
+
+// 재생 스레드. 다 넣으면 처리량을 알리고, 남은 재생 접속은 닫는다(값은
+// 마지막 상태 그대로 남음). -j면 JSON 한 줄을 찍고 서버를 끝낸다.
+void *replay_thread(void *arg) {
+  struct replay r = {0};
+  struct dirent **names;
+  char path[512];
+  double secs;
+  int n;
+  (void)arg;
+
+  metrics_thread("replay", 0);
+  r.conns = calloc(sensor_cap, sizeof(*r.conns));
+  if ((n = scandir(replay_path, &names, is_segment, alphasort)) < 0) {
+    if (replay_file(&r, replay_path) == -1)
+      log_info("Replay: cannot open %s", replay_path);
+  } else {
+    for (int i = 0; i < n; i++) {
+      snprintf(path, sizeof(path), "%s/%s", replay_path, names[i]->d_name);
+      if (keep_running)
+        replay_file(&r, path);
+      free(names[i]);
+    }
+    free(names);
+  }
+  secs = r.start_ns ? (now_ns(CLOCK_MONOTONIC) - r.start_ns) / 1e9 : 0;
+  for (unsigned i = 0; i < sensor_cap; i++)
+    if (r.conns[i])
+      close_client(r.conns[i]);
+  free(r.conns);
+  free(r.names);
+
+  log_info("Replay of %s done: %lu messages in %.3f s (%.0f/s), "
+           "%lu disconnects, %lu skipped",
+           replay_path, r.msgs, secs, secs > 0 ? r.msgs / secs : 0,
+           r.disconnects, r.skipped);
+  if (bench_json) {
+    bench_metric("replay", "msgs", r.msgs);
+    bench_metric("replay", "seconds", secs);
+    bench_metric("replay", "msgs_per_sec", secs > 0 ? r.msgs / secs : 0);
+    bench_metric("replay", "skipped", r.skipped);
+    bench_print_json();
+    fflush(stdout);
+    keep_running = 0;
+  } else if (headless) {
+    printf("Replay done: %lu messages in %.3f s (%.0f/s), %lu disconnects, "
+           "%lu skipped\n",
+           r.msgs, secs, secs > 0 ? r.msgs / secs : 0, r.disconnects,
+           r.skipped);
+    fflush(stdout);
+  }
+  return NULL;
+}
 
-    int *new_sock = (int *)malloc(sizeof(int));
-    *new_sock = client_sock;
+void server_crashed() { keep_running = 0; }
+
+int main(int argc, char *argv[]) {
+  signal(SIGINT, server_crashed);
+  signal(SIGPIPE, SIG_IGN); // 끊긴 소켓에 write 해도 죽지 않도록
+  pthread_t t_id, ui_tid;
+  struct rlimit rl;
+  const char *bench = NULL;
+  long long t0;
+  int opt, restored, log_dir_given = 0;
+
+  while ((opt = getopt(argc, argv, "w:Pc:s:n:aF:Q:S:L:R:T:d:r:qNb:je:Hi:U:A:p:x:C:K:")) != -1) {
+    switch (opt) {
+    case 's': // 센서 명단 파일
+      sensor_file = optarg;
+      break;
+    case 'e': // 경보 규칙 파일
+      rules_file = optarg;
+      break;
+    case 'n': // 최대 등록 가능한 기계 수
+      sensor_cap = strtoul(optarg, NULL, 10);
+      if (sensor_cap < 1)
+        sensor_cap = 1;
+      break;
+    case 'a': // 명단에 없는 ID도 접속하면 등록
+      auto_register = 1;
+      break;
+    case 'F': // 로그를 디스크에 모아 쓰는 주기 (ms)
+      log_flush_ms = atoi(optarg);
+      if (log_flush_ms < 1)
+        log_flush_ms = 1;
+      break;
+    case 'L': // 로그 세그먼트 디렉터리
+      log_dir = optarg;
+      log_dir_given = 1;
+      break;
+    case 'R': // 세그먼트 최대 크기 (MB)
+      log_rotate_mb = atol(optarg);
+      if (log_rotate_mb < 1)
+        log_rotate_mb = 1;
+      break;
+    case 'T': // 세그먼트 최대 유지 시간 (초)
+      log_rotate_sec = atol(optarg);
+      if (log_rotate_sec < 1)
+        log_rotate_sec = 1;
+      break;
+    case 'd': // 바이너리 로그를 글자로 풀어서 출력하고 끝냄
+      return decode_log(optarg) == 0 ? 0 : 1;
+    case 'r': // 초당 최대 화면 갱신 횟수
+      ui_fps = atoi(optarg);
+      if (ui_fps < 1)
+        ui_fps = 1;
+      if (ui_fps > 1000)
+        ui_fps = 1000;
+      break;
+    case 'q': // 장식 애니메이션 끄기
+      ui_animations = 0;
+      break;
+    case 'N': // 인트로 건너뛰기
+      skip_intro = 1;
+      break;
+    case 'b': // 벤치마크만 돌리고 끝냄
+      bench = optarg;
+      break;
+    case 'j': // 벤치마크 결과를 JSON으로
+      bench_json = 1;
+      break;
+    case 'Q': // 로그 큐 칸 수
+      log_queue_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'S': // fsync 정책
+      if (!strcmp(optarg, "always"))
+        log_fsync = 2;
+      else if (!strcmp(optarg, "interval"))
+        log_fsync = 1;
+      else
+        log_fsync = 0;
+      break;
+    case 'H': // 화면 없이 ingest만 (통계는 표준 출력)
+      headless = 1;
+      break;
+    case 'i': // 헤드리스 통계 주기 (초)
+      stats_interval = atoi(optarg);
+      if (stats_interval < 1)
+        stats_interval = 1;
+      break;
+    case 'U': // 제어 소켓 경로
+      ctl_path = optarg;
+      break;
+    case 'A': // 돌고 있는 서버의 제어 소켓에 붙어서 UI만 띄움
+      attach_path = optarg;
+      break;
+    case 'w': // ingest 이벤트 루프 개수
+      num_workers = atoi(optarg);
+      if (num_workers < 1)
+        num_workers = 1;
+      if (num_workers > MAX_WORKERS)
+        num_workers = MAX_WORKERS;
+      break;
+    case 'C': // 체크포인트 파일
+      ckpt_path = optarg;
+      break;
+    case 'K': // 체크포인트 주기 (초, 0이면 끔)
+      ckpt_interval = atoi(optarg);
+      if (ckpt_interval < 0)
+        ckpt_interval = 0;
+      break;
+    case 'p': // 기록된 로그를 ingest로 다시 넣음
+      replay_path = optarg;
+      break;
+    case 'x': // 재생 배속 (1 = 기록된 속도, max 또는 0 = 쉬지 않고)
+      replay_speed = strcmp(optarg, "max") ? atof(optarg) : 0;
+      break;
+    case 'P': // 루프별 리스닝 소켓 + 기계 묶음별 담당 루프
+      sharded = 1;
+      break;
+    case 'c': // ingest 루프를 묶을 코어 번호 (쉼표로 구분, 돌아가며 씀)
+      for (char *p = optarg; *p && num_pin_cores < MAX_WORKERS; p++) {
+        pin_cores[num_pin_cores++] = (int)strtol(p, &p, 10);
+        if (*p != ',')
+          break;
+      }
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-w workers] [-P] [-c cpu,cpu..] [-s sensors.conf] [-e rules.conf] "
+              "[-n max_sensors]\n"
+              "       [-a] [-F flush_ms] [-Q log_queue] "
+              "[-S none|interval|always]\n"
+              "       [-L log_dir] [-R rotate_mb] [-T rotate_sec] [-r fps] "
+              "[-q] [-N]\n"
+              "       [-H] [-i stats_sec] [-U control_socket] "
+              "[-C checkpoint] [-K checkpoint_sec]\n"
+              "       [-p log_dir|segment|factory.log [-x speed|max] [-j]]\n"
+              "       %s -b parse|wire|lookup|log|publish|rules|all [-j]  (벤치마크)\n"
+              "       %s -d log_dir|segment  (로그를 글자로 풀어 출력)\n"
+              "       %s -A control_socket  (돌고 있는 서버에 UI만 붙임)\n",
+              argv[0], argv[0], argv[0], argv[0]);
+      exit(1);
+    }
+  }
+  if (bench)
+    return run_bench(bench);
+  if (replay_path) {
+    // 재생한 보고가 실제 로그나 체크포인트에 진짜 상태처럼 남지 않게, -L을
+    // 주지 않았으면 임시 디렉터리에 쓰고 체크포인트는 끈다.
+    static char scratch[] = "/tmp/factory-replay-XXXXXX";
+    ckpt_interval = 0;
+    if (!log_dir_given) {
+      if (!mkdtemp(scratch)) {
+        perror("replay log directory");
+        exit(1);
+      }
+      log_dir = scratch;
+    }
+    printf("Replay log: %s (checkpoint off)\n", log_dir);
+  }
+
+  // 수천 개의 접속을 받으려면 fd 제한을 최대로 올려둔다.
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  if (attach_path) { // 화면만: 명단과 상태는 제어 소켓으로 받는다
+    if (attach_open() == -1)
+      exit(1);
+#ifdef USE_AUDIO
+    audio_start();
+#endif
+    sensor_alloc(); // 명단은 서버에서 받아 온다
+    ui_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_create(&t_id, NULL, attach_thread, NULL);
+    pthread_detach(t_id);
+    draw_ui_thread(NULL);
+    return 0;
+  }
+
+#ifdef USE_AUDIO
+  if (!headless)
+    audio_start();
+#endif
+  srand(time(NULL));
+  sensor_init();
+  signal(SIGHUP, sensor_reload_requested);
+
+  // 소켓 생성 및 설정 (논블로킹: 여러 루프가 같이 accept 함). -P면 루프마다
+  // 같은 포트에 SO_REUSEPORT 소켓을 하나씩 연다. -p로 재생할 때는 열지 않는다.
+  for (int i = 0; !replay_path && i < num_workers; i++) {
+    listen_fds[i] = i && !sharded ? server_sock : open_listener();
+    if (!i)
+      server_sock = listen_fds[0];
+    if ((ingest_epfd[i] = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+      perror("epoll_create1 error");
+      exit(1);
+    }
+  }
+  // 포트를 잡은 뒤에 연다. 포트가 이미 쓰이는 중이라 곧 끝날 서버가
+  // 다른 서버의 체크포인트를 덮어쓰지 않게.
+  t0 = now_ns(CLOCK_MONOTONIC);
+  restored = ckpt_open(); // 지난 실행의 마지막 값을 먼저 보여 준다
+  t0 = now_ns(CLOCK_MONOTONIC) - t0;
+  start_ns = now_ns(CLOCK_MONOTONIC);
+  log_init();
+  log_event(EV_START, -1, NULL, 0);
+  if (ckpt_map) {
+    log_info("Checkpoint %s: restored %d sensors in %.1f ms", ckpt_path,
+             restored, t0 / 1e6);
+    if (headless)
+      printf("Checkpoint %s: restored %d sensors in %.1f ms\n", ckpt_path,
+             restored, t0 / 1e6);
+    pthread_create(&t_id, NULL, ckpt_thread, NULL);
+    pthread_detach(t_id);
+  }
+  ctl_open();
+  ruleset = rules_load(rules_file, stdout);
+  bus_subscribe("log", BUS_LOG_MASK, BUS_DIRECT, 0, log_deliver);
+  pthread_create(&t_id, NULL, alerts_thread, NULL);
+  pthread_detach(t_id);
 
-    pthread_mutex_lock(&lock);
+  if (headless) {
+    // 화면이 없으니 ui_event_fd도 만들지 않는다 (ui_notify가 바로 돌아감)
+    pthread_create(&ui_tid, NULL, stats_thread, NULL);
+  } else {
+    ui_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    bus_subscribe("ui", BUS_UI_MASK, BUS_DIRECT, 0, ui_deliver);
 
-    gettime_log();
-    snprintf(log_buffer, LOG_SIZE,
-             "[%s] [INFO] New client has tried to connect. Check the "
-             "log right below for conformation.\n",
-             time_buffer);
-    write(log_fd, log_buffer, strlen(log_buffer));
+    // [핵심] UI 스레드 별도 실행
+    pthread_create(&ui_tid, NULL, draw_ui_thread, NULL);
+  }
+  pthread_detach(ui_tid);
+  if (replay_path) {
+    // 재생은 메인 스레드가 맡는다. 끝난 뒤에는 화면을 닫거나 Ctrl+C로
+    // UI(또는 통계) 스레드가 server_stop을 부를 때까지 기다린다.
+    replay_thread(NULL);
+    while (1)
+      pause();
+  }
 
-    pthread_mutex_unlock(&lock);
-    // 클라이언트마다 작업 스레드 생성
-    pthread_create(&t_id, NULL, handle_client, (void *)new_sock);
+  // ingest 루프는 고정 개수만 띄우고, 메인 스레드도 그 중 하나를 맡는다.
+  for (int i = 1; i < num_workers; i++) {
+    pthread_create(&t_id, NULL, ingest_loop, (void *)(intptr_t)i);
     pthread_detach(t_id);
   }
+  ingest_loop(NULL);
 
-  close(server_sock);
+  for (int i = 0; i < (sharded ? num_workers : 1); i++)
+    close(listen_fds[i]);
   return 0;
-}
\ No newline at end of file
+}